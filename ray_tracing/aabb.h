@@ -36,6 +36,20 @@ class aabb {
             return true;
         }
 
+        // Narrows [t_min, t_max] to where r is inside the box; false if it never is.
+        bool clip(const ray& r, double& t_min, double& t_max) const {
+            for (int a = 0; a < 3; a++) {
+                auto inv_d = 1 / r.direction()[a];
+                auto t0 = (minimum[a] - r.origin()[a]) * inv_d;
+                auto t1 = (maximum[a] - r.origin()[a]) * inv_d;
+                if (inv_d < 0)
+                    std::swap(t0, t1);
+                t_min = fmax(t0, t_min);
+                t_max = fmin(t1, t_max);
+            }
+            return t_min < t_max;
+        }
+
         double area() const {
             auto a = maximum.x() - minimum.x();
             auto b = maximum.y() - minimum.y();
@@ -72,5 +86,9 @@ aabb surrounding_box(aabb box0, aabb box1) {
     return aabb(small,big);
 }
 
+aabb lerp(const aabb& box0, const aabb& box1, double t) {
+    return aabb((1-t)*box0.min() + t*box1.min(), (1-t)*box0.max() + t*box1.max());
+}
+
 
 #endif
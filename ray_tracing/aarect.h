@@ -35,6 +35,7 @@ class xy_rect : public hittable {
 
     public:
         shared_ptr<material> mp;
+        int light = -1;     // its number in the scene's light_set, if it is one
         double x0, x1, y0, y1, k;
 };
 
@@ -57,6 +58,7 @@ class xz_rect : public hittable {
 
     public:
         shared_ptr<material> mp;
+        int light = -1;     // its number in the scene's light_set, if it is one
         double x0, x1, z0, z1, k;
 };
 
@@ -79,6 +81,7 @@ class yz_rect : public hittable {
 
     public:
         shared_ptr<material> mp;
+        int light = -1;     // its number in the scene's light_set, if it is one
         double y0, y1, z0, z1, k;
 };
 
@@ -97,6 +100,8 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.t = t;
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
+    rec.footprint = cone_footprint(r, t, outward_normal, 1 / fmin(x1-x0, y1-y0));
+    rec.light = light;
     rec.mat_ptr = mp;
     rec.p = r.at(t);
 
@@ -118,6 +123,8 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.t = t;
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
+    rec.footprint = cone_footprint(r, t, outward_normal, 1 / fmin(x1-x0, z1-z0));
+    rec.light = light;
     rec.mat_ptr = mp;
     rec.p = r.at(t);
 
@@ -139,6 +146,8 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.t = t;
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
+    rec.footprint = cone_footprint(r, t, outward_normal, 1 / fmin(y1-y0, z1-z0));
+    rec.light = light;
     rec.mat_ptr = mp;
     rec.p = r.at(t);
 
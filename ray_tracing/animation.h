@@ -0,0 +1,175 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "rtweekend.h"
+
+#include "arena.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "mat.h"
+#include "material.h"
+#include "scene.h"
+#include "triangle.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Keyframed transforms of the teapot instances, for rendering a sequence of frames in one
+// process (-a). The file has a line per key:
+//
+//     frame instance m00 m01 m02 m03 m10 ... m33
+//
+// the instance numbered in the order of the command line and the position matrix row major,
+// as in the matrix files; lines starting with # are comments. The normal matrix is the inverse
+// transpose of the position matrix. Between keys the matrices are interpolated linearly,
+// which is exact for translation and scale and close enough for rotations keyed every few
+// degrees; before its first key and after its last an instance stays where that key put it.
+struct keyframe {
+    double frame;
+    mat4 pos;
+};
+
+class animation {
+    public:
+        bool load(const std::string& file, std::string& error);
+
+        // Frames 0 to the last key.
+        int frames() const { return last_frame + 1; }
+        bool animated(int instance) const { return keys.count(instance) > 0; }
+
+        // The transforms of instance at frame, which need not be a whole number.
+        void transform(int instance, double frame, mat4 pos, mat3 norm) const;
+
+    public:
+        std::map<int, std::vector<keyframe>> keys;      // by instance, in order of frame
+        int last_frame = 0;
+};
+
+
+bool animation::load(const std::string& file, std::string& error) {
+    std::ifstream in(file);
+    if (!in) {
+        error = "cannot read " + file;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(in, line); number++) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        keyframe key;
+        int instance;
+        fields >> key.frame >> instance;
+        for (int k = 0; k < 16; k++)
+            fields >> key.pos[k / 4][k % 4];
+        if (!fields || key.frame < 0 || instance < 0) {
+            error = file + ":" + std::to_string(number) + ": expected frame, instance and 16 numbers";
+            return false;
+        }
+        keys[instance].push_back(key);
+        last_frame = std::max(last_frame, static_cast<int>(std::ceil(key.frame)));
+    }
+    for (auto& entry : keys)
+        std::stable_sort(entry.second.begin(), entry.second.end(),
+                         [](const keyframe& x, const keyframe& y) { return x.frame < y.frame; });
+    return true;
+}
+
+
+void animation::transform(int instance, double frame, mat4 pos, mat3 norm) const {
+    const std::vector<keyframe>& list = keys.at(instance);
+    auto next = std::upper_bound(list.begin(), list.end(), frame,
+                                 [](double f, const keyframe& key) { return f < key.frame; });
+    const keyframe& k0 = next == list.begin() ? list.front() : *(next - 1);
+    const keyframe& k1 = next == list.end() ? list.back() : *next;
+    double s = k1.frame > k0.frame ? (frame - k0.frame) / (k1.frame - k0.frame) : 0;
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            pos[i][j] = (1 - s) * k0.pos[i][j] + s * k1.pos[i][j];
+
+    // Inverse transpose of the upper 3x3: its cofactors over its determinant.
+    auto m = [&](int i, int j) { return pos[i % 3][j % 3]; };
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            norm[i][j] = m(i+1, j+1) * m(i+2, j+2) - m(i+1, j+2) * m(i+2, j+1);
+    double det = pos[0][0] * norm[0][0] + pos[0][1] * norm[0][1] + pos[0][2] * norm[0][2];
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            norm[i][j] /= det;
+}
+
+
+// An instance of a mesh that moves from frame to frame: move() updates its triangles in place
+// and refits its BVH. With motion blur the triangles move during the frame too, and the
+// nodes of the BVH keep their boxes at the start and the end of the shutter, so a ray tests
+// the box of its own time instead of one around the whole sweep.
+class animated_instance {
+    public:
+        animated_instance(hittable_list& objects, const mesh& shape, shared_ptr<material> m,
+                          int id, arena& pool, bool motion_blur, mat4 pos, mat3 norm);
+
+        // Places the mesh by pos and norm at the start of the shutter and by pos1 and norm1
+        // at its end (the same without motion blur).
+        void move(mat4 pos, mat3 norm, mat4 pos1, mat3 norm1);
+
+    public:
+        int id;
+
+    private:
+        const mesh* shape;
+        bool motion_blur;
+        std::vector<triangle*> triangles;       // in the order of the mesh
+        bvh_node* bvh;
+};
+
+
+animated_instance::animated_instance(hittable_list& objects, const mesh& shape,
+                                     shared_ptr<material> m, int id, arena& pool,
+                                     bool motion_blur, mat4 pos, mat3 norm)
+    : id(id), shape(&shape), motion_blur(motion_blur) {
+    hittable_list instance;
+    bool two_sided = dynamic_cast<dielectric*>(m.get()) != nullptr;
+    for (int i = 0; i < shape.triangles(); i++) {
+        vec3 p[3], n[3], face_norm;
+        transform_triangle(shape, i, pos, norm, p, n, face_norm);
+        shared_ptr<triangle> tri;
+        if (motion_blur)
+            tri = pool.make<moving_triangle>(arena::primitives, p[0], p[1], p[2], n[0], n[1], n[2],
+                                             face_norm, m, two_sided);
+        else
+            tri = pool.make<triangle>(arena::primitives, p[0], p[1], p[2], n[0], n[1], n[2],
+                                      face_norm, m, two_sided);
+        triangles.push_back(tri.get());
+        instance.add(tri);
+    }
+    auto node = pool.make<bvh_node>(arena::bvh_nodes, instance, 0, 0, &pool);
+    bvh = node.get();
+    objects.add(pool.make<instance_id>(arena::other, node, id));
+}
+
+
+void animated_instance::move(mat4 pos, mat3 norm, mat4 pos1, mat3 norm1) {
+    for (size_t i = 0; i < triangles.size(); i++) {
+        triangle* tri = triangles[i];
+        vec3 p[3], n[3];
+        transform_triangle(*shape, i, pos, norm, p, n, tri->norm);
+        tri->a = p[0], tri->b = p[1], tri->c = p[2];
+        tri->n_a = n[0], tri->n_b = n[1], tri->n_c = n[2];
+        if (motion_blur) {
+            auto moving = static_cast<moving_triangle*>(tri);
+            vec3 face_norm;
+            transform_triangle(*shape, i, pos1, norm1, p, n, face_norm);
+            moving->a1 = p[0], moving->b1 = p[1], moving->c1 = p[2];
+            moving->n_a1 = n[0], moving->n_b1 = n[1], moving->n_c1 = n[2];
+        }
+    }
+    bvh->refit();
+}
+
+
+#endif
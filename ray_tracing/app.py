@@ -1,52 +1,163 @@
 from time import sleep
 import flask
+import json
+import math
 import os
+import time
 from flask import Flask, Response, send_from_directory
 from flask_cors import CORS, cross_origin
 from flask import request
 from flask import  send_file
+from render_cache import CacheEntry, RESOLUTION, RenderCache, scene_key
+from scheduler import (RenderJob, RenderScheduler, STREAM_IMAGE, STREAM_STATS, scene_items,
+                       stream_message)
 
 app = Flask(__name__, static_folder='B08902087_hw1', static_url_path='')
-CORS(app)
+CORS(app, expose_headers=['X-Samples-Per-Pixel', 'X-Cache', 'X-Render-Stats', 'X-Encode-Ms',
+                          'X-Queue-Ms', 'X-Service-Ms', 'X-Job-State'])
+
+# Every render gets a deadline, time_budget seconds after the request came in, so a large
+# samples_per_pixel can't block the server: its slices stop adding passes when the next one
+# would miss it. Only min_samples_per_pixel are rendered past it, and at most this many.
+DEFAULT_TIME_BUDGET = 10.0
+MIN_TIME_BUDGET = 0.1
+MAX_TIME_BUDGET = 60.0
+MAX_MIN_SAMPLES_PER_PIXEL = 16
+
+# Finished renders by scene, bounded by a memory budget (bytes).
+cache = RenderCache(int(os.environ.get('RENDER_CACHE_BYTES', 512 * 1024 * 1024)))
+
+# Image formats a.out can encode (-e), by the MIME type they are sent as. PNG is the default:
+# a tenth of the size of P3 and shown by every browser.
+IMAGE_TYPES = {'png': 'image/png', 'qoi': 'image/qoi', 'ppm': 'image/x-portable-pixmap'}
+STREAM_TYPE = 'application/x-tile-stream'
+
+def image_response(image, image_format, samples_per_pixel, cache_status):
+    response = Response(image, mimetype=IMAGE_TYPES[image_format])
+    response.headers['X-Samples-Per-Pixel'] = str(samples_per_pixel)
+    response.headers['X-Cache'] = cache_status
+    return response
 
 @app.route('/')
 @cross_origin()
 def serve():
     return send_from_directory(app.static_folder, 'index.html')
 
+def cache_result(job):
+    # Cancelled jobs too: the samples they got are as good as any.
+    if job.checkpoint is not None and job.image:
+        variant = (job.options['format'], job.options['denoise'])
+        cache.put(job.key, CacheEntry(job.samples_per_pixel, job.checkpoint, {variant: job.image},
+                                      job.gbuffer))
+
+# Renders run as time slices on a pool of a.out workers (scheduler.py), interactive previews
+# ahead of batch renders; when the queue is full requests get 503.
+scheduler = RenderScheduler(workers=int(os.environ.get('RENDER_WORKERS', 2)),
+                            queue_limit=int(os.environ.get('RENDER_QUEUE', 16)),
+                            slice_seconds=float(os.environ.get('RENDER_SLICE_SECONDS', 2.0)),
+                            on_finish=cache_result)
+
+def job_timings(job, received, first_pixel=None):
+    timings = {'queue_ms': job.queue_delay() * 1000, 'service_ms': job.service * 1000,
+               'slices': job.slices, 'state': job.state,
+               'total_ms': (time.monotonic() - received) * 1000}
+    if first_pixel is not None:
+        timings['time_to_first_pixel_ms'] = first_pixel * 1000
+    return timings
+
+def stream_render(job, received):
+    # Tiles are passed on as the slices send them; a last stats message (kind 3) adds the
+    # server's timings as JSON.
+    first_pixel = None
+    try:
+        while True:
+            message = job.messages.get()
+            if message is None:
+                break
+            if first_pixel is None:
+                first_pixel = time.monotonic() - received
+            yield message
+    finally:
+        # The client went away: nobody waits for the rest.
+        if not job.done.is_set():
+            scheduler.cancel(job)
+    timings = job_timings(job, received, first_pixel)
+    timings.update(job.headers)
+    print(f"streamed render: {timings}")
+    yield stream_message(STREAM_STATS, 0, 0, job.samples_per_pixel, json.dumps(timings).encode())
+
 @app.route('/render',  methods = ['POST'])
 @cross_origin()
 def render():
     if request.is_json:
+        received = time.monotonic()
         json_data = request.get_json()
         renderData = json_data['renderData']
-        samples_per_pixel = json_data['samples_per_pixel']
-        num_item = len(renderData)
-
-        for i in range(num_item):
-            mvMat =  renderData[i]['mvMatrix']
-            norm_mat =  renderData[i]['mvNormalMatrix']
-
-            with open(f"mv_mat_{i}.txt", 'w') as f:
-                for j in range(0, 4):
-                    f.write(f"{mvMat[j]} {mvMat[j + 4]} {mvMat[j + 8]} {mvMat[j + 12]}\n")
-            
-            with open(f"norm_mat_{i}.txt", 'w') as f:
-                for j in range(0, 3):
-                    f.write(f"{norm_mat[j]} {norm_mat[j + 3]} {norm_mat[j + 6]}\n")
-                    
-        pos_mat_norm_mat_material = ' '.join([ f"mv_mat_{i}.txt norm_mat_{i}.txt {renderData[i]['meterial']}" for i in range(num_item)])
-        res = os.system(f"./a.out {samples_per_pixel} {num_item} {pos_mat_norm_mat_material} > out.ppm")
-
-        print(res)
-        print(f"./a.out {samples_per_pixel} {num_item} {pos_mat_norm_mat_material} > out.ppm")
-        
-        if res == 0:
-            return send_file('./out.ppm')
-        else:
+        # a.out takes a budget of 0 or less as no deadline at all.
+        time_budget = float(json_data.get('time_budget', DEFAULT_TIME_BUDGET))
+        if not math.isfinite(time_budget):
+            return Response(status=400)
+        samples_per_pixel = int(json_data['samples_per_pixel'])
+        min_samples_per_pixel = int(json_data.get('min_samples_per_pixel', 1))
+        options = {
+            'samples_per_pixel': samples_per_pixel,
+            'time_budget': min(max(time_budget, MIN_TIME_BUDGET), MAX_TIME_BUDGET),
+            'min_samples_per_pixel': max(1, min(min_samples_per_pixel, samples_per_pixel,
+                                                MAX_MIN_SAMPLES_PER_PIXEL)),
+            'stats': bool(json_data.get('stats', False)),
+            'denoise': bool(json_data.get('denoise', False)),
+            'format': json_data.get('format', 'png'),
+            # Send the tiles as they are rendered (tile_stream.h) instead of the image at the end.
+            'stream': bool(json_data.get('stream', False)),
+        }
+        if options['format'] not in IMAGE_TYPES:
+            return Response(status=400)
+
+        key = scene_key(renderData)
+        # The scene this session (page) asked for before, usually this one with a teapot moved.
+        history = cache.history(json_data.get('session'), key)
+        cached = cache.get(key)
+        image = cached.image(options['format'], options['denoise']) if cached is not None else b''
+        if image and cached.samples_per_pixel >= options['samples_per_pixel']:
+            if options['stream']:
+                timings = {'queue_ms': 0, 'time_to_first_pixel_ms': (time.monotonic() - received) * 1000,
+                           'total_ms': (time.monotonic() - received) * 1000, 'X-Cache': 'hit'}
+                return Response([stream_message(STREAM_IMAGE, *RESOLUTION, cached.samples_per_pixel, image),
+                                 stream_message(STREAM_STATS, 0, 0, cached.samples_per_pixel,
+                                                json.dumps(timings).encode())],
+                                mimetype=STREAM_TYPE)
+            return image_response(image, options['format'], cached.samples_per_pixel, 'hit')
+        if (cached is not None and options['denoise']
+                and cached.samples_per_pixel >= options['samples_per_pixel']):
+            # The denoiser is guided by the AOVs of the passes a render traces, and resuming the
+            # checkpoint to encode it again traces none: trace one more.
+            options['samples_per_pixel'] = cached.samples_per_pixel + 1
+
+        # 'interactive' previews are scheduled ahead of 'batch' renders. A render from the same
+        # session (page) cancels the one before, whose scene is out of date.
+        job = RenderJob(key, scene_items(renderData), options, json_data.get('priority', 'interactive'),
+                        json_data.get('session'), cached, history)
+        if not scheduler.submit(job):
+            response = Response(status=503)
+            response.headers['Retry-After'] = str(int(scheduler.slice_seconds) + 1)
+            return response
+        if options['stream']:
+            return Response(stream_render(job, received), mimetype=STREAM_TYPE)
+
+        job.done.wait()
+        if job.state == 'cancelled' and not job.image:
+            return Response(status=409)
+        if job.state == 'failed' or not job.image:
             return Response(status=400)
+        response = image_response(job.image, options['format'], job.samples_per_pixel, job.headers['X-Cache'])
+        response.headers.update({k: v for k, v in job.headers.items() if k != 'X-Cache'})
+        timings = job_timings(job, received)
+        response.headers['X-Queue-Ms'] = str(timings['queue_ms'])
+        response.headers['X-Service-Ms'] = str(timings['service_ms'])
+        response.headers['X-Job-State'] = job.state
+        return response
     else:
         return  Response(status=400)
 
 if __name__ == '__main__':
-    app.run()
\ No newline at end of file
+    app.run(threaded=True)
\ No newline at end of file
@@ -0,0 +1,129 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "rtweekend.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// Monotonic allocator for the objects of a scene. Objects are placed one after the other in
+// large blocks and are never freed one by one; reset() frees the whole scene with one free()
+// per block. make() hands objects out as shared_ptrs that alias an empty owner, so they fit
+// the hittable and material interfaces, but they own nothing: copying one (a hit_record's
+// mat_ptr, say) doesn't touch a reference count, and they must not outlive the arena.
+class arena {
+    public:
+        enum category { primitives, bvh_nodes, materials, other, category_count };
+
+        arena(size_t block_size = 1 << 16) : block_size(block_size) {}
+        ~arena() { reset(); }
+
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        void* allocate(size_t size, size_t align, category c);
+
+        template <class T, class... Args>
+        shared_ptr<T> make(category c, Args&&... args) {
+            T* object = new (allocate(sizeof(T), alignof(T), c)) T(std::forward<Args>(args)...);
+            if (!std::is_trivially_destructible<T>::value) {
+                auto d = new (allocate(sizeof(destructor), alignof(destructor), c)) destructor;
+                d->destroy = [](void* p) { static_cast<T*>(p)->~T(); };
+                d->object = object;
+                d->next = destructors;
+                destructors = d;
+            }
+            objects[c]++;
+            return shared_ptr<T>(shared_ptr<T>(), object);
+        }
+
+        // Destroys every object and frees the blocks.
+        void reset();
+
+        size_t bytes(category c) const { return used[c]; }
+        size_t count(category c) const { return objects[c]; }
+        size_t reserved() const { return reserved_bytes; }
+        void report(std::ostream& out) const;
+
+    private:
+        struct destructor {
+            void (*destroy)(void*);
+            void* object;
+            destructor* next;
+        };
+
+        size_t block_size;
+        std::vector<char*> blocks;
+        char* cursor = nullptr;
+        char* limit = nullptr;
+        destructor* destructors = nullptr;
+        size_t used[category_count] = {};
+        size_t objects[category_count] = {};
+        size_t reserved_bytes = 0;
+};
+
+
+void* arena::allocate(size_t size, size_t align, category c) {
+    char* p = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(cursor) + align - 1) & ~(align - 1));
+    if (!cursor || p + size > limit) {
+        size_t capacity = std::max(block_size, size + align);
+        char* block = static_cast<char*>(std::malloc(capacity));
+        if (!block)
+            throw std::bad_alloc();
+        blocks.push_back(block);
+        reserved_bytes += capacity;
+        limit = block + capacity;
+        p = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(block) + align - 1) & ~(align - 1));
+    }
+    cursor = p + size;
+    used[c] += size;
+    return p;
+}
+
+
+void arena::reset() {
+    for (destructor* d = destructors; d; d = d->next)
+        d->destroy(d->object);
+    for (char* block : blocks)
+        std::free(block);
+    blocks.clear();
+    cursor = limit = nullptr;
+    destructors = nullptr;
+    for (int c = 0; c < category_count; c++)
+        used[c] = objects[c] = 0;
+    reserved_bytes = 0;
+}
+
+
+void arena::report(std::ostream& out) const {
+    static const char* names[category_count] = {"primitives", "bvh nodes", "materials", "other"};
+    auto kib = [](size_t bytes) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.1f KiB", bytes / 1024.0);
+        return std::string(text);
+    };
+    out << "Scene memory:";
+    for (int c = 0; c < category_count; c++)
+        if (objects[c])
+            out << " " << names[c] << " " << kib(used[c]) << " (" << objects[c] << "),";
+    out << " " << kib(reserved_bytes) << " reserved.\n";
+}
+
+
+// Allocates in pool when there is one, on the heap otherwise.
+template <class T, class... Args>
+shared_ptr<T> make_in(arena* pool, arena::category c, Args&&... args) {
+    if (pool)
+        return pool->make<T>(c, std::forward<Args>(args)...);
+    return make_shared<T>(std::forward<Args>(args)...);
+}
+
+
+#endif
@@ -0,0 +1,995 @@
+// Micro and macro benchmarks of the renderer.
+//
+//   g++ -O2 -o bench bench.cpp -lpthread -lz
+//   ./bench [-f filter] [-o results.json] [-s spp] [-t seconds] [-r repeats] [-j threads]
+//
+// Every benchmark runs -r times and keeps the fastest run; a micro benchmark repeats its
+// operation until the run has taken -t seconds. Scenes, rays and sample sequences are seeded
+// with fixed values, so two builds run exactly the same work; the renders also report a
+// checksum of the image. Approximations also report their largest error against the exact
+// result, and the run fails if it is beyond their bound. Results go to stdout (or -o) as
+// JSON, compare two result files with bench_compare.py.
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "animation.h"
+#include "bvh.h"
+#include "box.h"
+#include "camera.h"
+#include "constant_medium.h"
+#include "denoise.h"
+#include "environment.h"
+#include "framebuffer.h"
+#include "grid_medium.h"
+#include "image_codec.h"
+#include "image_texture.h"
+#include "lights.h"
+#include "material.h"
+#include "perlin.h"
+#include "sampler.h"
+#include "scene.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "visibility.h"
+
+#include <sys/resource.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+struct bench_result {
+    std::string name;
+    std::string unit;               // what one op is: a ray, a build, a sample...
+    uint64_t ops;
+    double ns_per_op;
+    long peak_rss_kb;
+    double checksum;
+    bool has_checksum;
+    double max_error = -1;          // of an approximation, against the exact result (-1: none)
+    double error_bound = 0;         // the most max_error may be
+};
+
+std::string filter;
+double min_time = 0.2;
+int repeats = 3;
+int spp = 4;
+int thread_count = 16;
+std::vector<bench_result> results;
+int inaccurate = 0;                 // approximations beyond their bounds
+volatile double sink;               // keeps the measured work from being optimized away
+
+long peak_rss_kb() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+bool selected(const std::string& name) {
+    return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+// Times batch(), which does ops_per_batch operations, and records the fastest of the repeats.
+void run(const std::string& name, const std::string& unit, uint64_t ops_per_batch,
+         const std::function<double()>& batch, bool timed_batches = true) {
+    if (!selected(name))
+        return;
+    double best = infinity;
+    uint64_t ops = 0;
+    double checksum = batch();      // warm up
+    for (int r = 0; r < repeats; r++) {
+        uint64_t batches = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed;
+        do {
+            checksum = batch();
+            batches++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (timed_batches && elapsed < min_time);
+        best = std::min(best, elapsed * 1e9 / (batches * ops_per_batch));
+        ops += batches * ops_per_batch;
+    }
+    sink = checksum;
+    results.push_back({name, unit, ops, best, peak_rss_kb(), checksum, !timed_batches});
+    std::cerr << name << ": " << best << " ns/" << unit << ", "
+              << 1e9 / best << " " << unit << "s/s\n";
+}
+
+
+// Attaches the largest error of the approximation name measured against the exact result; an
+// error beyond bound fails the run.
+void record_error(const std::string& name, double max_error, double bound) {
+    if (!selected(name))
+        return;
+    for (auto& r : results)
+        if (r.name == name)
+            r.max_error = max_error, r.error_bound = bound;
+    bool within = max_error <= bound;
+    inaccurate += !within;
+    std::cerr << name << ": max error " << max_error << (within ? " within " : " BEYOND ")
+              << bound << "\n";
+}
+
+
+// Scene
+
+struct teapot_instance {
+    double scale;
+    vec3 offset;
+    int material;
+};
+
+// The instances of the renderer's default scenes, built in so that the benchmark doesn't
+// depend on the matrix files app.py rewrites.
+const teapot_instance metal_teapot = {-3.45, vec3(-40, 0, -160), 0};
+const teapot_instance glass_teapot = { 3.45, vec3( 40, 0, -160), 1};
+const teapot_instance small_teapot = { 2.30, vec3(  0, -40, -230), 2};
+
+void instance_matrices(const teapot_instance& t, mat4 pos, mat3 norm) {
+    // Mirrored instances (negative scale) are also turned around the y axis, as in the UI.
+    mat4 p = {{t.scale, 0, 0, t.offset.x()},
+              {0, std::fabs(t.scale), 0, t.offset.y()},
+              {0, 0, t.scale, t.offset.z()},
+              {0, 0, 0, 1}};
+    mat3 n = {{1 / t.scale, 0, 0}, {0, 1 / std::fabs(t.scale), 0}, {0, 0, 1 / t.scale}};
+    std::copy(&p[0][0], &p[0][0] + 16, &pos[0][0]);
+    std::copy(&n[0][0], &n[0][0] + 9, &norm[0][0]);
+}
+
+void add_instance(hittable_list& objects, const teapot_instance& t) {
+    mat4 pos;
+    mat3 norm;
+    instance_matrices(t, pos, norm);
+    add_teapot(objects, pos, norm, materials[t.material]);
+}
+
+// Hides the motion of a moving object from the BVH, which then bounds it by its whole sweep.
+class swept : public hittable {
+    public:
+        swept(shared_ptr<hittable> p) : ptr(p) {}
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return ptr->hit(r, t_min, t_max, rec);
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            return ptr->bounding_box(time0, time1, output_box);
+        }
+
+    public:
+        shared_ptr<hittable> ptr;
+};
+
+// Hides all of an object but hit() and its box: how a boundary finds where a ray is inside it
+// in one query, so media fall back to intersecting the ray with it twice, and a medium's
+// transmittance(), so shadow rays fall back to its delta-tracked hit.
+class two_hit_boundary : public hittable {
+    public:
+        two_hit_boundary(shared_ptr<hittable> p) : ptr(p) {}
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return ptr->hit(r, t_min, t_max, rec);
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            return ptr->bounding_box(time0, time1, output_box);
+        }
+
+    public:
+        shared_ptr<hittable> ptr;
+};
+
+void collect_leaves(const shared_ptr<hittable>& node, std::vector<shared_ptr<hittable>>& leaves) {
+    auto inner = std::dynamic_pointer_cast<bvh_node>(node);
+    if (!inner) {
+        leaves.push_back(node);
+        return;
+    }
+    collect_leaves(inner->left, leaves);
+    if (inner->right != inner->left)
+        collect_leaves(inner->right, leaves);
+}
+
+camera scene_camera() {
+    return camera(point3(0, 0, 200), point3(0, 0, -400), vec3(0, 1, 0), 40, 1.0, 0.0, 10.0, 0.0, 1.0);
+}
+
+// Rays from random points of the Cornell box towards random points of the target box.
+std::vector<ray> rays_towards(const aabb& target, int count) {
+    std::vector<ray> rays;
+    for (int k = 0; k < count; k++) {
+        point3 origin(random_double(-100, 100), random_double(-100, 100), random_double(-300, 0));
+        point3 to(random_double(target.min().x(), target.max().x()),
+                  random_double(target.min().y(), target.max().y()),
+                  random_double(target.min().z(), target.max().z()));
+        rays.push_back(ray(origin, unit_vector(to - origin)));
+    }
+    return rays;
+}
+
+
+// Renders
+
+struct render_job {
+    const hittable* world;
+    const camera* cam;
+    int width, height, thread;
+    std::vector<color>* pixels;
+    const light_set* lights;
+    uint64_t seed;
+    const environment* background;
+};
+
+void* render_rows(void* arg) {
+    auto job = static_cast<render_job*>(arg);
+    thread_sampler = make_sampler("sobol");
+    thread_sampler->seed = job->seed;
+    for (int j = job->thread; j < job->height; j += thread_count) {
+        for (int i = 0; i < job->width; i++) {
+            color sum(0, 0, 0);
+            for (int s = 0; s < spp; s++) {
+                double du, dv;
+                thread_sampler->start_sample(i, j, s);
+                thread_sampler->get_2d(du, dv);
+                ray r = job->cam->get_ray((i + du) / (job->width - 1), (j + dv) / (job->height - 1));
+                sum += ray_color(r, *job->background, *job->world, 50, nullptr, nullptr,
+                                 job->lights);
+            }
+            (*job->pixels)[j * job->width + i] = sum;
+        }
+    }
+    delete thread_sampler;
+    thread_sampler = nullptr;
+    return nullptr;
+}
+
+// The sums of spp samples of each pixel of a 400x400 image of world, sampled with seed.
+std::vector<color> render_image(const hittable& world, const light_set* lights, uint64_t seed,
+                                const environment& background = environment()) {
+    camera cam = scene_camera();
+    const int width = 400, height = 400;
+    cam.set_resolution(height);
+    std::vector<color> pixels(width * height);
+    std::vector<pthread_t> threads(thread_count);
+    std::vector<render_job> jobs(thread_count);
+    for (int t = 0; t < thread_count; t++) {
+        jobs[t] = {&world, &cam, width, height, t, &pixels, lights, seed, &background};
+        pthread_create(&threads[t], NULL, render_rows, &jobs[t]);
+    }
+    for (auto& thread : threads)
+        pthread_join(thread, NULL);
+    return pixels;
+}
+
+// Which pixels of render_image() see a light (a hittable with a light number) or the sky
+// directly, or come within a pixel of one: their noise is that of the edges crossing them,
+// the same however the lights are sampled.
+std::vector<bool> pixels_seeing_lights(const hittable& world) {
+    camera cam = scene_camera();
+    const int width = 400, height = 400;
+    cam.set_resolution(height);
+    std::vector<bool> corner((width + 1) * (height + 1));
+    for (int j = 0; j <= height; j++)
+        for (int i = 0; i <= width; i++) {
+            hit_record rec;
+            ray r = cam.get_ray(double(i) / (width - 1), double(j) / (height - 1));
+            corner[j * (width + 1) + i] = !world.hit(r, 0.001, infinity, rec) || rec.light >= 0;
+        }
+    std::vector<bool> seeing(width * height);
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++)
+            for (int y = std::max(j - 1, 0); y <= std::min(j + 2, height); y++)
+                for (int x = std::max(i - 1, 0); x <= std::min(i + 2, width); x++)
+                    if (corner[y * (width + 1) + x])
+                        seeing[j * width + i] = true;
+    return seeing;
+}
+
+// Renders world; with report_noise, also estimates the variance of its pixels from a second
+// render with other samples, relative to their mean squared, and that times the time per
+// sample, which is in proportion to the time it takes to reach a given noise. Pixels that see
+// a light are left out of the estimate.
+void run_render(const std::string& name, const hittable& world, const light_set* lights = nullptr,
+                bool report_noise = false, const environment& background = environment()) {
+    std::vector<color> pixels;
+    run(name, "sample", uint64_t(400) * 400 * spp, [&]() {
+        pixels = render_image(world, lights, 0, background);
+        double checksum = 0;
+        for (const auto& p : pixels)
+            checksum += p.x() + p.y() + p.z();
+        return checksum / (double(pixels.size()) * spp);
+    }, false);
+    if (!selected(name) || !report_noise)
+        return;
+    std::vector<color> other = render_image(world, lights, 1, background);
+    std::vector<bool> seeing = pixels_seeing_lights(world);
+    double mean = 0, variance = 0;
+    size_t count = 0;
+    for (size_t k = 0; k < pixels.size(); k++) {
+        if (seeing[k])
+            continue;
+        count++;
+        for (int c = 0; c < 3; c++) {
+            double a = pixels[k][c] / spp, b = other[k][c] / spp;
+            mean += (a + b) / 2;
+            variance += (a - b) * (a - b) / 2;
+        }
+    }
+    mean /= 3.0 * count;
+    variance /= 3.0 * count;
+    double relative = variance / (mean * mean);
+    std::cerr << "  relative variance " << relative << ", times ns/sample "
+              << relative * results.back().ns_per_op << "\n";
+}
+
+void run_render(const std::string& name, const std::vector<teapot_instance>& teapots) {
+    if (!selected(name))
+        return;
+    hittable_list world;
+    seed_random(1);
+    add_cornell_box(world);
+    for (const auto& t : teapots)
+        add_instance(world, t);
+    run_render(name, world);
+}
+
+
+void write_json(std::ostream& out) {
+    out.precision(10);
+    out << "{\"spp\":" << spp << ",\"threads\":" << thread_count
+        << ",\"peak_rss_kb\":" << peak_rss_kb() << ",\"benchmarks\":[\n";
+    for (size_t k = 0; k < results.size(); k++) {
+        const auto& r = results[k];
+        out << "{\"name\":\"" << r.name << "\",\"unit\":\"" << r.unit << "\",\"ops\":" << r.ops
+            << ",\"ns_per_op\":" << r.ns_per_op
+            << ",\"" << r.unit << "s_per_sec\":" << 1e9 / r.ns_per_op
+            << ",\"peak_rss_kb\":" << r.peak_rss_kb;
+        if (r.has_checksum)
+            out << ",\"checksum\":" << r.checksum;
+        if (r.max_error >= 0)
+            out << ",\"max_error\":" << r.max_error << ",\"error_bound\":" << r.error_bound;
+        out << "}" << (k + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+}
+
+
+int main(int argc, char *argv[]) {
+    std::string output;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:o:s:t:r:j:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f': filter = optarg; break;
+            case 'o': output = optarg; break;
+            case 's': spp = std::max(1, atoi(optarg)); break;
+            case 't': min_time = atof(optarg); break;
+            case 'r': repeats = std::max(1, atoi(optarg)); break;
+            case 'j': thread_count = std::max(1, atoi(optarg)); break;
+            default:
+                std::cerr << "usage: ./bench [-f filter] [-o results.json] [-s spp] [-t seconds]"
+                             " [-r repeats] [-j threads]\n";
+                return -1;
+        }
+    }
+
+    load_teapot();
+    if (teapot.pos.empty()) {
+        std::cerr << "cannot read modify_teapot.txt\n";
+        return -1;
+    }
+    create_materials();
+
+    // Micro benchmarks run on the glass teapot, whose triangles are two-sided.
+    seed_random(1);
+    hittable_list teapot;
+    add_instance(teapot, glass_teapot);
+    auto teapot_bvh = teapot.objects[0];
+    std::vector<shared_ptr<hittable>> triangles;
+    collect_leaves(teapot_bvh, triangles);
+    aabb teapot_box;
+    teapot_bvh->bounding_box(0, 0, teapot_box);
+    const int ray_count = 1 << 16;
+
+    auto box_rays = rays_towards(aabb(teapot_box.min() - vec3(20, 20, 20),
+                                      teapot_box.max() + vec3(20, 20, 20)), ray_count);
+    run("aabb_hit", "ray", ray_count, [&]() {
+        int hits = 0;
+        for (const auto& r : box_rays)
+            hits += teapot_box.hit(r, 0.001, infinity);
+        return double(hits);
+    });
+
+    // Each ray is aimed at the bounding box of the triangle it is tested against.
+    std::vector<ray> triangle_rays;
+    for (int k = 0; k < ray_count; k++) {
+        aabb box;
+        triangles[k % triangles.size()]->bounding_box(0, 0, box);
+        triangle_rays.push_back(rays_towards(box, 1)[0]);
+    }
+    run("triangle_hit", "ray", ray_count, [&]() {
+        int hits = 0;
+        hit_record rec;
+        for (int k = 0; k < ray_count; k++)
+            hits += triangles[k % triangles.size()]->hit(triangle_rays[k], 0.001, infinity, rec);
+        return double(hits);
+    });
+
+    sphere ball(point3(0, 0, -150), 30, my_diffuse);
+    auto sphere_rays = rays_towards(aabb(point3(-45, -45, -195), point3(45, 45, -105)), ray_count);
+    run("sphere_hit", "ray", ray_count, [&]() {
+        int hits = 0;
+        hit_record rec;
+        for (const auto& r : sphere_rays)
+            hits += ball.hit(r, 0.001, infinity, rec);
+        return double(hits);
+    });
+
+    run("bvh_build", "build", 1, [&]() {
+        seed_random(1);
+        arena nodes;
+        bvh_node node(std::vector<shared_ptr<hittable>>(triangles), 0, triangles.size(), 0, 0, &nodes);
+        return node.box.max().x();
+    });
+
+    // An animated teapot (animation.h) moved to its next frame: its triangles transformed and
+    // its BVH refitted, against the build above.
+    if (selected("bvh_refit") || selected("motion_blur")) {
+        seed_random(1);
+        arena pool;
+        hittable_list objects;
+        mat4 pos, pos_end;
+        mat3 norm;
+        instance_matrices(glass_teapot, pos, norm);
+        animated_instance animated(objects, ::teapot, my_glass, 0, pool, true, pos, norm);
+        instance_matrices(glass_teapot, pos_end, norm);
+        int frame = 0;
+        run("bvh_refit", "refit", 1, [&]() {
+            pos[0][3] = pos_end[0][3] = glass_teapot.offset.x() + (++frame & 1);
+            animated.move(pos, norm, pos_end, norm);
+            return pos[0][3];
+        });
+
+        // Motion blur: the teapot moves 40 units, about half its width, while the shutter is
+        // open. Rays of random times traverse the BVH that interpolates the boxes of the
+        // nodes to the ray's time, and one over the same triangles bounded by their sweeps.
+        pos[0][3] = glass_teapot.offset.x() - 20;
+        pos_end[0][3] = glass_teapot.offset.x() + 20;
+        animated.move(pos, norm, pos_end, norm);
+        auto interpolated = objects.objects[0];
+        std::vector<shared_ptr<hittable>> moving_triangles, swept_triangles;
+        collect_leaves(std::static_pointer_cast<instance_id>(interpolated)->ptr, moving_triangles);
+        for (const auto& t : moving_triangles)
+            swept_triangles.push_back(make_shared<swept>(t));
+        seed_random(1);
+        auto sweep_bvh = make_shared<bvh_node>(std::move(swept_triangles), 0, moving_triangles.size(),
+                                               0, 1);
+        aabb sweep;
+        sweep_bvh->bounding_box(0, 1, sweep);
+        std::vector<ray> timed_rays;
+        for (const auto& r : rays_towards(sweep, ray_count))
+            timed_rays.push_back(ray(r.origin(), r.direction(), random_double()));
+        for (const auto& tree : {std::make_pair("interpolated", interpolated),
+                                 std::make_pair("swept", shared_ptr<hittable>(sweep_bvh))}) {
+            run(std::string("bvh_traverse_motion_blur_") + tree.first, "ray", ray_count, [&]() {
+                int hits = 0;
+                hit_record rec;
+                for (const auto& r : timed_rays)
+                    hits += tree.second->hit(r, 0.001, infinity, rec);
+                return double(hits);
+            });
+        }
+    }
+
+    auto random_rays = rays_towards(aabb(point3(-100, -100, -300), point3(100, 100, 0)), ray_count);
+    run("bvh_traverse_random", "ray", ray_count, [&]() {
+        int hits = 0;
+        hit_record rec;
+        for (const auto& r : random_rays)
+            hits += teapot_bvh->hit(r, 0.001, infinity, rec);
+        return double(hits);
+    });
+
+    // Primary rays in scanline order, through the pixel centers of the 400x400 view.
+    camera cam = scene_camera();
+    std::vector<ray> coherent_rays;
+    for (int j = 399; j >= 0; j--)
+        for (int i = 0; i < 400; i++)
+            coherent_rays.push_back(cam.get_ray((i + 0.5) / 399, (j + 0.5) / 399));
+    run("bvh_traverse_coherent", "ray", coherent_rays.size(), [&]() {
+        int hits = 0;
+        hit_record rec;
+        for (const auto& r : coherent_rays)
+            hits += teapot_bvh->hit(r, 0.001, infinity, rec);
+        return double(hits);
+    });
+
+    // The fast variants of turb() are checked against it at the timed points and at points as
+    // far out as the scene's, where floats lose the most.
+    seed_random(1);
+    perlin noise;
+    seed_random(1);
+    perlin periodic_noise(16);
+    noise_volume volume(periodic_noise);
+    std::vector<point3> noise_points;
+    for (int k = 0; k < 4096; k++)
+        noise_points.push_back(point3(random_double(-10, 10), random_double(-10, 10), random_double(-10, 10)));
+    run("perlin_turb", "call", noise_points.size(), [&]() {
+        double sum = 0;
+        for (const auto& p : noise_points)
+            sum += noise.turb(p);
+        return sum;
+    });
+    run("perlin_turb_simd", "call", noise_points.size(), [&]() {
+        double sum = 0;
+        for (const auto& p : noise_points)
+            sum += noise.turb_fast(p);
+        return sum;
+    });
+    run("perlin_turb_volume", "call", noise_points.size(), [&]() {
+        double sum = 0;
+        for (const auto& p : noise_points)
+            sum += volume.turb(p);
+        return sum;
+    });
+    std::vector<float> noise_x, noise_y, noise_z, noise_out(noise_points.size());
+    for (const auto& p : noise_points) {
+        noise_x.push_back(float(p.x())), noise_y.push_back(float(p.y()));
+        noise_z.push_back(float(p.z()));
+    }
+    run("perlin_noise_batch", "point", noise_points.size(), [&]() {
+        noise.noise(noise_x.data(), noise_y.data(), noise_z.data(), noise_out.data(),
+                    static_cast<int>(noise_points.size()));
+        return double(noise_out[0]);
+    });
+    double simd_error = 0, volume_error = 0, batch_error = 0;
+    for (size_t k = 0; k < noise_points.size(); k++) {
+        point3 q(noise_x[k], noise_y[k], noise_z[k]);
+        batch_error = std::max(batch_error, fabs(noise_out[k] - noise.noise(q)));
+        for (double distance : {1.0, 40.0}) {
+            point3 p = distance * noise_points[k];
+            simd_error = std::max(simd_error, fabs(noise.turb_fast(p) - noise.turb(p)));
+            volume_error = std::max(volume_error, fabs(volume.turb(p) - periodic_noise.turb(p)));
+        }
+    }
+    record_error("perlin_turb_simd", simd_error, 1e-6);
+    record_error("perlin_turb_volume", volume_error, 0.035);
+    record_error("perlin_noise_batch", batch_error, 1e-6);
+
+    // Incoming rays hit the front and the back of the surface in turn.
+    std::vector<ray> incoming;
+    for (int k = 0; k < 4096; k++)
+        incoming.push_back(ray(point3(0, 0, 0), random_unit_vector()));
+    std::vector<std::pair<std::string, shared_ptr<material>>> scatter_materials = {
+        {"lambertian", my_diffuse}, {"metal", my_metal}, {"dielectric_thin", my_glass},
+        {"dielectric_solid", make_shared<dielectric>(1.5)},
+        {"isotropic", make_shared<isotropic>(color(0.8, 0.8, 0.8))}};
+    for (const auto& m : scatter_materials) {
+        run("scatter_" + m.first, "scatter", incoming.size(), [&]() {
+            double sum = 0;
+            hit_record rec;
+            rec.p = point3(0, 0, 0);
+            rec.mat_ptr = m.second;
+            rec.u = rec.v = 0.5;
+            for (const auto& r : incoming) {
+                rec.set_face_normal(r, vec3(0, 0, 1));
+                color attenuation;
+                ray scattered;
+                if (m.second->scatter(r, rec, attenuation, scattered))
+                    sum += scattered.direction().z();
+            }
+            return sum;
+        });
+    }
+
+    // Primary hits of one frame of the three-teapot scene: traversing the BVH for every primary
+    // ray against rasterizing the visibility buffer and intersecting one primitive per ray.
+    if (selected("primary_")) {
+        hittable_list world;
+        add_cornell_box(world);
+        for (const auto& t : {metal_teapot, glass_teapot, small_teapot})
+            add_instance(world, t);
+        seed_random(1);
+        std::vector<double> du(400 * 400), dv(400 * 400);
+        std::vector<ray> primary;
+        for (int j = 0; j < 400; j++) {
+            for (int i = 0; i < 400; i++) {
+                int k = j * 400 + i;
+                du[k] = random_double();
+                dv[k] = random_double();
+                primary.push_back(cam.get_ray((i + du[k]) / 399, (j + dv[k]) / 399));
+            }
+        }
+        run("primary_traversal", "frame", 1, [&]() {
+            int hits = 0;
+            hit_record rec;
+            for (const auto& r : primary)
+                hits += world.hit(r, 0.001, infinity, rec);
+            return double(hits);
+        });
+
+        visibility_buffer visibility;
+        std::string reason;
+        visibility.build(world, cam, 400, 400, reason);
+        auto all = visibility.overlapping(0, 0, 400, 400);
+        std::vector<int> nearest;
+        std::vector<double> depth;
+        run("primary_visibility", "frame", 1, [&]() {
+            visibility.rasterize(all, 0, 0, 400, 400, du, dv, nearest, depth);
+            int hits = 0;
+            hit_record rec;
+            for (size_t k = 0; k < primary.size(); k++)
+                hits += nearest[k] >= 0
+                      ? visibility.primitive(nearest[k])->hit(primary[k], 0.001, infinity, rec)
+                      : world.hit(primary[k], 0.001, infinity, rec);
+            return double(hits);
+        });
+    }
+
+    // Denoising a 1 spp frame of the metal teapot, guided by its AOVs.
+    if (selected("denoise")) {
+        hittable_list world;
+        add_cornell_box(world);
+        add_instance(world, metal_teapot);
+        seed_random(1);
+        framebuffer image(400, 400);
+        aov_buffer aov(400, 400);
+        for (int j = 0; j < 400; j++) {
+            for (int i = 0; i < 400; i++) {
+                first_hit first;
+                ray r = cam.get_ray((i + random_double()) / 399, (j + random_double()) / 399);
+                color c = ray_color(r, color(0, 0, 0), world, 50, nullptr, &first);
+                image.add_sample(i, j, c);
+                aov.add_sample(i, j, first.albedo, first.normal, first.depth, first.emitted, c);
+            }
+        }
+        run("denoise", "frame", 1, [&]() {
+            framebuffer result = atrous_denoiser(image, aov, thread_count).run();
+            double sum = 0;
+            for (const auto& c : result.accum)
+                sum += c.x() + c.y() + c.z();
+            return sum;
+        });
+    }
+
+    // Encoding a noisy 4 spp frame of the metal teapot in the output formats; the sizes are
+    // what /render sends.
+    if (selected("encode")) {
+        hittable_list world;
+        add_cornell_box(world);
+        add_instance(world, metal_teapot);
+        seed_random(1);
+        framebuffer image(400, 400);
+        for (int j = 0; j < 400; j++)
+            for (int i = 0; i < 400; i++)
+                for (int s = 0; s < 4; s++) {
+                    ray r = cam.get_ray((i + random_double()) / 399, (j + random_double()) / 399);
+                    image.add_sample(i, j, ray_color(r, color(0, 0, 0), world, 50));
+                }
+        size_t bytes = 0;
+        run("encode_ppm", "frame", 1, [&]() {
+            std::ostringstream out;
+            image.write_ppm(out);
+            bytes = out.str().size();
+            return double(bytes);
+        });
+        std::cerr << "  P3: " << bytes << " bytes\n";
+        run("encode_qoi", "frame", 1, [&]() {
+            bytes = encode_qoi(image.rgb8(), 400, 400).size();
+            return double(bytes);
+        });
+        std::cerr << "  QOI: " << bytes << " bytes\n";
+        run("encode_png", "frame", 1, [&]() {
+            bytes = encode_png(image.rgb8(), 400, 400, thread_count).size();
+            return double(bytes);
+        });
+        std::cerr << "  PNG: " << bytes << " bytes\n";
+        run("encode_png_1thread", "frame", 1, [&]() {
+            bytes = encode_png(image.rgb8(), 400, 400, 1).size();
+            return double(bytes);
+        });
+        std::cerr << "  PNG, one strip: " << bytes << " bytes\n";
+    }
+
+    // Texture lookups over a 4096x4096 image minified 16 times, as on a distant surface: in
+    // rows, in 4x4 tiles, and tiled with mipmaps, which read the level whose texels are as wide
+    // as the footprint. Then the metal teapot's place taken by a teapot textured with it.
+    if (selected("texture_lookup") || selected("render_textured")) {
+        const int size = 4096, grid = 256;
+        std::vector<uint8_t> rgb(size_t(3) * size * size);
+        seed_random(1);
+        for (size_t k = 0; k < rgb.size(); k++)
+            rgb[k] = static_cast<uint8_t>(((k / 3 % size / 8 + k / 3 / size / 8) % 2 ? 160 : 64)
+                                          + random_int(0, 63));
+        std::vector<std::array<double, 2>> uvs;
+        for (int j = 0; j < grid; j++)
+            for (int i = 0; i < grid; i++)
+                uvs.push_back({(i + random_double()) / grid, (j + random_double()) / grid});
+        // In no order, as the bounces of paths reach the surface.
+        for (size_t k = uvs.size() - 1; k > 0; k--)
+            std::swap(uvs[k], uvs[random_int(0, static_cast<int>(k))]);
+        mesh textured = ::teapot;
+        cylindrical_uvs(textured);
+
+        struct layout { std::string name; bool mipmaps, tiled; };
+        for (const layout& l : {layout{"rows", false, false}, layout{"tiled", false, true},
+                                layout{"mipmapped", true, true}}) {
+            auto image = make_shared<const mip_image>(rgb, size, size, l.mipmaps, l.tiled);
+            run("texture_lookup_" + l.name, "lookup", uvs.size(), [&]() {
+                color sum(0, 0, 0);
+                for (const auto& uv : uvs)
+                    sum += image->trilinear(uv[0], uv[1], 1.0 / grid);
+                return sum.x() + sum.y() + sum.z();
+            });
+#ifdef RT_STATS
+            thread_stats = render_stats();
+            for (const auto& uv : uvs)
+                image->trilinear(uv[0], uv[1], 1.0 / grid);
+            std::cerr << "  " << 64.0 * thread_stats.texture_lines / uvs.size() << " bytes/lookup, "
+                      << image->bytes() / 1024 << " KiB\n";
+#endif
+            if (l.name == "rows")
+                continue;
+            hittable_list world;
+            seed_random(1);
+            add_cornell_box(world);
+            mat4 pos;
+            mat3 norm;
+            instance_matrices(metal_teapot, pos, norm);
+            auto m = make_in<lambertian>(&scene_arena, arena::materials,
+                                         make_in<image_texture>(&scene_arena, arena::materials, image));
+            add_mesh(world, textured, pos, norm, m, -1, scene_arena);
+            run_render("render_textured_teapot_" + l.name, world);
+        }
+    }
+
+    // Fog filling the Cornell box around the metal teapot. Homogeneous, its box boundary
+    // queried with two hits, as constant_medium used to, or with one slab test. Then ground
+    // fog on a 64^3 grid, thick at the floor and clear in the upper half, tracked against
+    // majorants of 8^3 voxels or against a single one for the whole grid.
+    if (selected("medium_") || selected("render_fog") || selected("render_fog_lights")) {
+        aabb room(point3(-100, -100, -300), point3(100, 100, 0));
+        auto fog_box = make_shared<box>(room.min(), room.max(), materials[2]);
+        auto fog = make_shared<constant_medium>(fog_box, 0.005, color(0.8, 0.8, 0.8));
+        auto fog_two_hits = make_shared<constant_medium>(make_shared<two_hit_boundary>(fog_box),
+                                                         0.005, color(0.8, 0.8, 0.8));
+        seed_random(1);
+        std::vector<ray> fog_rays = rays_towards(teapot_box, ray_count);
+        for (const auto& m : {std::make_pair("two_hits", fog_two_hits), std::make_pair("", fog)}) {
+            std::string name = std::string("medium_interval") + (*m.first ? "_" : "") + m.first;
+            run(name, "ray", fog_rays.size(), [&]() {
+                double sum = 0, t0, t1;
+                for (const auto& r : fog_rays)
+                    if (m.second->boundary->interval(r, 0.001, infinity, t0, t1))
+                        sum += t1 - t0;
+                return sum;
+            });
+        }
+
+        const int res = 64;
+        std::vector<float> density(size_t(res) * res * res);
+        seed_random(1);
+        perlin wisps;
+        vec3 extent = room.max() - room.min();
+        for (int z = 0; z < res; z++)
+            for (int y = 0; y < res; y++)
+                for (int x = 0; x < res; x++) {
+                    vec3 f = (vec3(x, y, z) + vec3(0.5, 0.5, 0.5)) / res;
+                    point3 p = room.min() + vec3(f.x() * extent.x(), f.y() * extent.y(),
+                                                 f.z() * extent.z());
+                    double height = f.y();
+                    density[(size_t(z) * res + y) * res + x] = height < 0.5
+                        ? float(0.02 * (1 - 2 * height) * (0.5 + 0.5 * wisps.noise(0.03 * p))) : 0;
+                }
+        auto ground_fog = make_shared<grid_medium>(room, res, res, res, density, color(0.8, 0.8, 0.8));
+        auto ground_fog_one_majorant = make_shared<grid_medium>(room, res, res, res, density,
+                                                                color(0.8, 0.8, 0.8), res);
+        for (const auto& m : {std::make_pair("", ground_fog),
+                              std::make_pair("_one_majorant", ground_fog_one_majorant)}) {
+            run(std::string("medium_transmittance_grid") + m.first, "ray", fog_rays.size(), [&]() {
+                double sum = 0;
+                for (const auto& r : fog_rays)
+                    sum += m.second->transmittance(r, 0.001, infinity);
+                return sum;
+            });
+        }
+
+        std::vector<std::pair<std::string, shared_ptr<hittable>>> media = {
+            {"two_hits", fog_two_hits}, {"constant", fog}, {"grid", ground_fog},
+            {"grid_one_majorant", ground_fog_one_majorant}};
+        for (const auto& m : media) {
+            if (!selected("render_fog_" + m.first))
+                continue;
+            hittable_list world;
+            seed_random(1);
+            add_cornell_box(world);
+            add_instance(world, metal_teapot);
+            world.add(m.second);
+            run_render("render_fog_" + m.first, world);
+        }
+
+        // The ground fog with the ceiling light sampled, its shadow rays through the fog
+        // delta tracked, all or nothing like any hit, or ratio tracked (transmittance()).
+        for (const auto& m : {std::make_pair("hits", shared_ptr<hittable>(
+                                                 make_shared<two_hit_boundary>(ground_fog))),
+                              std::make_pair("ratio", shared_ptr<hittable>(ground_fog))}) {
+            std::string name = std::string("render_fog_lights_") + m.first;
+            if (!selected(name))
+                continue;
+            hittable_list world;
+            seed_random(1);
+            add_cornell_box(world);
+            add_instance(world, metal_teapot);
+            world.add(m.second);
+            light_set lights;
+            lights.build(world);
+            run_render(name, world, &lights, true);
+        }
+    }
+
+    // The Cornell box lit by 1, 100 and 10000 small emissive triangles instead of its ceiling
+    // light, with that light's power between them, on the ceiling and the upper half of the
+    // side walls, around a diffuse teapot. The paths find the lights by themselves (paths) or
+    // also sample one at each bounce, picked in proportion to power or through the light BVH.
+    if (selected("render_lights") || selected("light_pick")) {
+        for (int count : {1, 100, 10000}) {
+            hittable_list world;
+            seed_random(1);
+            add_cornell_box(world);
+            world.objects.erase(std::remove_if(world.objects.begin(), world.objects.end(),
+                [](const shared_ptr<hittable>& o) {
+                    auto rect = std::dynamic_pointer_cast<xz_rect>(o);
+                    return rect && dynamic_cast<diffuse_light*>(rect->mp.get());
+                }), world.objects.end());
+            add_instance(world, {3.45, vec3(0, -40, -120), 2});
+
+            // Each in a cell of its own, 2.2 wide, so that none overlap.
+            const double radius = 1, area = 3 * sqrt(3.0) / 4 * radius * radius, cell = 2.2;
+            auto glow = make_shared<diffuse_light>(color(1, 1, 1) * (15 * 50 * 50 / (count * area)));
+            std::vector<point3> centres;
+            for (int wall = 0; wall < 3; wall++)
+                for (double z = -195 + cell / 2; z < -5; z += cell)
+                    for (double s = (wall == 0 ? -95 : 0) + cell / 2; s < 95; s += cell)
+                        centres.push_back(wall == 0 ? point3(s, 99.5, z)
+                                                    : point3(wall == 1 ? -99.5 : 99.5, s, z));
+            for (int k = 0; k < count; k++)
+                std::swap(centres[k], centres[random_int(k, int(centres.size()) - 1)]);
+            if (count == 1)
+                centres[0] = point3(0, 99.5, -100);
+            hittable_list triangles;
+            for (int k = 0; k < count; k++) {
+                point3 c = centres[k];
+                int wall = c.y() == 99.5 ? 0 : c.x() < 0 ? 1 : 2;
+                vec3 inward = wall == 0 ? vec3(0, -1, 0) : vec3(wall == 1 ? 1 : -1, 0, 0);
+                vec3 t1 = wall == 0 ? vec3(1, 0, 0) : vec3(0, 1, 0), t2(0, 0, 1);
+                point3 a = c + radius * t1;
+                point3 b = c + radius * (-0.5 * t1 + sqrt(0.75) * t2);
+                point3 d = c + radius * (-0.5 * t1 - sqrt(0.75) * t2);
+                if (dot(cross(b - a, d - a), inward) < 0)
+                    std::swap(b, d);
+                triangles.add(make_shared<triangle>(a, b, d, inward, inward, inward, inward, glow));
+            }
+            world.add(make_shared<bvh_node>(triangles, 0, 1));
+
+            light_set by_power, by_bvh;
+            by_power.build(world);
+            by_power.mode = light_set::by_power;
+            by_bvh.build(world);
+
+            // Picks at random points of the room, each facing a random way.
+            std::vector<point3> points;
+            std::vector<vec3> normals;
+            for (int k = 0; k < 4096; k++) {
+                points.push_back(point3(random_double(-100, 100), random_double(-100, 100),
+                                        random_double(-200, 0)));
+                normals.push_back(random_unit_vector(random_double(), random_double()));
+            }
+            std::string suffix = "_" + std::to_string(count);
+            for (const light_set* lights : {&by_power, &by_bvh}) {
+                std::string name = lights == &by_power ? "light_pick_power" : "light_pick_bvh";
+                run(name + suffix, "pick", points.size(), [&]() {
+                    double sum = 0, pmf;
+                    for (size_t k = 0; k < points.size(); k++)
+                        sum += lights->pick(points[k], normals[k], (k + 0.5) / points.size(), pmf);
+                    return sum;
+                });
+            }
+            run_render("render_lights" + suffix + "_paths", world, nullptr, true);
+            run_render("render_lights" + suffix + "_power", world, &by_power, true);
+            run_render("render_lights" + suffix + "_bvh", world, &by_bvh, true);
+        }
+    }
+
+    // A diffuse teapot on an endless floor under a sky of 512x256 texels with a small, bright
+    // sun, which gives most of the light, out of the camera's view. The paths find the sky by
+    // themselves (paths) or also sample it at each bounce, uniformly over the hemisphere or
+    // by its 2D distribution.
+    if (selected("render_environment") || selected("environment_sample")) {
+        const int width = 512, height = 256;
+        const vec3 sun = unit_vector(vec3(-0.66, 0.64, -0.38));
+        const double sun_cos = cos(degrees_to_radians(1.5));
+        std::vector<float> rgb(size_t(width) * height * 3);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++) {
+                double theta = pi * (y + 0.5) / height, phi = 2*pi * (x + 0.5) / width - pi;
+                vec3 d(sin(theta) * sin(phi), cos(theta), -sin(theta) * cos(phi));
+                color c = d.y() > 0 ? (0.25 + 0.25 * d.y()) * color(0.5, 0.7, 1.0)
+                                    : color(0.1, 0.08, 0.06);
+                if (dot(d, sun) > sun_cos)
+                    c = 2600 * color(1, 0.9, 0.8);
+                for (int k = 0; k < 3; k++)
+                    rgb[(size_t(y) * width + x) * 3 + k] = static_cast<float>(c[k]);
+            }
+        environment by_importance(rgb, width, height), uniform = by_importance;
+        uniform.mode = environment::uniform;
+
+        hittable_list world;
+        seed_random(1);
+        world.add(make_shared<xz_rect>(-5000, 5000, -5000, 5000, -100,
+                                       make_shared<lambertian>(color(.73, .73, .73))));
+        add_instance(world, {3.45, vec3(0, -40, -120), 2});
+        light_set no_lights;
+        no_lights.build(world);
+
+        std::vector<double> u2(4096);
+        for (auto& u : u2)
+            u = random_double();
+        for (const environment* sky : {&uniform, &by_importance}) {
+            std::string name = sky == &uniform ? "environment_sample_uniform"
+                                               : "environment_sample_importance";
+            run(name, "sample", u2.size(), [&]() {
+                double sum = 0, pdf;
+                for (size_t k = 0; k < u2.size(); k++)
+                    sum += sky->sample(vec3(0, 1, 0), (k + 0.5) / u2.size(), u2[k], pdf).y() + pdf;
+                return sum;
+            });
+        }
+        run_render("render_environment_paths", world, nullptr, true, by_importance);
+        run_render("render_environment_uniform", world, &no_lights, true, uniform);
+        run_render("render_environment_importance", world, &no_lights, true, by_importance);
+    }
+
+    run_render("render_metal_teapot", {metal_teapot});
+    run_render("render_glass_teapot", {glass_teapot});
+    run_render("render_three_teapots", {metal_teapot, glass_teapot, small_teapot});
+
+    // Scene setup as in a.out: instancing the teapots and building their BVHs, then freeing
+    // the scene. Runs last, since it frees the objects of the benchmarks above.
+    for (int count : {1, 4, 16}) {
+        run("scene_build_" + std::to_string(count), "scene", 1, [&]() {
+            hittable_list world;
+            seed_random(1);
+            add_cornell_box(world);
+            for (int k = 0; k < count; k++)
+                add_instance(world, k % 2 ? glass_teapot : metal_teapot);
+            double bytes = scene_arena.reserved();
+            world.clear();
+            reset_scene();
+            return bytes;
+        });
+    }
+
+    if (output.empty()) {
+        write_json(std::cout);
+    } else {
+        std::ofstream out(output);
+        write_json(out);
+        if (!out) {
+            std::cerr << "cannot write " << output << "\n";
+            return -1;
+        }
+    }
+    if (inaccurate) {
+        std::cerr << inaccurate << " approximation(s) beyond their error bounds\n";
+        return 1;
+    }
+}
@@ -0,0 +1,74 @@
+"""Compares two result files of the benchmarks (bench.cpp) and flags regressions.
+
+A benchmark regresses when its ns/op grows by more than the threshold; the peak RSS has its
+own threshold. A render whose checksum changed produces a different image, so its timings
+aren't comparable; it is reported as well, and so is an approximation whose error went beyond
+its bound. Exits with 1 if anything regressed.
+
+usage: python3 bench_compare.py baseline.json current.json [--threshold 0.05]
+                                [--rss-threshold 0.10]
+"""
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        results = json.load(f)
+    return results, {b['name']: b for b in results['benchmarks']}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('baseline')
+    parser.add_argument('current')
+    parser.add_argument('--threshold', type=float, default=0.05,
+                        help="relative ns/op increase that counts as a regression")
+    parser.add_argument('--rss-threshold', type=float, default=0.10,
+                        help="relative peak RSS increase that counts as a regression")
+    args = parser.parse_args()
+
+    base_run, base = load(args.baseline)
+    current_run, current = load(args.current)
+    if base_run['spp'] != current_run['spp'] or base_run['threads'] != current_run['threads']:
+        print("warning: runs differ in spp or threads, renders are not comparable", file=sys.stderr)
+
+    failures = 0
+    print(f"{'ns/op':<24}{'baseline':>14}{'current':>14}{'change':>9}")
+    for name, b in base.items():
+        c = current.get(name)
+        if c is None:
+            print(f"{name:<24}{'missing':>14}")
+            continue
+        change = c['ns_per_op'] / b['ns_per_op'] - 1
+        status = ''
+        if change > args.threshold:
+            status = 'REGRESSION'
+        elif change < -args.threshold:
+            status = 'faster'
+        if 'checksum' in b and abs(c.get('checksum', 0) - b['checksum']) > 1e-9 * abs(b['checksum']):
+            status = 'IMAGE CHANGED'
+        if c.get('max_error', 0) > c.get('error_bound', 0):
+            status = 'INACCURATE'
+        failures += status in ('REGRESSION', 'IMAGE CHANGED', 'INACCURATE')
+        print(f"{name:<24}{b['ns_per_op']:>14.1f}{c['ns_per_op']:>14.1f}"
+              f"{100 * change:>+8.1f}%  {status}")
+    for name in current:
+        if name not in base:
+            print(f"{name:<24}{'new':>14}")
+
+    rss_change = current_run['peak_rss_kb'] / base_run['peak_rss_kb'] - 1
+    rss_status = 'REGRESSION' if rss_change > args.rss_threshold else ''
+    failures += bool(rss_status)
+    print(f"{'peak RSS (KiB)':<24}{base_run['peak_rss_kb']:>14}{current_run['peak_rss_kb']:>14}"
+          f"{100 * rss_change:>+8.1f}%  {rss_status}")
+
+    if failures:
+        print(f"{failures} regression(s)", file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -30,6 +30,12 @@ class box : public hittable  {
             return true;
         }
 
+        virtual bool interval(const ray& r, double t_min, double t_max, double& t0,
+                              double& t1) const override {
+            t0 = t_min, t1 = t_max;
+            return aabb(box_min, box_max).clip(r, t0, t1);
+        }
+
     public:
         point3 box_min;
         point3 box_max;
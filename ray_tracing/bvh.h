@@ -13,8 +13,10 @@
 
 #include "rtweekend.h"
 
+#include "arena.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "stats.h"
 
 #include <algorithm>
 
@@ -23,23 +25,44 @@ class bvh_node : public hittable  {
     public:
         bvh_node();
 
-        bvh_node(const hittable_list& list, double time0, double time1)
-            : bvh_node(list.objects, 0, list.objects.size(), time0, time1)
+        // The nodes below this one go in pool if one is given.
+        bvh_node(const hittable_list& list, double time0, double time1, arena* pool = nullptr)
+            : bvh_node(std::vector<shared_ptr<hittable>>(list.objects),
+                       0, list.objects.size(), time0, time1, pool)
         {}
 
         bvh_node(
-            const std::vector<shared_ptr<hittable>>& src_objects,
-            size_t start, size_t end, double time0, double time1);
+            std::vector<shared_ptr<hittable>>&& objects,
+            size_t start, size_t end, double time0, double time1, arena* pool = nullptr)
+            : bvh_node(objects, start, end, time0, time1, pool)
+        {}
+
+        // Sorts objects[start, end) in place; the children share the vector.
+        bvh_node(
+            std::vector<shared_ptr<hittable>>& objects,
+            size_t start, size_t end, double time0, double time1, arena* pool = nullptr);
 
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+        virtual bool motion_boxes(aabb& start, aabb& end) const override;
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override;
+
+        // Recomputes the boxes bottom-up after the objects below moved, keeping the tree: far
+        // cheaper than building a new one, and as good while the objects under each node stay
+        // close together, as the triangles of a rigidly moving mesh do.
+        void refit(double time0 = 0, double time1 = 0);
+
+    private:
+        void update_box(double time0, double time1);
 
     public:
         shared_ptr<hittable> left;
         shared_ptr<hittable> right;
-        aabb box;
+        aabb box;           // at the start of the shutter if something below moves
+        aabb box_end;       // then at its end; a ray of time t tests the box in between
+        bool moving = false;
 };
 
 
@@ -68,11 +91,9 @@ bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b)
 
 
 bvh_node::bvh_node(
-    const std::vector<shared_ptr<hittable>>& src_objects,
-    size_t start, size_t end, double time0, double time1
+    std::vector<shared_ptr<hittable>>& objects,
+    size_t start, size_t end, double time0, double time1, arena* pool
 ) {
-    auto objects = src_objects; // Create a modifiable array of the source scene objects
-
     int axis = random_int(0,2);
     auto comparator = (axis == 0) ? box_x_compare
                     : (axis == 1) ? box_y_compare
@@ -94,23 +115,44 @@ bvh_node::bvh_node(
         std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
         auto mid = start + object_span/2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+        left = make_in<bvh_node>(pool, arena::bvh_nodes, objects, start, mid, time0, time1, pool);
+        right = make_in<bvh_node>(pool, arena::bvh_nodes, objects, mid, end, time0, time1, pool);
     }
 
-    aabb box_left, box_right;
+    update_box(time0, time1);
+}
 
-    if (  !left->bounding_box (time0, time1, box_left)
-       || !right->bounding_box(time0, time1, box_right)
-    )
-        std::cerr << "No bounding box in bvh_node constructor.\n";
 
-    box = surrounding_box(box_left, box_right);
+void bvh_node::update_box(double time0, double time1) {
+    aabb start[2], end[2];
+    bool child_moving[2];
+    const hittable* children[2] = {left.get(), right.get()};
+    for (int k = 0; k < 2; k++) {
+        child_moving[k] = children[k]->motion_boxes(start[k], end[k]);
+        if (child_moving[k])
+            continue;
+        if (!children[k]->bounding_box(time0, time1, start[k]))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+        end[k] = start[k];
+    }
+
+    moving = child_moving[0] || child_moving[1];
+    box = surrounding_box(start[0], start[1]);
+    box_end = surrounding_box(end[0], end[1]);
+}
+
+
+void bvh_node::refit(double time0, double time1) {
+    for (auto child : {left.get(), right == left ? nullptr : right.get()})
+        if (auto node = dynamic_cast<bvh_node*>(child))
+            node->refit(time0, time1);
+    update_box(time0, time1);
 }
 
 
 bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    if (!box.hit(r, t_min, t_max))
+    STAT_BVH_NODE();
+    if (moving ? !lerp(box, box_end, r.time()).hit(r, t_min, t_max) : !box.hit(r, t_min, t_max))
         return false;
 
     bool hit_left = left->hit(r, t_min, t_max, rec);
@@ -120,10 +162,30 @@ bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 }
 
 
+// Any opaque hit ends it, so the children are visited in no particular order.
+double bvh_node::transmittance(const ray& r, double t_min, double t_max) const {
+    STAT_BVH_NODE();
+    if (moving ? !lerp(box, box_end, r.time()).hit(r, t_min, t_max) : !box.hit(r, t_min, t_max))
+        return 1;
+
+    double through = left->transmittance(r, t_min, t_max);
+    if (through == 0 || right == left)
+        return through;
+    return through * right->transmittance(r, t_min, t_max);
+}
+
+
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
-    output_box = box;
+    output_box = moving ? surrounding_box(box, box_end) : box;
     return true;
 }
 
 
+bool bvh_node::motion_boxes(aabb& start, aabb& end) const {
+    start = box;
+    end = box_end;
+    return moving;
+}
+
+
 #endif
@@ -13,6 +13,8 @@
 
 #include "rtweekend.h"
 
+#include "sampler.h"
+
 
 class camera {
     public:
@@ -44,18 +46,52 @@ class camera {
             lower_left_corner = origin - horizontal/2 - vertical/2 - focus_dist*w;
 
             lens_radius = aperture / 2;
+            pixel_spread = 0;
+            view_height = viewport_height;
             time0 = _time0;
             time1 = _time1;
         }
 
+        // Makes the rays cones as wide as a pixel of an image rows pixels high, so textures can
+        // be filtered to what a pixel covers.
+        void set_resolution(int rows) {
+            pixel_spread = view_height / rows;
+        }
+
         ray get_ray(double s, double t) const {
-            vec3 rd = lens_radius * random_in_unit_disk();
+            double lens_u, lens_v;
+            sample_2d(lens_u, lens_v);
+            vec3 rd = lens_radius * random_in_unit_disk(lens_u, lens_v);
             vec3 offset = u * rd.x() + v * rd.y();
-            return ray(
+            ray r(
                 origin + offset,
                 lower_left_corner + s*horizontal + t*vertical - origin - offset,
-                random_double(time0, time1)
+                time0 + (time1 - time0) * sample_1d()
             );
+            r.cone_spread = pixel_spread;
+            return r;
+        }
+
+        // Pinhole view: every ray starts at the eye, so the primary hits can be rasterized.
+        bool pinhole() const { return lens_radius == 0; }
+        point3 eye() const { return origin; }
+
+        // Direction of the pinhole ray through (s, t).
+        vec3 direction(double s, double t) const {
+            return lower_left_corner + s*horizontal + t*vertical - origin;
+        }
+
+        // The (s, t) whose pinhole ray passes through p; false if p isn't in front of the eye.
+        bool project(const point3& p, double& s, double& t) const {
+            vec3 x = p - origin;
+            double depth = -dot(x, w);
+            if (depth <= 0)
+                return false;
+            double focus_dist = -dot(lower_left_corner + horizontal/2 + vertical/2 - origin, w);
+            double scale = focus_dist / depth;
+            s = scale * dot(x, horizontal) / horizontal.length_squared() + 0.5;
+            t = scale * dot(x, vertical) / vertical.length_squared() + 0.5;
+            return true;
         }
 
     private:
@@ -65,6 +101,8 @@ class camera {
         vec3 vertical;
         vec3 u, v, w;
         double lens_radius;
+        double view_height;         // of the viewport at distance 1
+        double pixel_spread;        // of the rays' cones, 0 for rays of no width
         double time0, time1;  // shutter open/close times
 };
 
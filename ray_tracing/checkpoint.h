@@ -0,0 +1,202 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "rtweekend.h"
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// FNV-1a over the canonical description of a scene, so a checkpoint is only ever resumed or
+// merged into a render of the same scene.
+class scene_hash {
+    public:
+        void add(const void* data, size_t size) {
+            auto bytes = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < size; i++) {
+                value ^= bytes[i];
+                value *= 0x100000001b3ULL;
+            }
+        }
+
+        void add(double x) { add(&x, sizeof(x)); }
+        void add(int x)    { add(&x, sizeof(x)); }
+        void add(const vec3& v) { add(v.e, sizeof(v.e)); }
+
+    public:
+        uint64_t value = 0xcbf29ce484222325ULL;
+};
+
+
+// Sample indices [begin, end) that went into an accumulation buffer.
+struct sample_range {
+    uint32_t begin;
+    uint32_t end;
+};
+
+
+// Everything needed to resume a progressive render: the accumulation buffer with per-pixel
+// sample counts and the sample indices they hold. Samples are seeded from (sampler seed,
+// pixel, sample index), so the sampler name, seed and used index ranges are the whole RNG
+// state; extending a render continues after the last used index.
+//
+// File layout (native byte order): "RTCK", version, scene hash, width, height, seed,
+// sampler name, range count and ranges, then the accumulation (3 doubles per pixel) and
+// the sample counts (one uint32 per pixel), rows bottom to top.
+class checkpoint {
+    public:
+        checkpoint() {}
+
+        uint32_t next_sample() const {
+            uint32_t next = 0;
+            for (const auto& r : ranges)
+                next = std::max(next, r.end);
+            return next;
+        }
+
+        int sample_count() const {
+            int count = 0;
+            for (const auto& r : ranges)
+                count += r.end - r.begin;
+            return count;
+        }
+
+        bool overlaps(const sample_range& range) const {
+            for (const auto& r : ranges)
+                if (range.begin < r.end && r.begin < range.end)
+                    return true;
+            return false;
+        }
+
+        void add_range(sample_range range) {
+            // Keep the list sorted and join adjacent ranges.
+            ranges.push_back(range);
+            std::sort(ranges.begin(), ranges.end(),
+                [](const sample_range& a, const sample_range& b) { return a.begin < b.begin; });
+            std::vector<sample_range> joined;
+            for (const auto& r : ranges) {
+                if (!joined.empty() && joined.back().end == r.begin)
+                    joined.back().end = r.end;
+                else
+                    joined.push_back(r);
+            }
+            ranges = joined;
+        }
+
+        bool load(const std::string& file);
+        bool save(const std::string& file) const;
+        bool merge(const checkpoint& other, std::string& error);
+
+    public:
+        static constexpr uint32_t version = 1;
+
+        uint64_t hash = 0;
+        uint64_t seed = 0;
+        std::string sampler_name;
+        std::vector<sample_range> ranges;
+        framebuffer image;
+};
+
+
+bool checkpoint::load(const std::string& file) {
+    std::ifstream in(file, std::ios::binary);
+    char magic[4];
+    uint32_t file_version, name_length, range_count;
+    int width, height;
+
+    in.read(magic, 4);
+    in.read(reinterpret_cast<char*>(&file_version), sizeof(file_version));
+    if (!in || std::string(magic, 4) != "RTCK" || file_version != version)
+        return false;
+
+    in.read(reinterpret_cast<char*>(&hash), sizeof(hash));
+    in.read(reinterpret_cast<char*>(&width), sizeof(width));
+    in.read(reinterpret_cast<char*>(&height), sizeof(height));
+    in.read(reinterpret_cast<char*>(&seed), sizeof(seed));
+    in.read(reinterpret_cast<char*>(&name_length), sizeof(name_length));
+    if (!in || width <= 0 || height <= 0 || name_length > 64)
+        return false;
+    sampler_name.resize(name_length);
+    in.read(&sampler_name[0], name_length);
+
+    in.read(reinterpret_cast<char*>(&range_count), sizeof(range_count));
+    if (!in || range_count > (1u << 20))
+        return false;
+    ranges.resize(range_count);
+    in.read(reinterpret_cast<char*>(ranges.data()), range_count * sizeof(sample_range));
+
+    image = framebuffer(width, height);
+    in.read(reinterpret_cast<char*>(image.accum.data()), image.accum.size() * sizeof(color));
+    in.read(reinterpret_cast<char*>(image.samples.data()), image.samples.size() * sizeof(int));
+    return static_cast<bool>(in);
+}
+
+
+bool checkpoint::save(const std::string& file) const {
+    // Write a temporary file and rename it, so an interrupted save never destroys the
+    // previous checkpoint.
+    std::string temp = file + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary);
+        uint32_t name_length = sampler_name.size();
+        uint32_t range_count = ranges.size();
+
+        out.write("RTCK", 4);
+        out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        out.write(reinterpret_cast<const char*>(&hash), sizeof(hash));
+        out.write(reinterpret_cast<const char*>(&image.width), sizeof(image.width));
+        out.write(reinterpret_cast<const char*>(&image.height), sizeof(image.height));
+        out.write(reinterpret_cast<const char*>(&seed), sizeof(seed));
+        out.write(reinterpret_cast<const char*>(&name_length), sizeof(name_length));
+        out.write(sampler_name.data(), name_length);
+        out.write(reinterpret_cast<const char*>(&range_count), sizeof(range_count));
+        out.write(reinterpret_cast<const char*>(ranges.data()), range_count * sizeof(sample_range));
+        out.write(reinterpret_cast<const char*>(image.accum.data()), image.accum.size() * sizeof(color));
+        out.write(reinterpret_cast<const char*>(image.samples.data()), image.samples.size() * sizeof(int));
+        if (!out)
+            return false;
+    }
+    return std::rename(temp.c_str(), file.c_str()) == 0;
+}
+
+
+// Adds the samples of another checkpoint of the same scene. The two must come from the same
+// sample sequence and hold disjoint sample index ranges, otherwise samples would be counted
+// twice.
+bool checkpoint::merge(const checkpoint& other, std::string& error) {
+    if (ranges.empty()) {
+        *this = other;
+        return true;
+    }
+    if (other.hash != hash || other.image.width != image.width || other.image.height != image.height) {
+        error = "checkpoint is of a different scene";
+        return false;
+    }
+    if (other.sampler_name != sampler_name || other.seed != seed) {
+        error = "checkpoint used a different sampler or seed";
+        return false;
+    }
+    for (const auto& r : other.ranges) {
+        if (overlaps(r)) {
+            error = "checkpoint sample ranges overlap";
+            return false;
+        }
+    }
+
+    for (const auto& r : other.ranges)
+        add_range(r);
+    for (size_t k = 0; k < image.accum.size(); k++) {
+        image.accum[k] += other.image.accum[k];
+        image.samples[k] += other.image.samples[k];
+    }
+    return true;
+}
+
+
+#endif
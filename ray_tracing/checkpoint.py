@@ -0,0 +1,62 @@
+"""Reads and writes the renderer's checkpoint files (see checkpoint.h for the layout)."""
+import struct
+
+MAGIC = b'RTCK'
+VERSION = 1
+
+
+class Checkpoint:
+    def __init__(self, scene_hash, width, height, seed, sampler, ranges, accum, samples):
+        self.scene_hash = scene_hash
+        self.width = width
+        self.height = height
+        self.seed = seed
+        self.sampler = sampler
+        self.ranges = ranges        # [(begin, end)] sample index ranges
+        self.accum = accum          # bytes, 3 doubles per pixel, rows bottom to top
+        self.samples = samples      # bytes, one int32 per pixel
+
+    @classmethod
+    def parse(cls, data):
+        if data[:4] != MAGIC or struct.unpack_from('<I', data, 4)[0] != VERSION:
+            raise ValueError("not a checkpoint file")
+        scene_hash, width, height, seed, name_length = struct.unpack_from('<QiiQI', data, 8)
+        offset = 8 + struct.calcsize('<QiiQI')
+        sampler = data[offset:offset + name_length].decode()
+        offset += name_length
+        range_count, = struct.unpack_from('<I', data, offset)
+        offset += 4
+        ranges = [struct.unpack_from('<II', data, offset + 8 * k) for k in range(range_count)]
+        offset += 8 * range_count
+        pixels = width * height
+        accum = data[offset:offset + 24 * pixels]
+        samples = data[offset + 24 * pixels:offset + 28 * pixels]
+        if len(samples) != 4 * pixels:
+            raise ValueError("truncated checkpoint file")
+        return cls(scene_hash, width, height, seed, sampler, ranges, accum, samples)
+
+    def serialize(self):
+        name = self.sampler.encode()
+        header = MAGIC + struct.pack('<IQiiQI', VERSION, self.scene_hash, self.width,
+                                     self.height, self.seed, len(name))
+        ranges = struct.pack('<I', len(self.ranges))
+        ranges += b''.join(struct.pack('<II', begin, end) for begin, end in self.ranges)
+        return header + name + ranges + bytes(self.accum) + bytes(self.samples)
+
+    def tile(self, x0, y0, x1, y1):
+        """Accumulation and sample count bytes of the pixels x0 <= x < x1, y0 <= y < y1."""
+        accum = b''.join(self.accum[24 * (y * self.width + x0):24 * (y * self.width + x1)]
+                         for y in range(y0, y1))
+        samples = b''.join(self.samples[4 * (y * self.width + x0):4 * (y * self.width + x1)]
+                           for y in range(y0, y1))
+        return accum, samples
+
+    def set_tile(self, x0, y0, x1, y1, accum, samples):
+        if not isinstance(self.accum, bytearray):
+            self.accum = bytearray(self.accum)
+            self.samples = bytearray(self.samples)
+        row = x1 - x0
+        for k, y in enumerate(range(y0, y1)):
+            start = y * self.width + x0
+            self.accum[24 * start:24 * (start + row)] = accum[24 * k * row:24 * (k + 1) * row]
+            self.samples[4 * start:4 * (start + row)] = samples[4 * k * row:4 * (k + 1) * row]
@@ -14,39 +14,26 @@
 #include "vec3.h"
 
 #include <iostream>
+#include <string>
 
 using namespace std;
 
-extern vector<vector<string>> pixels;
-
-void write_color(int i, int j, color pixel_color, int samples_per_pixel) {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
-
+// One component of a pixel's color in [0,255], from the sum of its samples.
+inline int color_byte(double component, int samples_per_pixel) {
     // Replace NaN components with zero. See explanation in Ray Tracing: The Rest of Your Life.
-    if (r != r) r = 0.0;
-    if (g != g) g = 0.0;
-    if (b != b) b = 0.0;
+    if (component != component) component = 0.0;
 
     // Divide the color by the number of samples and gamma-correct for gamma=2.0.
-    auto scale = 1.0 / samples_per_pixel;
-    r = sqrt(scale * r);
-    g = sqrt(scale * g);
-    b = sqrt(scale * b);
+    auto scale = samples_per_pixel > 0 ? 1.0 / samples_per_pixel : 0.0;
+    return static_cast<int>(256 * clamp(sqrt(scale * component), 0.0, 0.999));
+}
+
 
+string color_string(color pixel_color, int samples_per_pixel) {
     // Write the translated [0,255] value of each color component.
-    string output = to_string(static_cast<int>(256 * clamp(r, 0.0, 0.999))) + " "
-                  + to_string(static_cast<int>(256 * clamp(g, 0.0, 0.999))) + " "
-                  + to_string(static_cast<int>(256 * clamp(b, 0.0, 0.999))) + "\n";
-    //pixel.replace(pixel.begin(), pixel.end(), output);
-    pixels[i][j] = output;
-
-    /*
-    out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
-    */
+    return to_string(color_byte(pixel_color.x(), samples_per_pixel)) + " "
+         + to_string(color_byte(pixel_color.y(), samples_per_pixel)) + " "
+         + to_string(color_byte(pixel_color.z(), samples_per_pixel)) + "\n";
 }
 
 
@@ -15,10 +15,19 @@
 
 #include "hittable.h"
 #include "material.h"
+#include "sampler.h"
 #include "texture.h"
 
 
-class constant_medium : public hittable  {
+// A participating medium: its hits are where rays scatter inside it, and its transmittance(),
+// which shadow rays take (sample_light() in scene.h), is estimated rather than all or nothing.
+class medium : public hittable {
+    public:
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override = 0;
+};
+
+
+class constant_medium : public medium  {
     public:
         constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
             : boundary(b),
@@ -39,6 +48,13 @@ class constant_medium : public hittable  {
             return boundary->bounding_box(time0, time1, output_box);
         }
 
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            double t0, t1;
+            if (!boundary->interval(r, t_min, t_max, t0, t1))
+                return 1;
+            return exp((t1 - fmax(t0, 0)) * r.direction().length() / neg_inv_density);
+        }
+
     public:
         shared_ptr<hittable> boundary;
         shared_ptr<material> phase_function;
@@ -51,33 +67,25 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
     const bool enableDebug = false;
     const bool debugging = enableDebug && random_double() < 0.00001;
 
-    hit_record rec1, rec2;
-
-    if (!boundary->hit(r, -infinity, infinity, rec1))
-        return false;
-
-    if (!boundary->hit(r, rec1.t+0.0001, infinity, rec2))
+    // Entry and exit in one query of the boundary (hittable::interval), which boxes and
+    // spheres answer without intersecting the ray twice.
+    double t0, t1;
+    if (!boundary->interval(r, t_min, t_max, t0, t1))
         return false;
 
-    if (debugging) std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
-
-    if (rec1.t < t_min) rec1.t = t_min;
-    if (rec2.t > t_max) rec2.t = t_max;
-
-    if (rec1.t >= rec2.t)
-        return false;
+    if (debugging) std::cerr << "\nt_min=" << t0 << ", t_max=" << t1 << '\n';
 
-    if (rec1.t < 0)
-        rec1.t = 0;
+    if (t0 < 0)
+        t0 = 0;
 
     const auto ray_length = r.direction().length();
-    const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-    const auto hit_distance = neg_inv_density * log(random_double());
+    const auto distance_inside_boundary = (t1 - t0) * ray_length;
+    const auto hit_distance = neg_inv_density * log(1 - sample_1d());
 
     if (hit_distance > distance_inside_boundary)
         return false;
 
-    rec.t = rec1.t + hit_distance / ray_length;
+    rec.t = t0 + hit_distance / ray_length;
     rec.p = r.at(rec.t);
 
     if (debugging) {
@@ -88,6 +96,8 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
     rec.normal = vec3(1,0,0);  // arbitrary
     rec.front_face = true;     // also arbitrary
+    rec.footprint = 0;
+    rec.light = -1;
     rec.mat_ptr = phase_function;
 
     return true;
@@ -0,0 +1,80 @@
+"""Error-vs-time convergence benchmark for the samplers of a.out.
+
+Renders a reference image once with the independent sampler, then renders the same scene
+with every sampler, writing float snapshots at a series of spp checkpoints in a single run,
+and reports the RMSE of each snapshot against the reference together with its wall time.
+
+usage: python3 convergence.py [--ref-spp N] [--spp 1,2,4,...] [--csv file] -- scene args
+  e.g. python3 convergence.py --ref-spp 1024 -- 1 mv_mat_0.txt norm_mat_0.txt 2
+"""
+import argparse
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+from pfm import read_pfm
+
+
+def rmse(image, reference):
+    total = 0.0
+    for a, b in zip(image, reference):
+        total += (a - b) * (a - b)
+    return math.sqrt(total / len(reference))
+
+
+def render(binary, sampler, checkpoints, prefix, scene, seed=0):
+    args = [binary, '-f', '-s', sampler, '-x', str(seed),
+            '-c', ','.join(map(str, checkpoints)), '-o', prefix, str(max(checkpoints))] + scene
+    result = subprocess.run(args, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    if result.returncode != 0:
+        sys.exit(f"render failed: {' '.join(args)}\n{result.stderr}")
+    times = {}
+    for name, seconds in re.findall(r"snapshot (\S+) ([0-9.eE+-]+)s", result.stderr):
+        spp = int(re.search(r"(\d+)\.pfm$", name).group(1))
+        times[spp] = float(seconds)
+    return times
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--binary', default='./a.out')
+    parser.add_argument('--ref-spp', type=int, default=1024)
+    parser.add_argument('--spp', default='1,2,4,8,16,32,64')
+    parser.add_argument('--samplers', default='independent,sobol,bluenoise')
+    parser.add_argument('--csv', help="also write the results to this CSV file")
+    parser.add_argument('scene', nargs='+', help="n [pos_mat norm_mat material] * n")
+    args = parser.parse_args()
+
+    checkpoints = sorted(int(s) for s in args.spp.split(','))
+    with tempfile.TemporaryDirectory() as tmp:
+        print(f"rendering reference at {args.ref_spp} spp", file=sys.stderr)
+        ref_prefix = os.path.join(tmp, 'ref_')
+        # A different seed keeps the reference independent of the candidate samples.
+        render(args.binary, 'independent', [args.ref_spp], ref_prefix, args.scene, seed=1)
+        _, _, reference = read_pfm(f"{ref_prefix}{args.ref_spp}.pfm")
+
+        rows = []
+        for sampler in args.samplers.split(','):
+            prefix = os.path.join(tmp, f"{sampler}_")
+            times = render(args.binary, sampler, checkpoints, prefix, args.scene)
+            for spp in checkpoints:
+                _, _, image = read_pfm(f"{prefix}{spp}.pfm")
+                rows.append((sampler, spp, times[spp], rmse(image, reference)))
+
+    print(f"{'sampler':<12} {'spp':>6} {'seconds':>9} {'rmse':>10}")
+    for sampler, spp, seconds, error in rows:
+        print(f"{sampler:<12} {spp:>6} {seconds:>9.3f} {error:>10.5f}")
+
+    if args.csv:
+        with open(args.csv, 'w') as f:
+            f.write("sampler,spp,seconds,rmse\n")
+            for row in rows:
+                f.write(','.join(map(str, row)) + "\n")
+
+
+if __name__ == '__main__':
+    main()
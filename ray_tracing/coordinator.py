@@ -0,0 +1,214 @@
+"""Distributes a render over worker processes (worker.py), possibly on other hosts.
+
+The image is split into tiles that are handed out to the workers one at a time. A tile whose
+worker dies is put back in the queue, and once the queue is empty idle workers duplicate the
+oldest unfinished tiles, so a straggler can't hold up the render; the first result wins.
+Every pixel sample is seeded from (seed, pixel, sample index) and each pixel is rendered
+entirely by one worker, so the merged checkpoint is bit-identical to a single-process render
+with the same sampler and seed.
+
+Workers check a shared token (--token or RT_WORKER_TOKEN); local workers get a random one if
+none is given.
+
+usage: python3 coordinator.py (--workers host:port,... | --local N) [--tile 100]
+                              [--token TOKEN] [--checkpoint merged.ckpt] [--output out.ppm]
+                              -- samples_per_pixel n [pos_mat norm_mat material] * n
+"""
+import argparse
+import os
+import secrets
+import socket
+import subprocess
+import sys
+import threading
+import time
+from collections import deque
+
+from checkpoint import Checkpoint
+from worker import recv_message, send_message
+
+
+class TileScheduler:
+    def __init__(self, tiles):
+        self.tiles = tiles
+        self.pending = deque(range(len(tiles)))
+        self.started = {}           # tile index -> time it was last handed out
+        self.results = {}           # tile index -> (header, payload)
+        self.condition = threading.Condition()
+
+    def next_tile(self):
+        with self.condition:
+            while True:
+                if len(self.results) == len(self.tiles):
+                    return None
+                if self.pending:
+                    index = self.pending.popleft()
+                    self.started[index] = time.monotonic()
+                    return index
+                unfinished = [k for k in self.started if k not in self.results]
+                if unfinished:
+                    # Duplicate the tile that has been running the longest.
+                    index = min(unfinished, key=lambda k: self.started[k])
+                    self.started[index] = time.monotonic()
+                    return index
+                self.condition.wait()
+
+    def finish(self, index, header, payload):
+        with self.condition:
+            self.results.setdefault(index, (header, payload))
+            self.condition.notify_all()
+
+    def fail(self, index):
+        with self.condition:
+            if index not in self.results and index not in self.pending:
+                self.pending.append(index)
+            self.condition.notify_all()
+
+
+# Timeouts in a row after which a worker is taken to be unreachable and dropped.
+MAX_TIMEOUTS = 3
+
+
+def run_worker(address, scheduler, job, timeout, log):
+    host, port = address.rsplit(':', 1)
+    sock = None
+    timeouts = 0
+    while True:
+        index = scheduler.next_tile()
+        if index is None:
+            break
+        try:
+            if sock is None:
+                sock = socket.create_connection((host, int(port)), timeout=timeout)
+            send_message(sock, dict(job, job=index, tile=scheduler.tiles[index]))
+            header, payload = recv_message(sock)
+            if 'error' in header:
+                raise RuntimeError(header['error'])
+            scheduler.finish(index, header, payload)
+            timeouts = 0
+        except socket.timeout:
+            # Straggler: hand the tile to someone else and start over on a new connection.
+            scheduler.fail(index)
+            if sock is not None:
+                sock.close()
+                sock = None
+            timeouts += 1
+            if timeouts >= MAX_TIMEOUTS:
+                log(f"{address}: tile {index} timed out, {timeouts} in a row; reissued, worker dropped")
+                break
+            log(f"{address}: tile {index} timed out, reissuing")
+        except (OSError, ConnectionError, RuntimeError, ValueError) as error:
+            log(f"{address}: {error}; tile {index} reissued, worker dropped")
+            scheduler.fail(index)
+            break
+    if sock is not None:
+        sock.close()
+
+
+def merge(scheduler):
+    first, _ = next(iter(scheduler.results.values()))
+    merged = Checkpoint(first['scene_hash'], first['width'], first['height'], first['seed'],
+                        first['sampler'], [tuple(r) for r in first['ranges']],
+                        bytearray(24 * first['width'] * first['height']),
+                        bytearray(4 * first['width'] * first['height']))
+    # Tiles are disjoint, so copying them in tile order is deterministic.
+    for index in sorted(scheduler.results):
+        header, payload = scheduler.results[index]
+        if header['scene_hash'] != merged.scene_hash:
+            raise ValueError(f"tile {index} was rendered from a different scene")
+        x0, y0, x1, y1 = header['tile']
+        pixels = (x1 - x0) * (y1 - y0)
+        merged.set_tile(x0, y0, x1, y1, payload[:24 * pixels], payload[24 * pixels:])
+    return merged
+
+
+def start_local_workers(count, binary, token):
+    workers, addresses = [], []
+    script = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'worker.py')
+    # The token goes in the environment rather than on the command line, where ps shows it.
+    env = dict(os.environ, RT_WORKER_TOKEN=token)
+    for _ in range(count):
+        process = subprocess.Popen([sys.executable, script, '--host', '127.0.0.1', '--port', '0',
+                                    '--binary', binary], stdout=subprocess.PIPE, text=True,
+                                   env=env)
+        addresses.append(process.stdout.readline().split()[-1])
+        workers.append(process)
+    return workers, addresses
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--workers', help="comma separated host:port list")
+    parser.add_argument('--local', type=int, default=0, help="start N workers on this host")
+    parser.add_argument('--binary', default='./a.out')
+    parser.add_argument('--tile', type=int, default=100, help="tile size in pixels")
+    parser.add_argument('--size', default='400x400', help="image size of the renderer")
+    parser.add_argument('--sampler', default='sobol')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--token', default=os.environ.get('RT_WORKER_TOKEN'),
+                        help="shared with the workers (default $RT_WORKER_TOKEN)")
+    parser.add_argument('--timeout', type=float, default=600,
+                        help="seconds before a tile is reissued to another worker")
+    parser.add_argument('--checkpoint', default='merged.ckpt')
+    parser.add_argument('--output', help="also write the image, via a.out -r")
+    parser.add_argument('scene', nargs='+', help="samples_per_pixel n [pos_mat norm_mat material] * n")
+    args = parser.parse_args()
+
+    width, height = map(int, args.size.split('x'))
+    tiles = [[x, y, min(x + args.tile, width), min(y + args.tile, height)]
+             for y in range(0, height, args.tile) for x in range(0, width, args.tile)]
+    # The workers get the scene as fields, not as a.out arguments: the instances, and the
+    # matrix files they name by contents.
+    count = int(args.scene[1])
+    if len(args.scene) != 2 + 3 * count:
+        sys.exit("the scene needs samples_per_pixel n and n [pos_mat norm_mat material]")
+    instances, files = [], {}
+    for i in range(count):
+        position, normal, material = args.scene[2 + 3 * i : 5 + 3 * i]
+        for name in (position, normal):
+            with open(name) as f:
+                files[name] = f.read()
+        instances.append({'position': position, 'normal': normal, 'material': int(material)})
+    if not args.token:
+        if args.workers:
+            sys.exit("no token for the workers: give --token or set RT_WORKER_TOKEN")
+        args.token = secrets.token_hex(16)
+    job = {'token': args.token, 'instances': instances, 'files': files,
+           'spp': int(args.scene[0]), 'sampler': args.sampler, 'seed': args.seed}
+
+    local_workers, addresses = start_local_workers(args.local, os.path.abspath(args.binary),
+                                                   args.token)
+    if args.workers:
+        addresses += args.workers.split(',')
+    if not addresses:
+        sys.exit("no workers: give --workers or --local")
+
+    start = time.monotonic()
+    scheduler = TileScheduler(tiles)
+    log = lambda message: print(message, file=sys.stderr)
+    threads = [threading.Thread(target=run_worker, args=(a, scheduler, job, args.timeout, log))
+               for a in addresses]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    for process in local_workers:
+        process.terminate()
+
+    if len(scheduler.results) != len(tiles):
+        sys.exit(f"{len(tiles) - len(scheduler.results)} tiles could not be rendered")
+    merged = merge(scheduler)
+    with open(args.checkpoint, 'wb') as f:
+        f.write(merged.serialize())
+    print(f"rendered {len(tiles)} tiles on {len(addresses)} workers in "
+          f"{time.monotonic() - start:.2f}s", file=sys.stderr)
+
+    if args.output:
+        with open(args.output, 'wb') as out:
+            subprocess.run([args.binary, '-s', args.sampler, '-x', str(args.seed),
+                            '-r', args.checkpoint] + args.scene, stdout=out, check=True)
+
+
+if __name__ == '__main__':
+    main()
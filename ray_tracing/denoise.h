@@ -0,0 +1,299 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "rtweekend.h"
+
+#include "framebuffer.h"
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+
+// First-hit features of every pixel's samples, summed like the framebuffer: the albedo,
+// normal, distance and emission of what the camera rays hit first (albedo 1, the background
+// and 0 where they escape), and the squared luminance of the samples' reflected light for the
+// denoiser's noise estimate.
+class aov_buffer {
+    public:
+        aov_buffer() : width(0), height(0) {}
+        aov_buffer(int w, int h)
+            : width(w), height(h), albedo(w * h, color(0,0,0)), normal(w * h, vec3(0,0,0)),
+              depth(w * h, 0), emitted(w * h, color(0,0,0)), luminance2(w * h, 0),
+              samples(w * h, 0) {}
+
+        int index(int i, int j) const { return j * width + i; }
+
+        void add_sample(int i, int j, const color& a, const vec3& n, double z, const color& e,
+                        const color& c) {
+            int k = index(i, j);
+            double l = luminance(c - e);
+            albedo[k] += a;
+            normal[k] += n;
+            depth[k] += z;
+            emitted[k] += e;
+            luminance2[k] += l == l ? l * l : 0;
+            samples[k]++;
+        }
+
+        // Writes the averages to prefix + albedo.pfm, normal.pfm (components -1 to 1) and
+        // depth.pfm (gray).
+        bool write(const std::string& prefix) const {
+            framebuffer out(width, height);
+            out.samples = samples;
+            out.accum = albedo;
+            bool written = out.write(prefix + "albedo.pfm", image_format::pfm);
+            out.accum = normal;
+            written = out.write(prefix + "normal.pfm", image_format::pfm) && written;
+            for (size_t k = 0; k < depth.size(); k++)
+                out.accum[k] = color(depth[k], depth[k], depth[k]);
+            return out.write(prefix + "depth.pfm", image_format::pfm) && written;
+        }
+
+        static double luminance(const color& c) {
+            return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+        }
+
+    public:
+        int width;
+        int height;
+        std::vector<color> albedo;
+        std::vector<vec3> normal;
+        std::vector<double> depth;
+        std::vector<color> emitted;
+        std::vector<double> luminance2;
+        std::vector<int> samples;
+};
+
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010), steered by the noise of each
+// pixel as in SVGF (Schied et al. 2017). Only the light reflected at the first hit is
+// filtered: the emission seen directly (the light, the background) stays sharp. It is divided
+// by the albedo, so texture and material edges survive, and filtered in `iterations` passes
+// of a 5x5 B3 spline kernel whose taps are 2^pass pixels apart. A tap's weight falls off with
+// the difference in albedo, in normal, in depth relative to the local depth gradient, and
+// (from pass luminance_from_pass on) in luminance relative to the pixel's estimated noise.
+// The variance is filtered along with the color, so later, wider passes smooth less. Buffers
+// are planar floats, split into rows across the threads.
+//
+// Pixels with no AOV samples (e.g. history kept by -H) are passed through and don't
+// contribute to their neighbours.
+class atrous_denoiser {
+    public:
+        atrous_denoiser(const framebuffer& image, const aov_buffer& aov, int threads = 16,
+                        int iterations = 5);
+
+        framebuffer run();
+
+    public:
+        float sigma_luminance = 4;
+        int normal_sharpness = 7;       // the normal weight is cosine^(2^normal_sharpness)
+        float sigma_depth = 4;
+        float sigma_albedo = 0.1f;
+        int luminance_from_pass = 1;    // at a few spp the first pass can't tell edges from noise
+
+    private:
+        struct job {
+            atrous_denoiser* self;
+            int thread;
+        };
+
+        static void* work(void* arg);
+        void prepare(int j);
+        void filter_row(int j, int step);
+
+        const framebuffer& image;
+        const aov_buffer& aov;
+        int width, height, threads, iterations;
+        pthread_barrier_t barrier;
+
+        std::vector<float> r, g, b, variance;       // demodulated color, ping
+        std::vector<float> r2, g2, b2, variance2;   // pong
+        std::vector<float> ar, ag, ab;              // albedo
+        std::vector<float> er, eg, eb;              // emission
+        std::vector<float> nx, ny, nz, z, gradient, known;
+};
+
+
+atrous_denoiser::atrous_denoiser(const framebuffer& image, const aov_buffer& aov, int threads,
+                                 int iterations)
+    : image(image), aov(aov), width(image.width), height(image.height), threads(threads),
+      iterations(iterations) {
+    size_t n = size_t(width) * height;
+    for (auto v : {&r, &g, &b, &variance, &r2, &g2, &b2, &variance2, &ar, &ag, &ab, &er, &eg, &eb,
+                   &nx, &ny, &nz, &z, &gradient, &known})
+        v->assign(n, 0.0f);
+}
+
+
+void* atrous_denoiser::work(void* arg) {
+    auto job = static_cast<atrous_denoiser::job*>(arg);
+    auto self = job->self;
+    for (int j = job->thread; j < self->height; j += self->threads)
+        self->prepare(j);
+    pthread_barrier_wait(&self->barrier);
+    // The depth gradient needs the neighbouring rows.
+    for (int j = job->thread; j < self->height; j += self->threads) {
+        for (int i = 0; i < self->width; i++) {
+            int k = j * self->width + i;
+            int left = std::max(i - 1, 0), right = std::min(i + 1, self->width - 1);
+            int down = std::max(j - 1, 0), up = std::min(j + 1, self->height - 1);
+            float dx = std::fabs(self->z[j * self->width + right]
+                                 - self->z[j * self->width + left]);
+            float dy = std::fabs(self->z[up * self->width + i] - self->z[down * self->width + i]);
+            self->gradient[k] = 0.5f * std::max(dx, dy);
+        }
+    }
+    for (int pass = 0; pass < self->iterations; pass++) {
+        pthread_barrier_wait(&self->barrier);
+        for (int j = job->thread; j < self->height; j += self->threads)
+            self->filter_row(j, 1 << pass);
+        if (pthread_barrier_wait(&self->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            std::swap(self->r, self->r2);
+            std::swap(self->g, self->g2);
+            std::swap(self->b, self->b2);
+            std::swap(self->variance, self->variance2);
+        }
+    }
+    return nullptr;
+}
+
+
+void atrous_denoiser::prepare(int j) {
+    for (int i = 0; i < width; i++) {
+        int k = j * width + i;
+        int n = image.samples[k], m = aov.samples[k];
+        color e = m > 0 ? aov.emitted[k] / m : color(0,0,0);
+        color mean = image.average(i, j) - e;
+        for (int c = 0; c < 3; c++)
+            if (mean[c] != mean[c]) mean[c] = 0;
+        er[k] = e.x(); eg[k] = e.y(); eb[k] = e.z();
+        color a = m > 0 ? aov.albedo[k] / m : color(1,1,1);
+        for (int c = 0; c < 3; c++)
+            a[c] = std::fmax(a[c], 0.01);
+        ar[k] = a.x(); ag[k] = a.y(); ab[k] = a.z();
+        r[k] = mean.x() / a.x();
+        g[k] = mean.y() / a.y();
+        b[k] = mean.z() / a.z();
+
+        known[k] = n > 0 && m > 0;
+        if (!known[k])
+            continue;
+        // Variance of the pixel's mean luminance, from the spread of its samples.
+        double l = aov_buffer::luminance(mean);
+        double spread = m > 1 ? std::fmax(0.0, aov.luminance2[k] / m - l * l) * m / (m - 1) : l * l;
+        double la = aov_buffer::luminance(a);
+        variance[k] = spread / n / (la * la);
+        vec3 normal = aov.normal[k];
+        if (normal.length_squared() > 0)
+            normal = unit_vector(normal);
+        nx[k] = normal.x(); ny[k] = normal.y(); nz[k] = normal.z();
+        z[k] = aov.depth[k] / m;
+    }
+}
+
+
+void atrous_denoiser::filter_row(int j, int step) {
+    static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    // 1 / taxicab distance of each tap in steps; the center tap has no depth difference.
+    static const float inverse_distance[5][5] = {
+        {0.25f, 1.0f / 3, 0.5f, 1.0f / 3, 0.25f},
+        {1.0f / 3, 0.5f, 1.0f, 0.5f, 1.0f / 3},
+        {0.5f, 1.0f, 0.0f, 1.0f, 0.5f},
+        {1.0f / 3, 0.5f, 1.0f, 0.5f, 1.0f / 3},
+        {0.25f, 1.0f / 3, 0.5f, 1.0f / 3, 0.25f}};
+    // Locals, so the compiler knows the loops don't write through them.
+    const float *R = r.data(), *G = g.data(), *B = b.data(), *V = variance.data();
+    const float *NX = nx.data(), *NY = ny.data(), *NZ = nz.data(), *Z = z.data();
+    const float *AR = ar.data(), *AG = ag.data(), *AB = ab.data();
+    const float* K = known.data();
+    float albedo_scale = 1 / sigma_albedo;
+
+    for (int i = 0; i < width; i++) {
+        int p = j * width + i;
+        if (!K[p]) {
+            r2[p] = R[p]; g2[p] = G[p]; b2[p] = B[p]; variance2[p] = V[p];
+            continue;
+        }
+
+        // Noise of the pixel from its 3x3 neighbourhood, which is steadier than its own.
+        float local = 0, local_weight = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int x = i + dx, y = j + dy;
+                if (x < 0 || x >= width || y < 0 || y >= height)
+                    continue;
+                float w = (dx ? 0.5f : 1.0f) * (dy ? 0.5f : 1.0f) * K[y * width + x];
+                local += w * V[y * width + x];
+                local_weight += w;
+            }
+        }
+        float luminance_scale = step < (1 << luminance_from_pass) ? 0.0f
+                              : 1.0f / (sigma_luminance * std::sqrt(local / local_weight) + 1e-4f);
+        float lp = 0.2126f * R[p] + 0.7152f * G[p] + 0.0722f * B[p];
+        float np_unset = 1 - (NX[p] * NX[p] + NY[p] * NY[p] + NZ[p] * NZ[p]);
+        float depth_scale = 1.0f / (sigma_depth * gradient[p] * step + 1e-3f * Z[p] + 1e-6f);
+
+        int tx0 = std::max(0, 2 - i / step), tx1 = std::min(4, 2 + (width - 1 - i) / step);
+        int ty0 = std::max(0, 2 - j / step), ty1 = std::min(4, 2 + (height - 1 - j) / step);
+        float sr = 0, sg = 0, sb = 0, sv = 0, sw = 0;
+        for (int ty = ty0; ty <= ty1; ty++) {
+            int row = (j + (ty - 2) * step) * width;
+            for (int tx = tx0; tx <= tx1; tx++) {
+                int q = row + i + (tx - 2) * step;
+                float lq = 0.2126f * R[q] + 0.7152f * G[q] + 0.0722f * B[q];
+                // Escaped rays have no normal; they only blend with each other.
+                float cosine = NX[p] * NX[q] + NY[p] * NY[q] + NZ[p] * NZ[q]
+                             + np_unset * (1 - (NX[q] * NX[q] + NY[q] * NY[q] + NZ[q] * NZ[q]));
+                float wn = std::fmax(cosine, 0.0f);
+                for (int e = 0; e < normal_sharpness; e++)
+                    wn *= wn;
+                float wz = std::fabs(Z[p] - Z[q]) * depth_scale * inverse_distance[ty][tx];
+                float wl = std::fabs(lp - lq) * luminance_scale;
+                float wa = (std::fabs(AR[p] - AR[q]) + std::fabs(AG[p] - AG[q])
+                            + std::fabs(AB[p] - AB[q])) * albedo_scale;
+                float w = kernel[tx] * kernel[ty] * K[q] * wn * std::exp(-wz - wl - wa);
+                sr += w * R[q];
+                sg += w * G[q];
+                sb += w * B[q];
+                sv += w * w * V[q];
+                sw += w;
+            }
+        }
+        // The center tap always has a positive weight.
+        r2[p] = sr / sw;
+        g2[p] = sg / sw;
+        b2[p] = sb / sw;
+        variance2[p] = sv / (sw * sw);
+    }
+}
+
+
+framebuffer atrous_denoiser::run() {
+    pthread_barrier_init(&barrier, NULL, threads);
+    std::vector<pthread_t> workers(threads);
+    std::vector<job> jobs(threads);
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = {this, t};
+        pthread_create(&workers[t], NULL, work, &jobs[t]);
+    }
+    for (auto& worker : workers)
+        pthread_join(worker, NULL);
+    pthread_barrier_destroy(&barrier);
+
+    // Put the albedo back; one "sample" per pixel that had any.
+    framebuffer result(width, height);
+    for (int k = 0; k < width * height; k++) {
+        if (image.samples[k] == 0)
+            continue;
+        result.accum[k] = color(r[k] * ar[k] + er[k], g[k] * ag[k] + eg[k], b[k] * ab[k] + eb[k]);
+        result.samples[k] = 1;
+    }
+    return result;
+}
+
+
+#endif
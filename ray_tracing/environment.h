@@ -0,0 +1,191 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "rtweekend.h"
+
+#include "image_codec.h"
+#include "lights.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+
+// The light from infinitely far away that rays which leave the scene find: a constant color,
+// or an HDR map in latitude-longitude, each texel a constant radiance. The map's top row is
+// straight up (+y), its bottom straight down, and its middle column looks along -z, the way
+// the camera looks; u grows to the right of that, towards +x.
+//
+// A map is sampled for the paths' vertices (next event estimation) either uniformly over the
+// hemisphere the material scatters into, or in proportion to its texels' luminance times the
+// solid angle they take up, through a precomputed 2D distribution: the cumulative sums of
+// each row, to pick a column in it, and of the rows, to pick a row. A sun a few texels wide
+// is then found by nearly every sample rather than by one in thousands.
+class environment {
+    public:
+        enum sampling { uniform, importance };
+
+        environment(const color& constant = color(0,0,0)) : constant(constant) {}
+        // rgb: width x height linear RGB floats, top row first, scaled by scale.
+        environment(const std::vector<float>& rgb, int width, int height, double scale = 1);
+
+        color value(const vec3& direction) const;
+
+        // Whether sample() is worth calling: the map has something in it. A constant color
+        // is left to the paths.
+        bool sampled() const { return total > 0; }
+
+        // A direction towards the map for a point scattering to the side of side (every way
+        // if it is zero), and its density per solid angle.
+        vec3 sample(const vec3& side, double u1, double u2, double& pdf) const;
+        double pdf(const vec3& side, const vec3& direction) const;
+
+        int width() const { return columns; }
+        int height() const { return rows; }
+        // The map's texels, top row first, e.g. to hash it; none for a constant color.
+        const color* data() const { return texels.data(); }
+        size_t size() const { return texels.size(); }
+
+    public:
+        sampling mode = importance;
+
+    private:
+        void texel_of(const vec3& direction, int& x, int& y, double& sin_theta) const;
+
+        color constant;
+        int columns = 0, rows = 0;
+        std::vector<color> texels;
+        std::vector<double> row_cdf;    // rows + 1 of them, from 0 to 1
+        std::vector<double> column_cdf; // columns + 1 for each row, from 0 to 1
+        std::vector<double> weight;     // of each texel, luminance times sin(theta)
+        double total = 0;               // of the weights, over the texels
+};
+
+
+environment::environment(const std::vector<float>& rgb, int width, int height, double scale)
+    : columns(width), rows(height) {
+    texels.resize(size_t(width) * height);
+    weight.resize(texels.size());
+    column_cdf.resize(size_t(width + 1) * height);
+    row_cdf.assign(height + 1, 0);
+    for (int y = 0; y < height; y++) {
+        double sin_theta = sin(pi * (y + 0.5) / height);
+        double* cdf = &column_cdf[size_t(width + 1) * y];
+        cdf[0] = 0;
+        for (int x = 0; x < width; x++) {
+            size_t k = size_t(y) * width + x;
+            texels[k] = scale * color(rgb[3*k], rgb[3*k + 1], rgb[3*k + 2]);
+            weight[k] = fmax(0, luminance(texels[k])) * sin_theta;
+            cdf[x + 1] = cdf[x] + weight[k];
+        }
+        double row_sum = cdf[width];
+        for (int x = 1; x <= width; x++)
+            cdf[x] = row_sum > 0 ? cdf[x] / row_sum : double(x) / width;
+        row_cdf[y + 1] = row_cdf[y] + row_sum;
+    }
+    total = row_cdf[height];
+    for (auto& c : row_cdf)
+        c = total > 0 ? c / total : 0;
+}
+
+
+void environment::texel_of(const vec3& direction, int& x, int& y, double& sin_theta) const {
+    vec3 d = unit_vector(direction);
+    double theta = acos(clamp(d.y(), -1, 1));
+    double phi = atan2(d.x(), -d.z());
+    sin_theta = sin(theta);
+    x = std::min(static_cast<int>((phi + pi) / (2*pi) * columns), columns - 1);
+    y = std::min(static_cast<int>(theta / pi * rows), rows - 1);
+}
+
+
+color environment::value(const vec3& direction) const {
+    if (texels.empty())
+        return constant;
+    int x, y;
+    double sin_theta;
+    texel_of(direction, x, y, sin_theta);
+    return texels[size_t(y) * columns + x];
+}
+
+
+vec3 environment::sample(const vec3& side, double u1, double u2, double& pdf) const {
+    if (mode == uniform) {
+        // Uniform over the sphere, mirrored into side's hemisphere.
+        double z = 1 - 2 * u1, r = sqrt(fmax(0, 1 - z*z)), phi = 2*pi * u2;
+        vec3 d(r * cos(phi), r * sin(phi), z);
+        bool hemisphere = side.length_squared() > 0;
+        if (hemisphere && dot(d, side) < 0)
+            d = -d;
+        pdf = hemisphere ? 1 / (2*pi) : 1 / (4*pi);
+        return d;
+    }
+
+    // A row by the marginal distribution, then a column by the row's, each found by binary
+    // search and the sample spread across the texel.
+    int y = static_cast<int>(std::upper_bound(row_cdf.begin(), row_cdf.end(), u1)
+                             - row_cdf.begin()) - 1;
+    y = std::min(std::max(y, 0), rows - 1);
+    while (row_cdf[y + 1] == row_cdf[y] && y > 0)      // u1 on the edge of an empty row
+        y--;
+    const double* cdf = &column_cdf[size_t(columns + 1) * y];
+    int x = static_cast<int>(std::upper_bound(cdf, cdf + columns + 1, u2) - cdf) - 1;
+    x = std::min(std::max(x, 0), columns - 1);
+    while (cdf[x + 1] == cdf[x] && x > 0)
+        x--;
+    double dv = (u1 - row_cdf[y]) / (row_cdf[y + 1] - row_cdf[y]);
+    double du = (u2 - cdf[x]) / (cdf[x + 1] - cdf[x]);
+    double theta = pi * (y + clamp(dv, 0, 1)) / rows;
+    double phi = 2*pi * (x + clamp(du, 0, 1)) / columns - pi;
+
+    double sin_theta = sin(theta);
+    vec3 d(sin_theta * sin(phi), cos(theta), -sin_theta * cos(phi));
+    // The texel's share of the weights over its share of the sphere's (u, v) square, and that
+    // square's 2 pi^2 sin(theta) of solid angle per unit.
+    double texel_pdf = weight[size_t(y) * columns + x] / total * columns * rows;
+    pdf = sin_theta > 0 ? texel_pdf / (2 * pi * pi * sin_theta) : 0;
+    return d;
+}
+
+
+double environment::pdf(const vec3& side, const vec3& direction) const {
+    if (mode == uniform) {
+        if (side.length_squared() == 0)
+            return 1 / (4*pi);
+        return dot(direction, side) > 0 ? 1 / (2*pi) : 0;
+    }
+    if (total == 0)
+        return 0;
+    int x, y;
+    double sin_theta;
+    texel_of(direction, x, y, sin_theta);
+    if (sin_theta <= 0)
+        return 0;
+    double texel_pdf = weight[size_t(y) * columns + x] / total * columns * rows;
+    return texel_pdf / (2 * pi * pi * sin_theta);
+}
+
+
+// The map in file, a PFM or Radiance RGBE image; false with error set if it can't be read.
+bool load_environment(const std::string& file, environment& env, std::string& error,
+                      double scale = 1) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+        error = "cannot read " + file;
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<float> rgb;
+    int width, height;
+    if (!decode_hdr_image(data, rgb, width, height, error)) {
+        error = file + ": " + error;
+        return false;
+    }
+    env = environment(rgb, width, height, scale);
+    return true;
+}
+
+
+#endif
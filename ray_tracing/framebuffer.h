@@ -0,0 +1,113 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "image_codec.h"
+
+#include <fstream>
+#include <vector>
+
+
+// Accumulation buffer for progressive rendering. Every pixel keeps the running sum of its
+// samples and how many were taken, so the buffer can be written out as a valid image at
+// any point of the render.
+class framebuffer {
+    public:
+        framebuffer() : width(0), height(0) {}
+        framebuffer(int w, int h)
+            : width(w), height(h), accum(w * h, color(0,0,0)), samples(w * h, 0) {}
+
+        int index(int i, int j) const { return j * width + i; }
+
+        void add_sample(int i, int j, const color& c) {
+            accum[index(i, j)] += c;
+            samples[index(i, j)]++;
+        }
+
+        color average(int i, int j) const {
+            int n = samples[index(i, j)];
+            return n > 0 ? accum[index(i, j)] / n : color(0,0,0);
+        }
+
+        // 8-bit gamma-corrected RGB as in the PPM, top row first, of the image or of the
+        // pixels [x0, x1) x [y0, y1).
+        std::vector<uint8_t> rgb8() const { return rgb8(0, 0, width, height); }
+        std::vector<uint8_t> rgb8(int x0, int y0, int x1, int y1) const;
+
+        void write_ppm(std::ostream& out) const;
+        void write_pfm(std::ostream& out) const;
+        void write(std::ostream& out, image_format format, int threads = 16) const;
+        bool write(const std::string& file, image_format format) const;
+
+    public:
+        int width;
+        int height;
+        std::vector<color> accum;
+        std::vector<int> samples;
+};
+
+
+std::vector<uint8_t> framebuffer::rgb8(int x0, int y0, int x1, int y1) const {
+    std::vector<uint8_t> rgb(3 * size_t(x1 - x0) * (y1 - y0));
+    size_t k = 0;
+    for (int j = y1-1; j >= y0; --j)
+        for (int i = x0; i < x1; ++i)
+            for (int c = 0; c < 3; c++)
+                rgb[k++] = color_byte(accum[index(i, j)][c], samples[index(i, j)]);
+    return rgb;
+}
+
+
+void framebuffer::write_ppm(std::ostream& out) const {
+    std::string body;
+    body.reserve(width * height * 12);
+
+    for (int j = height-1; j >= 0; --j)
+        for (int i = 0; i < width; ++i)
+            body += color_string(accum[index(i, j)], samples[index(i, j)]);
+
+    out << "P3\n" << width << ' ' << height << "\n255\n" << body;
+}
+
+
+// Linear float image in the Portable Float Map format, bottom row first.
+void framebuffer::write_pfm(std::ostream& out) const {
+    out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+
+    std::vector<float> row(3 * width);
+    for (int j = 0; j < height; ++j) {
+        for (int i = 0; i < width; ++i) {
+            color c = average(i, j);
+            for (int k = 0; k < 3; k++)
+                row[3*i + k] = c[k] == c[k] ? static_cast<float>(c[k]) : 0.0f;
+        }
+        out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+}
+
+
+void framebuffer::write(std::ostream& out, image_format format, int threads) const {
+    std::string encoded;
+    switch (format) {
+        case image_format::ppm: write_ppm(out); return;
+        case image_format::pfm: write_pfm(out); return;
+        case image_format::png: encoded = encode_png(rgb8(), width, height, threads); break;
+        case image_format::qoi: encoded = encode_qoi(rgb8(), width, height); break;
+    }
+    out.write(encoded.data(), encoded.size());
+}
+
+
+bool framebuffer::write(const std::string& file, image_format format) const {
+    std::ofstream out(file, std::ios::binary);
+    if (!out)
+        return false;
+    write(out, format);
+    out.close();    // flushes, so a full disk shows up here
+    return static_cast<bool>(out);
+}
+
+
+#endif
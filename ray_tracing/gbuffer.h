@@ -0,0 +1,261 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "framebuffer.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+// What a pixel sees through its center, and which instances (instance_id) the paths of its
+// samples hit.
+struct gbuffer_pixel {
+    uint64_t touched = 0;       // instance_bit of the instances a fair share of its paths hit
+    float depth = 0;            // distance from the eye, 0 where the ray escapes
+    float normal[3] = {0, 0, 0};
+    int32_t instance = -2;      // id of the instance seen, -1 for untagged objects, -2 for none
+};
+
+
+// Per-pixel geometry of a render, kept next to its checkpoint so the render of an edited
+// scene can start from the samples of the pixels the edit didn't change (temporal reuse).
+// The view and a fingerprint of every instance (its transform and material) tell what moved.
+//
+// File layout (native byte order): "RTGB", version, width, height, eye, lookat, vup (3
+// doubles each), vfov, aspect ratio, instance count and fingerprints, then the pixels, rows
+// bottom to top.
+class gbuffer {
+    public:
+        gbuffer() {}
+        gbuffer(int w, int h) : width(w), height(h), pixels(w * h) {}
+
+        int index(int i, int j) const { return j * width + i; }
+
+        void set_view(const point3& from, const point3& at, const vec3& up, double fov, double aspect) {
+            lookfrom = from;
+            lookat = at;
+            vup = up;
+            vfov = fov;
+            aspect_ratio = aspect;
+        }
+
+        camera view() const { return camera(lookfrom, lookat, vup, vfov, aspect_ratio, 0, 10); }
+
+        // Fills depth, normal and instance from the pinhole ray through each pixel center, and
+        // makes room for counting the paths; the instances must be known.
+        void trace_primary(const hittable& world);
+
+        // Counts a path of pixel (i, j) that hit the instances in hit (a path_instances set).
+        // Threads may count the paths of different pixels at the same time.
+        void count_path(int i, int j, uint64_t hit) {
+            uint32_t* count = &path_counts[index(i, j) * slots];
+            count[0]++;
+            for (int k = 1; hit; k++, hit >>= 1)
+                count[k] += hit & 1;
+        }
+
+        // Adds the instances that at least touch_share of a pixel's counted paths hit to its
+        // touched set. Nearly every path of a diffuse box hits every object sooner or later;
+        // the rarely hit ones carry too little of the pixel's light to invalidate it.
+        void finish_paths();
+
+        bool load(const std::string& file);
+        bool save(const std::string& file) const;
+
+    public:
+        static constexpr uint32_t version = 1;
+        static constexpr double touch_share = 0.1;
+
+        int width = 0;
+        int height = 0;
+        point3 lookfrom, lookat;
+        vec3 vup;
+        double vfov = 0;
+        double aspect_ratio = 1;
+        std::vector<uint64_t> instances;
+        std::vector<gbuffer_pixel> pixels;
+
+    private:
+        int slots = 1;                      // per pixel: its paths, then per instance bit
+        std::vector<uint32_t> path_counts;
+};
+
+
+void gbuffer::trace_primary(const hittable& world) {
+    slots = 1 + static_cast<int>(std::min<size_t>(instances.size(), 64));
+    path_counts.assign(pixels.size() * slots, 0);
+
+    camera cam = view();
+    point3 eye = cam.eye();
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            auto& pixel = pixels[index(i, j)];
+            vec3 d = unit_vector(cam.direction((i + 0.5) / (width - 1), (j + 0.5) / (height - 1)));
+            hit_record rec;
+            if (!world.hit(ray(eye, d), 0.001, infinity, rec)) {
+                pixel.depth = 0;
+                pixel.instance = -2;
+                continue;
+            }
+            pixel.depth = rec.t;
+            for (int c = 0; c < 3; c++)
+                pixel.normal[c] = rec.normal[c];
+            pixel.instance = rec.instance;
+        }
+    }
+}
+
+
+void gbuffer::finish_paths() {
+    for (size_t p = 0; p < pixels.size(); p++) {
+        const uint32_t* count = &path_counts[p * slots];
+        for (int k = 1; k < slots; k++)
+            if (count[0] > 0 && count[k] >= touch_share * count[0])
+                pixels[p].touched |= 1ULL << (k - 1);
+    }
+}
+
+
+bool gbuffer::load(const std::string& file) {
+    std::ifstream in(file, std::ios::binary);
+    char magic[4];
+    uint32_t file_version, instance_count;
+
+    in.read(magic, 4);
+    in.read(reinterpret_cast<char*>(&file_version), sizeof(file_version));
+    if (!in || std::string(magic, 4) != "RTGB" || file_version != version)
+        return false;
+
+    in.read(reinterpret_cast<char*>(&width), sizeof(width));
+    in.read(reinterpret_cast<char*>(&height), sizeof(height));
+    in.read(reinterpret_cast<char*>(lookfrom.e), sizeof(lookfrom.e));
+    in.read(reinterpret_cast<char*>(lookat.e), sizeof(lookat.e));
+    in.read(reinterpret_cast<char*>(vup.e), sizeof(vup.e));
+    in.read(reinterpret_cast<char*>(&vfov), sizeof(vfov));
+    in.read(reinterpret_cast<char*>(&aspect_ratio), sizeof(aspect_ratio));
+    in.read(reinterpret_cast<char*>(&instance_count), sizeof(instance_count));
+    if (!in || width <= 0 || height <= 0 || instance_count > (1u << 20))
+        return false;
+    instances.resize(instance_count);
+    in.read(reinterpret_cast<char*>(instances.data()), instance_count * sizeof(uint64_t));
+
+    pixels.assign(width * height, gbuffer_pixel());
+    in.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(gbuffer_pixel));
+    return static_cast<bool>(in);
+}
+
+
+bool gbuffer::save(const std::string& file) const {
+    // Written next to a checkpoint, so replaced the same way.
+    std::string temp = file + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary);
+        uint32_t instance_count = instances.size();
+
+        out.write("RTGB", 4);
+        out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        out.write(reinterpret_cast<const char*>(&width), sizeof(width));
+        out.write(reinterpret_cast<const char*>(&height), sizeof(height));
+        out.write(reinterpret_cast<const char*>(lookfrom.e), sizeof(lookfrom.e));
+        out.write(reinterpret_cast<const char*>(lookat.e), sizeof(lookat.e));
+        out.write(reinterpret_cast<const char*>(vup.e), sizeof(vup.e));
+        out.write(reinterpret_cast<const char*>(&vfov), sizeof(vfov));
+        out.write(reinterpret_cast<const char*>(&aspect_ratio), sizeof(aspect_ratio));
+        out.write(reinterpret_cast<const char*>(&instance_count), sizeof(instance_count));
+        out.write(reinterpret_cast<const char*>(instances.data()), instance_count * sizeof(uint64_t));
+        out.write(reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(gbuffer_pixel));
+        if (!out)
+            return false;
+    }
+    return std::rename(temp.c_str(), file.c_str()) == 0;
+}
+
+
+// Starts image from the samples of the previous render (history, with its G-buffer previous)
+// wherever the edit that led to current left the pixel unchanged. current's primary hits must
+// be traced already. Each pixel's center hit is reprojected into the previous view; the
+// history there is rejected if it saw another instance or a surface at another depth or
+// orientation, or if its paths touched an instance whose fingerprint changed (moved, given
+// another material, added or removed). Kept pixels also keep their touched sets. Returns the
+// number of pixels that kept their history.
+//
+// Kept history is biased where the edit changed the light a pixel gets through the paths
+// below touch_share, or through none at all (e.g. where the edited instance now casts a
+// shadow); the error fades as new samples are added to it.
+int reuse_history(const gbuffer& previous, const framebuffer& history,
+                  gbuffer& current, framebuffer& image) {
+    if (previous.width != current.width || previous.height != current.height
+        || history.width != current.width || history.height != current.height)
+        return 0;
+
+    uint64_t changed = 0;
+    size_t instance_count = std::max(previous.instances.size(), current.instances.size());
+    for (size_t k = 0; k < instance_count; k++)
+        if (k >= previous.instances.size() || k >= current.instances.size()
+            || previous.instances[k] != current.instances[k])
+            changed |= instance_bit(static_cast<int>(k));
+
+    camera now = current.view();
+    camera before = previous.view();
+    point3 eye = now.eye();
+    auto same = [](const vec3& a, const vec3& b) {
+        return a.x() == b.x() && a.y() == b.y() && a.z() == b.z();
+    };
+    bool same_view = same(previous.lookfrom, current.lookfrom) && same(previous.lookat, current.lookat)
+                  && same(previous.vup, current.vup) && previous.vfov == current.vfov
+                  && previous.aspect_ratio == current.aspect_ratio;
+    int width = current.width, height = current.height;
+    int kept = 0;
+
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            auto& pixel = current.pixels[current.index(i, j)];
+            if (instance_bit(pixel.instance) & changed)
+                continue;
+
+            int pi = i, pj = j;
+            point3 p;
+            if (pixel.instance != -2) {
+                vec3 d = unit_vector(now.direction((i + 0.5) / (width - 1), (j + 0.5) / (height - 1)));
+                p = eye + pixel.depth * d;
+                double s, t;
+                if (!before.project(p, s, t))
+                    continue;
+                pi = static_cast<int>(std::lround(s * (width - 1) - 0.5));
+                pj = static_cast<int>(std::lround(t * (height - 1) - 0.5));
+                if (pi < 0 || pi >= width || pj < 0 || pj >= height)
+                    continue;
+            } else if (!same_view) {
+                continue;           // the background isn't reprojected
+            }
+
+            const auto& old = previous.pixels[previous.index(pi, pj)];
+            if (old.instance != pixel.instance || (old.touched & changed))
+                continue;
+            if (pixel.instance != -2) {
+                double distance = (p - before.eye()).length();
+                double cosine = old.normal[0] * pixel.normal[0] + old.normal[1] * pixel.normal[1]
+                              + old.normal[2] * pixel.normal[2];
+                if (std::fabs(old.depth - distance) > 0.01 * distance || cosine < 0.9)
+                    continue;
+            }
+
+            int from = history.index(pi, pj), to = image.index(i, j);
+            image.accum[to] = history.accum[from];
+            image.samples[to] = history.samples[from];
+            pixel.touched = old.touched;
+            kept++;
+        }
+    }
+    return kept;
+}
+
+
+#endif
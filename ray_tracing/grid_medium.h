@@ -0,0 +1,221 @@
+#ifndef GRID_MEDIUM_H
+#define GRID_MEDIUM_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "constant_medium.h"
+#include "material.h"
+#include "sampler.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <vector>
+
+
+// A heterogeneous medium: its density, per unit of length, given on a grid of nx x ny x nz
+// voxels filling bounds and interpolated trilinearly between their centres.
+//
+// Rays are tracked through it against majorants, the largest density in each block of
+// block^3 voxels: a ray walks the blocks it crosses and, in each, draws tentative collisions
+// as if the block were filled at its majorant, keeping each with the probability that the
+// density there is of the majorant. That is delta tracking for scattering (hit) and ratio
+// tracking for transmittance. Blocks with nothing in them are stepped over without drawing
+// anything, and a tight majorant wastes few draws where the medium is thin.
+class grid_medium : public medium {
+    public:
+        grid_medium(const aabb& bounds, int nx, int ny, int nz, std::vector<float> density,
+                    shared_ptr<texture> albedo, int block = 8);
+
+        grid_medium(const aabb& bounds, int nx, int ny, int nz, std::vector<float> density,
+                    color albedo, int block = 8)
+            : grid_medium(bounds, nx, ny, nz, std::move(density), make_shared<solid_color>(albedo),
+                          block) {}
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = bounds;
+            return true;
+        }
+
+        virtual bool interval(const ray& r, double t_min, double t_max, double& t0,
+                              double& t1) const override {
+            t0 = t_min, t1 = t_max;
+            return bounds.clip(r, t0, t1);
+        }
+
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override;
+
+        double density_at(const point3& p) const;
+
+    public:
+        aabb bounds;
+        shared_ptr<material> phase_function;
+
+    private:
+        // Calls segment(t0, t1, majorant) for each block r crosses between t_min and t_max
+        // with something in it, in order, until it returns true.
+        template <typename F>
+        bool march(const ray& r, double t_min, double t_max, F segment) const;
+
+        float voxel(int x, int y, int z) const {
+            return density[(size_t(z) * n[1] + y) * n[0] + x];
+        }
+
+        int n[3];
+        std::vector<float> density;
+        int block;
+        int blocks[3];
+        std::vector<float> majorants;
+        vec3 to_grid;               // voxels per unit of length along each axis
+};
+
+
+grid_medium::grid_medium(const aabb& bounds, int nx, int ny, int nz, std::vector<float> density,
+                         shared_ptr<texture> albedo, int block)
+    : bounds(bounds), phase_function(make_shared<isotropic>(albedo)), n{nx, ny, nz},
+      density(std::move(density)), block(block) {
+    vec3 extent = bounds.max() - bounds.min();
+    to_grid = vec3(nx / extent.x(), ny / extent.y(), nz / extent.z());
+    for (int a = 0; a < 3; a++)
+        blocks[a] = (n[a] + block - 1) / block;
+
+    // Interpolating anywhere in a block reads its voxels and those next to them.
+    majorants.assign(size_t(blocks[0]) * blocks[1] * blocks[2], 0);
+    for (int bz = 0; bz < blocks[2]; bz++)
+        for (int by = 0; by < blocks[1]; by++)
+            for (int bx = 0; bx < blocks[0]; bx++) {
+                int b[3] = {bx, by, bz}, lo[3], hi[3];
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = std::max(b[a] * block - 1, 0);
+                    hi[a] = std::min((b[a] + 1) * block, n[a] - 1);
+                }
+                float m = 0;
+                for (int z = lo[2]; z <= hi[2]; z++)
+                    for (int y = lo[1]; y <= hi[1]; y++)
+                        for (int x = lo[0]; x <= hi[0]; x++)
+                            m = std::max(m, voxel(x, y, z));
+                majorants[(size_t(bz) * blocks[1] + by) * blocks[0] + bx] = m;
+            }
+}
+
+
+double grid_medium::density_at(const point3& p) const {
+    int i[3];
+    double f[3];
+    for (int a = 0; a < 3; a++) {
+        double g = (p[a] - bounds.min()[a]) * to_grid[a] - 0.5;
+        double fl = floor(g);
+        i[a] = static_cast<int>(fl);
+        f[a] = g - fl;
+    }
+    double sum = 0;
+    for (int k = 0; k < 8; k++) {
+        double w = 1;
+        int c[3];
+        for (int a = 0; a < 3; a++) {
+            int bit = (k >> a) & 1;
+            w *= bit ? f[a] : 1 - f[a];
+            c[a] = std::min(std::max(i[a] + bit, 0), n[a] - 1);
+        }
+        sum += w * voxel(c[0], c[1], c[2]);
+    }
+    return sum;
+}
+
+
+template <typename F>
+bool grid_medium::march(const ray& r, double t_min, double t_max, F segment) const {
+    if (!bounds.clip(r, t_min, t_max))
+        return false;
+
+    // A 3D DDA over the blocks, in block units.
+    point3 start = r.at(t_min);
+    int cell[3], step[3];
+    double t_next[3], t_delta[3];
+    for (int a = 0; a < 3; a++) {
+        double scale = to_grid[a] / block;
+        double g = (start[a] - bounds.min()[a]) * scale;
+        cell[a] = std::min(std::max(static_cast<int>(floor(g)), 0), blocks[a] - 1);
+        double d = r.direction()[a] * scale;
+        step[a] = d < 0 ? -1 : 1;
+        if (d == 0) {
+            t_next[a] = t_delta[a] = infinity;
+        } else {
+            t_next[a] = t_min + (cell[a] + (d > 0) - g) / d;
+            t_delta[a] = fabs(1 / d);
+        }
+    }
+
+    double t = t_min;
+    while (true) {
+        int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2)
+                                      : (t_next[1] < t_next[2] ? 1 : 2);
+        double t_exit = fmin(t_next[a], t_max);
+        float m = majorants[(size_t(cell[2]) * blocks[1] + cell[1]) * blocks[0] + cell[0]];
+        if (m > 0 && t_exit > t && segment(t, t_exit, double(m)))
+            return true;
+        if (t_next[a] >= t_max)
+            return false;
+        cell[a] += step[a];
+        if (cell[a] < 0 || cell[a] >= blocks[a])
+            return false;
+        t = t_next[a];
+        t_next[a] += t_delta[a];
+    }
+}
+
+
+bool grid_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    const double length = r.direction().length();
+    double t_hit;
+    bool scattered = march(r, fmax(t_min, 0), t_max, [&](double t0, double t1, double majorant) {
+        for (double t = t0;;) {
+            t -= log(1 - sample_1d()) / (majorant * length);
+            if (t >= t1)
+                return false;
+            if (sample_1d() * majorant < density_at(r.at(t))) {
+                t_hit = t;
+                return true;
+            }
+        }
+    });
+    if (!scattered)
+        return false;
+
+    rec.t = t_hit;
+    rec.p = r.at(t_hit);
+    rec.normal = vec3(1,0,0);  // arbitrary
+    rec.front_face = true;     // also arbitrary
+    rec.footprint = 0;
+    rec.light = -1;
+    rec.mat_ptr = phase_function;
+    return true;
+}
+
+
+double grid_medium::transmittance(const ray& r, double t_min, double t_max) const {
+    const double length = r.direction().length();
+    double through = 1;
+    march(r, fmax(t_min, 0), t_max, [&](double t0, double t1, double majorant) {
+        for (double t = t0;;) {
+            t -= log(1 - sample_1d()) / (majorant * length);
+            if (t >= t1)
+                return false;
+            through *= 1 - density_at(r.at(t)) / majorant;
+            // Russian roulette once little gets through, so thick media end early.
+            if (through < 0.1) {
+                if (sample_1d() < 0.75) {
+                    through = 0;
+                    return true;
+                }
+                through *= 4;
+            }
+        }
+    });
+    return through;
+}
+
+
+#endif
@@ -27,6 +27,9 @@ struct hit_record {
     double u;
     double v;
     bool front_face;
+    int instance = -1;      // id of the instance_id wrapper that was hit, -1 for none
+    double footprint = 0;   // width of the ray's cone at the hit in (u, v) units, 0 for a point
+    int light = -1;         // number of the light hit in the scene's light_set, -1 for none
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
@@ -35,12 +38,95 @@ struct hit_record {
 };
 
 
+// The width in (u, v) units of the cone of r where it hits, at t, a surface of that normal
+// whose (u, v) change by uv_per_unit over a unit of length.
+inline double cone_footprint(const ray& r, double t, const vec3& normal, double uv_per_unit) {
+    if (r.cone_width == 0 && r.cone_spread == 0)
+        return 0;
+    double length = r.direction().length();
+    double width = r.cone_width + r.cone_spread * t * length;
+    double cosine = fabs(dot(r.direction(), normal)) / length;
+    return width / fmax(cosine, 0.01) * uv_per_unit;
+}
+
+
 class hittable {
     public:
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+        // For objects that move while the shutter is open: their boxes at its start and end
+        // (ray times 0 and 1), which bound them at any time in between when interpolated.
+        virtual bool motion_boxes(aabb& start, aabb& end) const { return false; }
+
+        // Where r is inside the solid this bounds, [t0, t1] clipped to [t_min, t_max]; false
+        // if nowhere. For the boundaries of media, see constant_medium.h.
+        virtual bool interval(const ray& r, double t_min, double t_max, double& t0, double& t1) const;
+
+        // The fraction of light that gets through this along r between t_min and t_max, for
+        // shadow rays: none if r hits it, which is all there is to it but for media, lists and
+        // the wrappers of media.
+        virtual double transmittance(const ray& r, double t_min, double t_max) const {
+            hit_record rec;
+            return hit(r, t_min, t_max, rec) ? 0 : 1;
+        }
 };
 
+// Two hits, the first crossing and the next one: right for convex solids, and the only way
+// for objects that can't tell where they are crossed without intersecting the ray twice.
+inline bool hittable::interval(const ray& r, double t_min, double t_max, double& t0,
+                               double& t1) const {
+    hit_record rec1, rec2;
+    if (!hit(r, -infinity, infinity, rec1))
+        return false;
+    if (!hit(r, rec1.t+0.0001, infinity, rec2))
+        return false;
+    t0 = fmax(rec1.t, t_min);
+    t1 = fmin(rec2.t, t_max);
+    return t0 < t1;
+}
+
+// Tags the hits of ptr with an id, so a pixel can tell which object instance it sees and
+// which ones its paths touched (gbuffer.h).
+class instance_id : public hittable {
+    public:
+        instance_id(shared_ptr<hittable> p, int id) : ptr(p), id(id) {}
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            if (!ptr->hit(r, t_min, t_max, rec))
+                return false;
+            rec.instance = id;
+            return true;
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            return ptr->bounding_box(time0, time1, output_box);
+        }
+
+        virtual bool motion_boxes(aabb& start, aabb& end) const override {
+            return ptr->motion_boxes(start, end);
+        }
+
+        virtual bool interval(const ray& r, double t_min, double t_max, double& t0,
+                              double& t1) const override {
+            return ptr->interval(r, t_min, t_max, t0, t1);
+        }
+
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            return ptr->transmittance(r, t_min, t_max);
+        }
+
+    public:
+        shared_ptr<hittable> ptr;
+        int id;
+};
+
+// Bit of an instance in a set of instances; ids above 63 share the last bit.
+inline uint64_t instance_bit(int id) {
+    return id < 0 ? 0 : 1ULL << (id < 63 ? id : 63);
+}
+
 class translate : public hittable {
     public:
         translate(shared_ptr<hittable> p, const vec3& displacement)
@@ -51,6 +137,17 @@ class translate : public hittable {
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual bool interval(const ray& r, double t_min, double t_max, double& t0,
+                              double& t1) const override {
+            return ptr->interval(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max,
+                                 t0, t1);
+        }
+
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            return ptr->transmittance(ray(r.origin() - offset, r.direction(), r.time()), t_min,
+                                      t_max);
+        }
+
     public:
         shared_ptr<hittable> ptr;
         vec3 offset;
@@ -59,6 +156,8 @@ class translate : public hittable {
 
 bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     ray moved_r(r.origin() - offset, r.direction(), r.time());
+    moved_r.cone_width = r.cone_width;
+    moved_r.cone_spread = r.cone_spread;
     if (!ptr->hit(moved_r, t_min, t_max, rec))
         return false;
 
@@ -93,6 +192,18 @@ class rotate_y : public hittable {
             return hasbox;
         }
 
+        virtual bool interval(const ray& r, double t_min, double t_max, double& t0,
+                              double& t1) const override {
+            return ptr->interval(rotated(r), t_min, t_max, t0, t1);
+        }
+
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            return ptr->transmittance(rotated(r), t_min, t_max);
+        }
+
+        // r in the frame of ptr.
+        ray rotated(const ray& r) const;
+
     public:
         shared_ptr<hittable> ptr;
         double sin_theta;
@@ -135,7 +246,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 }
 
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+ray rotate_y::rotated(const ray& r) const {
     auto origin = r.origin();
     auto direction = r.direction();
 
@@ -146,6 +257,14 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
 
     ray rotated_r(origin, direction, r.time());
+    rotated_r.cone_width = r.cone_width;
+    rotated_r.cone_spread = r.cone_spread;
+    return rotated_r;
+}
+
+
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    ray rotated_r = rotated(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec))
         return false;
@@ -32,6 +32,14 @@ class hittable_list : public hittable  {
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            double through = 1;
+            for (const auto& object : objects)
+                if ((through *= object->transmittance(r, t_min, t_max)) == 0)
+                    break;
+            return through;
+        }
+
     public:
         std::vector<shared_ptr<hittable>> objects;
 };
@@ -43,6 +51,8 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
     auto closest_so_far = t_max;
 
     for (const auto& object : objects) {
+        temp_rec.instance = -1;     // only instance_id objects set it
+        temp_rec.light = -1;        // nor do objects other than the lights
         if (object->hit(r, t_min, closest_so_far, temp_rec)) {
             hit_anything = true;
             closest_so_far = temp_rec.t;
@@ -0,0 +1,590 @@
+#ifndef IMAGE_CODEC_H
+#define IMAGE_CODEC_H
+
+#include <pthread.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Formats the image can be written in: ASCII P3 (the default), linear float PFM, and 8-bit
+// PNG and QOI, which are encoded here from rows of RGB bytes, top row first. Textures are
+// read back from PPM, QOI and PNG (decode_image()), and environments from PFM and Radiance
+// RGBE (decode_hdr_image()).
+enum class image_format { ppm, pfm, png, qoi };
+
+inline bool parse_image_format(const std::string& name, image_format& format) {
+    if (name == "ppm") format = image_format::ppm;
+    else if (name == "pfm") format = image_format::pfm;
+    else if (name == "png") format = image_format::png;
+    else if (name == "qoi") format = image_format::qoi;
+    else return false;
+    return true;
+}
+
+inline const char* image_extension(image_format format) {
+    switch (format) {
+        case image_format::pfm: return ".pfm";
+        case image_format::png: return ".png";
+        case image_format::qoi: return ".qoi";
+        default: return ".ppm";
+    }
+}
+
+
+inline void append_be32(std::string& out, uint32_t v) {
+    out += static_cast<char>(v >> 24);
+    out += static_cast<char>(v >> 16);
+    out += static_cast<char>(v >> 8);
+    out += static_cast<char>(v);
+}
+
+
+// The Quite OK Image format (qoiformat.org): one pass, no entropy coder, so it costs about
+// as much as copying the pixels.
+std::string encode_qoi(const std::vector<uint8_t>& rgb, int width, int height) {
+    std::string out = "qoif";
+    append_be32(out, width);
+    append_be32(out, height);
+    out += static_cast<char>(3);        // channels
+    out += static_cast<char>(0);        // sRGB
+    out.reserve(out.size() + rgb.size() / 2);
+
+    struct pixel { uint8_t r, g, b; };
+    pixel seen[64] = {};
+    bool seen_set[64] = {};             // alpha is always 255, so {0,0,0} isn't there yet
+    pixel previous = {0, 0, 0};
+    int run = 0;
+    size_t count = size_t(width) * height;
+
+    for (size_t k = 0; k < count; k++) {
+        pixel p = {rgb[3*k], rgb[3*k + 1], rgb[3*k + 2]};
+        if (p.r == previous.r && p.g == previous.g && p.b == previous.b) {
+            if (++run == 62 || k + 1 == count) {
+                out += static_cast<char>(0xc0 | (run - 1));     // QOI_OP_RUN
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out += static_cast<char>(0xc0 | (run - 1));
+            run = 0;
+        }
+
+        int slot = (p.r * 3 + p.g * 5 + p.b * 7 + 255 * 11) % 64;
+        if (seen_set[slot] && seen[slot].r == p.r && seen[slot].g == p.g && seen[slot].b == p.b) {
+            out += static_cast<char>(slot);                     // QOI_OP_INDEX
+            previous = p;
+            continue;
+        }
+        seen[slot] = p;
+        seen_set[slot] = true;
+
+        int dr = static_cast<int8_t>(p.r - previous.r);
+        int dg = static_cast<int8_t>(p.g - previous.g);
+        int db = static_cast<int8_t>(p.b - previous.b);
+        int dr_dg = dr - dg, db_dg = db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+            out += static_cast<char>(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));  // QOI_OP_DIFF
+        } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+            out += static_cast<char>(0x80 | (dg + 32));                                 // QOI_OP_LUMA
+            out += static_cast<char>((dr_dg + 8) << 4 | (db_dg + 8));
+        } else {
+            out += static_cast<char>(0xfe);                                             // QOI_OP_RGB
+            out += static_cast<char>(p.r);
+            out += static_cast<char>(p.g);
+            out += static_cast<char>(p.b);
+        }
+        previous = p;
+    }
+    out.append(7, '\0');
+    out += static_cast<char>(1);
+    return out;
+}
+
+
+// PNG whose pixel data is compressed in strips of rows on several threads, the way pigz
+// does: each strip is filtered (per row, the filter with the smallest sum of absolute
+// differences, as libpng picks) and deflated on its own, primed with the last 32 KiB of the
+// strip before so the split costs little compression, and ended with a sync flush so the
+// strips concatenate into one zlib stream. Their Adler-32 checksums are combined.
+class png_encoder {
+    public:
+        png_encoder(const std::vector<uint8_t>& rgb, int width, int height, int threads = 16,
+                     int level = 6);
+
+        std::string encode();
+
+    private:
+        struct job {
+            png_encoder* self;
+            int strip;
+        };
+
+        static void* work(void* arg);
+        void filter_row(int j);
+        void deflate_strip(int strip);
+
+        const std::vector<uint8_t>& rgb;
+        int width, height, level, strips;
+        size_t stride;                          // filter type byte + RGB
+        pthread_barrier_t barrier;
+        std::vector<uint8_t> filtered;
+        std::vector<std::string> compressed;
+        std::vector<uLong> checksums;
+};
+
+
+png_encoder::png_encoder(const std::vector<uint8_t>& rgb, int width, int height, int threads,
+                         int level)
+    : rgb(rgb), width(width), height(height), level(level), stride(1 + 3 * size_t(width)) {
+    // Strips under a window's worth of data would compress noticeably worse.
+    size_t bytes = stride * height;
+    strips = static_cast<int>(std::max<size_t>(1, std::min<size_t>(threads, bytes / 32768)));
+    filtered.resize(bytes);
+    compressed.resize(strips);
+    checksums.resize(strips);
+}
+
+
+void* png_encoder::work(void* arg) {
+    auto job = static_cast<png_encoder::job*>(arg);
+    auto self = job->self;
+    int j0 = job->strip * self->height / self->strips;
+    int j1 = (job->strip + 1) * self->height / self->strips;
+    for (int j = j0; j < j1; j++)
+        self->filter_row(j);
+    // The dictionary of a strip is the end of the one before.
+    pthread_barrier_wait(&self->barrier);
+    self->deflate_strip(job->strip);
+    return nullptr;
+}
+
+
+void png_encoder::filter_row(int j) {
+    const size_t n = 3 * size_t(width);
+    const uint8_t* row = &rgb[j * n];
+    const uint8_t* up = j > 0 ? &rgb[(j - 1) * n] : nullptr;
+    uint8_t* out = &filtered[j * stride];
+
+    std::vector<uint8_t> candidates(5 * n);
+    uint8_t* candidate[5];
+    for (int f = 0; f < 5; f++)
+        candidate[f] = &candidates[f * n];
+    long cost[5] = {0, 0, 0, 0, 0};
+    for (size_t x = 0; x < n; x++) {
+        int a = x >= 3 ? row[x - 3] : 0;
+        int b = up ? up[x] : 0;
+        int c = up && x >= 3 ? up[x - 3] : 0;
+        int p = a + b - c;
+        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        int paeth = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        candidate[0][x] = row[x];
+        candidate[1][x] = row[x] - a;
+        candidate[2][x] = row[x] - b;
+        candidate[3][x] = row[x] - (a + b) / 2;
+        candidate[4][x] = row[x] - paeth;
+        for (int f = 0; f < 5; f++)
+            cost[f] += std::abs(static_cast<int8_t>(candidate[f][x]));
+    }
+    int best = static_cast<int>(std::min_element(cost, cost + 5) - cost);
+    out[0] = static_cast<uint8_t>(best);
+    std::copy(candidate[best], candidate[best] + n, out + 1);
+}
+
+
+void png_encoder::deflate_strip(int strip) {
+    size_t begin = (strip * height / strips) * stride;
+    size_t end = ((strip + 1) * height / strips) * stride;
+
+    z_stream z = {};
+    deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_FILTERED);      // raw deflate
+    if (strip > 0) {
+        size_t dictionary = std::min<size_t>(begin, 32768);
+        deflateSetDictionary(&z, &filtered[begin - dictionary], dictionary);
+    }
+    std::string& out = compressed[strip];
+    out.resize(deflateBound(&z, end - begin) + 16);
+    z.next_in = &filtered[begin];
+    z.avail_in = end - begin;
+    z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    z.avail_out = out.size();
+    deflate(&z, strip + 1 == strips ? Z_FINISH : Z_SYNC_FLUSH);
+    out.resize(z.total_out);
+    deflateEnd(&z);
+    checksums[strip] = adler32(adler32(0, Z_NULL, 0), &filtered[begin], end - begin);
+}
+
+
+std::string png_encoder::encode() {
+    pthread_barrier_init(&barrier, NULL, strips);
+    std::vector<pthread_t> workers(strips);
+    std::vector<job> jobs(strips);
+    for (int s = 0; s < strips; s++) {
+        jobs[s] = {this, s};
+        pthread_create(&workers[s], NULL, work, &jobs[s]);
+    }
+    for (auto& worker : workers)
+        pthread_join(worker, NULL);
+    pthread_barrier_destroy(&barrier);
+
+    std::string idat = "IDAT";
+    idat += static_cast<char>(0x78);        // zlib header: deflate, 32 KiB window
+    idat += static_cast<char>(0x9c);
+    uLong checksum = adler32(0, Z_NULL, 0);
+    for (int s = 0; s < strips; s++) {
+        idat += compressed[s];
+        size_t length = ((s + 1) * height / strips - s * height / strips) * stride;
+        checksum = adler32_combine(checksum, checksums[s], length);
+    }
+    append_be32(idat, checksum);
+
+    std::string header = "IHDR";
+    append_be32(header, width);
+    append_be32(header, height);
+    header += std::string("\x08\x02\x00\x00\x00", 5);       // 8 bit RGB, no interlace
+
+    std::string end = "IEND";
+    std::string out = "\x89PNG\r\n\x1a\n";
+    for (const std::string* chunk : {&header, &idat, &end}) {
+        append_be32(out, chunk->size() - 4);
+        out += *chunk;
+        append_be32(out, crc32(crc32(0, Z_NULL, 0),
+                               reinterpret_cast<const Bytef*>(chunk->data()), chunk->size()));
+    }
+    return out;
+}
+
+
+std::string encode_png(const std::vector<uint8_t>& rgb, int width, int height, int threads = 16,
+                       int level = 6) {
+    return png_encoder(rgb, width, height, threads, level).encode();
+}
+
+
+inline uint32_t read_be32(const std::string& in, size_t at) {
+    return uint32_t(uint8_t(in[at])) << 24 | uint32_t(uint8_t(in[at + 1])) << 16
+         | uint32_t(uint8_t(in[at + 2])) << 8 | uint32_t(uint8_t(in[at + 3]));
+}
+
+
+// P3 or P6 with up to 255 levels.
+bool decode_ppm(const std::string& in, std::vector<uint8_t>& rgb, int& width, int& height,
+                std::string& error) {
+    std::istringstream stream(in);
+    std::string magic;
+    int levels = 0;
+    int* fields[3] = {&width, &height, &levels};
+    stream >> magic;
+    for (int* field : fields) {
+        while (stream >> std::ws && stream.peek() == '#')
+            stream.ignore(in.size(), '\n');
+        stream >> *field;
+    }
+    if (!stream || (magic != "P3" && magic != "P6") || width <= 0 || height <= 0
+        || levels <= 0 || levels > 255) {
+        error = "not a PPM of 8 bits per channel";
+        return false;
+    }
+    rgb.resize(size_t(width) * height * 3);
+    if (magic == "P6") {
+        stream.get();       // the single whitespace after the header
+        stream.read(reinterpret_cast<char*>(rgb.data()), rgb.size());
+    } else {
+        for (auto& c : rgb) {
+            int value = 0;
+            stream >> value;
+            c = static_cast<uint8_t>(value);
+        }
+    }
+    if (!stream) {
+        error = "truncated PPM";
+        return false;
+    }
+    if (levels != 255)
+        for (auto& c : rgb)
+            c = static_cast<uint8_t>(std::min(255, c * 255 / levels));
+    return true;
+}
+
+
+bool decode_qoi(const std::string& in, std::vector<uint8_t>& rgb, int& width, int& height,
+                std::string& error) {
+    if (in.size() < 22 || in.compare(0, 4, "qoif") != 0) {
+        error = "not a QOI image";
+        return false;
+    }
+    width = static_cast<int>(read_be32(in, 4));
+    height = static_cast<int>(read_be32(in, 8));
+    if (width <= 0 || height <= 0 || size_t(width) * height > (size_t(1) << 28)) {
+        error = "bad QOI size";
+        return false;
+    }
+    size_t count = size_t(width) * height;
+    rgb.resize(count * 3);
+
+    struct pixel { uint8_t r, g, b, a; };
+    pixel seen[64] = {};
+    pixel p = {0, 0, 0, 255};
+    size_t at = 14, end = in.size() - 8;
+    int run = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (run > 0) {
+            run--;
+        } else if (at < end) {
+            uint8_t op = in[at++];
+            if (op == 0xfe) {                                   // QOI_OP_RGB
+                p.r = in[at], p.g = in[at + 1], p.b = in[at + 2];
+                at += 3;
+            } else if (op == 0xff) {                            // QOI_OP_RGBA
+                p.r = in[at], p.g = in[at + 1], p.b = in[at + 2], p.a = in[at + 3];
+                at += 4;
+            } else if ((op & 0xc0) == 0x00) {                   // QOI_OP_INDEX
+                p = seen[op];
+            } else if ((op & 0xc0) == 0x40) {                   // QOI_OP_DIFF
+                p.r += ((op >> 4) & 3) - 2;
+                p.g += ((op >> 2) & 3) - 2;
+                p.b += (op & 3) - 2;
+            } else if ((op & 0xc0) == 0x80) {                   // QOI_OP_LUMA
+                int dg = (op & 0x3f) - 32;
+                uint8_t next = in[at++];
+                p.r += dg - 8 + (next >> 4);
+                p.g += dg;
+                p.b += dg - 8 + (next & 0x0f);
+            } else {                                            // QOI_OP_RUN
+                run = op & 0x3f;
+            }
+            seen[(p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64] = p;
+        }
+        rgb[3*k] = p.r, rgb[3*k + 1] = p.g, rgb[3*k + 2] = p.b;
+    }
+    return true;
+}
+
+
+// 8-bit, not interlaced: gray, RGB, palette, gray with alpha or RGBA (the alpha dropped).
+bool decode_png(const std::string& in, std::vector<uint8_t>& rgb, int& width, int& height,
+                std::string& error) {
+    if (in.size() < 8 || in.compare(0, 8, "\x89PNG\r\n\x1a\n") != 0) {
+        error = "not a PNG image";
+        return false;
+    }
+    int depth = 0, color_type = 0, interlace = 0;
+    std::string compressed, palette;
+    for (size_t at = 8; at + 8 <= in.size(); ) {
+        uint32_t length = read_be32(in, at);
+        std::string type = in.substr(at + 4, 4);
+        if (at + 12 + size_t(length) > in.size())
+            break;
+        const char* data = in.data() + at + 8;
+        if (type == "IHDR" && length >= 13) {
+            width = static_cast<int>(read_be32(in, at + 8));
+            height = static_cast<int>(read_be32(in, at + 12));
+            depth = uint8_t(data[8]);
+            color_type = uint8_t(data[9]);
+            interlace = uint8_t(data[12]);
+        } else if (type == "PLTE") {
+            palette.assign(data, length);
+        } else if (type == "IDAT") {
+            compressed.append(data, length);
+        } else if (type == "IEND") {
+            break;
+        }
+        at += 12 + size_t(length);
+    }
+    const int channels_of[7] = {1, 0, 3, 1, 2, 0, 4};
+    int channels = color_type <= 6 ? channels_of[color_type] : 0;
+    if (depth != 8 || channels == 0 || interlace != 0 || width <= 0 || height <= 0
+        || size_t(width) * height > (size_t(1) << 28)) {
+        error = "only 8-bit PNGs without interlacing are supported";
+        return false;
+    }
+
+    size_t stride = size_t(width) * channels;
+    std::vector<uint8_t> filtered((stride + 1) * height);
+    uLongf size = filtered.size();
+    if (uncompress(filtered.data(), &size, reinterpret_cast<const Bytef*>(compressed.data()),
+                   compressed.size()) != Z_OK || size != filtered.size()) {
+        error = "corrupt PNG data";
+        return false;
+    }
+
+    // Undo the filter of each row, in place, against the row above.
+    std::vector<uint8_t> pixels(stride * height);
+    for (int j = 0; j < height; j++) {
+        const uint8_t* line = &filtered[j * (stride + 1)];
+        uint8_t* row = &pixels[j * stride];
+        const uint8_t* above = j > 0 ? row - stride : nullptr;
+        for (size_t i = 0; i < stride; i++) {
+            int a = i >= size_t(channels) ? row[i - channels] : 0;
+            int b = above ? above[i] : 0;
+            int c = above && i >= size_t(channels) ? above[i - channels] : 0;
+            int x = line[1 + i];
+            switch (line[0]) {
+                case 1: x += a; break;
+                case 2: x += b; break;
+                case 3: x += (a + b) / 2; break;
+                case 4: {
+                    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+                    x += pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                    break;
+                }
+            }
+            row[i] = static_cast<uint8_t>(x);
+        }
+    }
+
+    rgb.resize(size_t(width) * height * 3);
+    for (size_t k = 0; k < size_t(width) * height; k++) {
+        const uint8_t* p = &pixels[k * channels];
+        if (color_type == 3) {
+            size_t entry = 3 * size_t(p[0]);
+            for (int c = 0; c < 3; c++)
+                rgb[3*k + c] = entry + 2 < palette.size() ? uint8_t(palette[entry + c]) : 0;
+        } else {
+            for (int c = 0; c < 3; c++)
+                rgb[3*k + c] = channels >= 3 ? p[c] : p[0];
+        }
+    }
+    return true;
+}
+
+
+// Reads an image in any of the formats above, told apart by their first bytes.
+bool decode_image(const std::string& in, std::vector<uint8_t>& rgb, int& width, int& height,
+                  std::string& error) {
+    if (in.compare(0, 4, "qoif") == 0)
+        return decode_qoi(in, rgb, width, height, error);
+    if (in.compare(0, 4, "\x89PNG") == 0)
+        return decode_png(in, rgb, width, height, error);
+    return decode_ppm(in, rgb, width, height, error);
+}
+
+
+// High dynamic range images, read as linear RGB floats, top row first.
+
+// PF (RGB) or Pf (gray); the sign of the scale gives the byte order, negative for little-endian.
+// Rows are stored bottom first.
+bool decode_pfm(const std::string& in, std::vector<float>& rgb, int& width, int& height,
+                std::string& error) {
+    std::istringstream stream(in);
+    std::string magic;
+    double scale = 0;
+    stream >> magic >> width >> height >> scale;
+    if (!stream || (magic != "PF" && magic != "Pf") || width <= 0 || height <= 0 || scale == 0) {
+        error = "not a PFM";
+        return false;
+    }
+    stream.get();           // the single whitespace after the header
+    int channels = magic == "PF" ? 3 : 1;
+    std::vector<float> data(size_t(width) * height * channels);
+    stream.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float));
+    if (!stream) {
+        error = "truncated PFM";
+        return false;
+    }
+    const uint32_t probe = 1;
+    bool little_endian = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+    if ((scale < 0) != little_endian)
+        for (auto& value : data) {
+            uint32_t bits;
+            memcpy(&bits, &value, 4);
+            bits = bits >> 24 | (bits >> 8 & 0xff00) | (bits << 8 & 0xff0000) | bits << 24;
+            memcpy(&value, &bits, 4);
+        }
+    rgb.resize(size_t(width) * height * 3);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            for (int c = 0; c < 3; c++) {
+                float value = data[(size_t(height - 1 - y) * width + x) * channels
+                                   + (channels == 3 ? c : 0)];
+                rgb[(size_t(y) * width + x) * 3 + c] = value == value ? value : 0;
+            }
+    return true;
+}
+
+
+// Radiance RGBE (.hdr), flat or run-length encoded by channel, with the usual -Y h +X w
+// orientation.
+bool decode_rgbe(const std::string& in, std::vector<float>& rgb, int& width, int& height,
+                 std::string& error) {
+    std::istringstream stream(in);
+    std::string line;
+    bool rgbe = true;       // unless the header says otherwise, e.g. XYZE
+    while (std::getline(stream, line) && !line.empty())
+        if (line.compare(0, 7, "FORMAT=") == 0)
+            rgbe = line == "FORMAT=32-bit_rle_rgbe";
+    std::string y_axis, x_axis;
+    stream >> y_axis >> height >> x_axis >> width;
+    if (!stream || !rgbe || y_axis != "-Y" || x_axis != "+X" || width <= 0 || height <= 0) {
+        error = "not a Radiance RGBE image of -Y +X rows";
+        return false;
+    }
+    stream.get();
+    size_t at = static_cast<size_t>(stream.tellg());
+
+    rgb.resize(size_t(width) * height * 3);
+    std::vector<uint8_t> row(size_t(width) * 4);
+    for (int y = 0; y < height; y++) {
+        if (at + 4 > in.size()) {
+            error = "truncated RGBE image";
+            return false;
+        }
+        bool encoded = width >= 8 && width < 32768 && in[at] == 2 && in[at + 1] == 2
+                       && (uint8_t(in[at + 2]) << 8 | uint8_t(in[at + 3])) == width;
+        if (!encoded) {
+            if (at + row.size() > in.size()) {
+                error = "truncated RGBE image";
+                return false;
+            }
+            memcpy(row.data(), in.data() + at, row.size());
+            at += row.size();
+        } else {
+            at += 4;
+            for (int c = 0; c < 4; c++)
+                for (int x = 0; x < width;) {
+                    if (at >= in.size()) {
+                        error = "truncated RGBE image";
+                        return false;
+                    }
+                    int count = uint8_t(in[at++]);
+                    bool run = count > 128;
+                    if (run)
+                        count -= 128;
+                    if (count == 0 || x + count > width || at + (run ? 1 : count) > in.size()) {
+                        error = "corrupt RGBE image";
+                        return false;
+                    }
+                    for (int k = 0; k < count; k++, x++)
+                        row[size_t(x) * 4 + c] = uint8_t(in[run ? at : at + k]);
+                    at += run ? 1 : count;
+                }
+        }
+        for (int x = 0; x < width; x++) {
+            const uint8_t* p = &row[size_t(x) * 4];
+            float f = p[3] ? static_cast<float>(ldexp(1.0, p[3] - (128 + 8))) : 0;
+            for (int c = 0; c < 3; c++)
+                rgb[(size_t(y) * width + x) * 3 + c] = p[c] * f;
+        }
+    }
+    return true;
+}
+
+
+// Reads a PFM or RGBE image, told apart by their first bytes.
+bool decode_hdr_image(const std::string& in, std::vector<float>& rgb, int& width, int& height,
+                      std::string& error) {
+    if (in.compare(0, 2, "#?") == 0)
+        return decode_rgbe(in, rgb, width, height, error);
+    return decode_pfm(in, rgb, width, height, error);
+}
+
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef IMAGE_TEXTURE_H
+#define IMAGE_TEXTURE_H
+
+#include "rtweekend.h"
+
+#include "image_codec.h"
+#include "stats.h"
+#include "texture.h"
+
+#include <pthread.h>
+
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// An 8-bit sRGB image and its mip pyramid, each level half the size of the one before, made
+// by averaging 2x2 texels in linear light. A texel is four bytes, RGB and one of padding.
+// Tiled, the texels of each level are stored in tiles of 4x4, one aligned 64-byte cache line
+// each, so the 2x2 texels of a bilinear lookup lie on one line nine times out of sixteen and
+// never on more than four; rows of the image would put them on two lines at least, and a
+// minified surface would read a line for every texel it uses.
+class mip_image {
+    public:
+        mip_image(const std::vector<uint8_t>& rgb, int width, int height, bool mipmaps = true,
+                  bool tiled = true);
+
+        int levels() const { return static_cast<int>(pyramid.size()); }
+        int width() const { return pyramid[0].width; }
+        int height() const { return pyramid[0].height; }
+        size_t bytes() const;
+        // Level 0's texels as stored, padding included (always zero), e.g. to hash the image.
+        const uint32_t* texels() const { return pyramid[0].texels.get(); }
+        size_t texel_count() const { return pyramid[0].count; }
+
+        // Bilinear in level l at (u, v), wrapping around; v = 0 is the bottom row.
+        color bilinear(int l, double u, double v) const;
+        // Trilinear, between the two levels whose texels are closest to footprint wide.
+        color trilinear(double u, double v, double footprint) const;
+
+    private:
+        struct aligned_free {
+            void operator()(uint32_t* p) const { free(p); }
+        };
+
+        struct level {
+            int width, height;
+            int tiles_x;                // in a row of tiles
+            size_t count;               // texels, tiles rounded up
+            std::unique_ptr<uint32_t[], aligned_free> texels;
+        };
+
+        void allocate(level& l, int width, int height);
+        size_t index(const level& l, int x, int y) const {
+            if (!tiled)
+                return size_t(y) * l.width + x;
+            return (size_t(y >> 2) * l.tiles_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3);
+        }
+
+        std::vector<level> pyramid;
+        bool tiled;
+};
+
+
+// Linear value of each 8-bit sRGB level.
+inline const float* srgb_to_linear_table() {
+    static const std::vector<float> table = [] {
+        std::vector<float> t(256);
+        for (int k = 0; k < 256; k++) {
+            double c = k / 255.0;
+            t[k] = static_cast<float>(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+inline uint8_t linear_to_srgb(double c) {
+    c = clamp(c, 0, 1);
+    c = c <= 0.0031308 ? 12.92 * c : 1.055 * pow(c, 1 / 2.4) - 0.055;
+    return static_cast<uint8_t>(c * 255 + 0.5);
+}
+
+
+mip_image::mip_image(const std::vector<uint8_t>& rgb, int width, int height, bool mipmaps,
+                     bool tiled)
+    : tiled(tiled) {
+    pyramid.emplace_back();
+    allocate(pyramid[0], width, height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++) {
+            const uint8_t* p = &rgb[3 * (size_t(y) * width + x)];
+            pyramid[0].texels[index(pyramid[0], x, y)] = p[0] | p[1] << 8 | p[2] << 16;
+        }
+
+    const float* linear = srgb_to_linear_table();
+    while (mipmaps && (pyramid.back().width > 1 || pyramid.back().height > 1)) {
+        pyramid.emplace_back();
+        const level& above = pyramid[pyramid.size() - 2];
+        level& next = pyramid.back();
+        allocate(next, std::max(1, above.width / 2), std::max(1, above.height / 2));
+        for (int y = 0; y < next.height; y++)
+            for (int x = 0; x < next.width; x++) {
+                double sum[3] = {0, 0, 0};
+                for (int k = 0; k < 4; k++) {
+                    int ax = std::min(2*x + (k & 1), above.width - 1);
+                    int ay = std::min(2*y + (k >> 1), above.height - 1);
+                    uint32_t t = above.texels[index(above, ax, ay)];
+                    for (int c = 0; c < 3; c++)
+                        sum[c] += linear[(t >> (8 * c)) & 0xff];
+                }
+                uint32_t texel = 0;
+                for (int c = 0; c < 3; c++)
+                    texel |= uint32_t(linear_to_srgb(sum[c] / 4)) << (8 * c);
+                next.texels[index(next, x, y)] = texel;
+            }
+    }
+}
+
+
+void mip_image::allocate(level& l, int width, int height) {
+    l.width = width;
+    l.height = height;
+    l.tiles_x = (width + 3) / 4;
+    l.count = tiled ? size_t(l.tiles_x) * ((height + 3) / 4) * 16 : size_t(width) * height;
+    size_t bytes = (l.count * sizeof(uint32_t) + 63) / 64 * 64;
+    l.texels.reset(static_cast<uint32_t*>(aligned_alloc(64, bytes)));
+    if (!l.texels)
+        throw std::bad_alloc();
+    std::fill(l.texels.get(), l.texels.get() + l.count, 0);
+}
+
+
+size_t mip_image::bytes() const {
+    size_t total = 0;
+    for (const auto& l : pyramid)
+        total += l.count * sizeof(uint32_t);
+    return total;
+}
+
+
+color mip_image::bilinear(int l, double u, double v) const {
+    const level& lv = pyramid[l];
+    double x = u * lv.width - 0.5, y = (1 - v) * lv.height - 0.5;
+    double fx = floor(x), fy = floor(y);
+    int x0 = static_cast<int>(fx) % lv.width, y0 = static_cast<int>(fy) % lv.height;
+    if (x0 < 0) x0 += lv.width;
+    if (y0 < 0) y0 += lv.height;
+    int x1 = x0 + 1 == lv.width ? 0 : x0 + 1, y1 = y0 + 1 == lv.height ? 0 : y0 + 1;
+    double tx = x - fx, ty = y - fy;
+
+    size_t at[4] = {index(lv, x0, y0), index(lv, x1, y0), index(lv, x0, y1), index(lv, x1, y1)};
+    double weight[4] = {(1 - tx) * (1 - ty), tx * (1 - ty), (1 - tx) * ty, tx * ty};
+    const float* linear = srgb_to_linear_table();
+    double sum[3] = {0, 0, 0};
+    for (int k = 0; k < 4; k++) {
+        uint32_t t = lv.texels[at[k]];
+        for (int c = 0; c < 3; c++)
+            sum[c] += weight[k] * linear[(t >> (8 * c)) & 0xff];
+    }
+
+#ifdef RT_STATS
+    int lines = 0;
+    for (int k = 0; k < 4; k++) {
+        bool seen = false;
+        for (int j = 0; j < k; j++)
+            seen = seen || at[j] / 16 == at[k] / 16;
+        lines += !seen;
+    }
+    STAT_ADD(texture_lookups, 1);
+    STAT_ADD(texture_lines, lines);
+#endif
+    return color(sum[0], sum[1], sum[2]);
+}
+
+
+color mip_image::trilinear(double u, double v, double footprint) const {
+    double lod = footprint > 0 ? log2(footprint * std::max(width(), height())) : 0;
+    if (lod <= 0)
+        return bilinear(0, u, v);
+    int l = static_cast<int>(lod);
+    if (l >= levels() - 1)
+        return bilinear(levels() - 1, u, v);
+    double t = lod - l;
+    if (t == 0)
+        return bilinear(l, u, v);
+    return (1 - t) * bilinear(l, u, v) + t * bilinear(l + 1, u, v);
+}
+
+
+// A texture from an image file (PPM, QOI or PNG), looked up trilinearly in its mip pyramid
+// by the footprint of the ray's cone.
+class image_texture : public texture {
+    public:
+        image_texture(shared_ptr<const mip_image> image) : image(image) {}
+
+        virtual color value(double u, double v, const vec3& p) const override {
+            return image->bilinear(0, u, v);
+        }
+
+        virtual color filtered(double u, double v, const vec3& p, double footprint) const override {
+            return image->trilinear(u, v, footprint);
+        }
+
+    public:
+        shared_ptr<const mip_image> image;
+};
+
+
+// Decoded images by file, shared by every texture that uses them. The cache holds at most
+// budget bytes of them: past that it lets go of the least recently requested ones, which stay
+// alive as long as textures still use them.
+class texture_cache {
+    public:
+        texture_cache(size_t budget = size_t(256) << 20) : budget(budget) {}
+        ~texture_cache() { pthread_mutex_destroy(&mutex); }
+
+        // The image of file, decoded on first use; null with error set if it can't be read.
+        shared_ptr<const mip_image> get(const std::string& file, std::string& error);
+
+        size_t bytes() const { return cached_bytes; }
+
+    public:
+        size_t budget;
+        uint64_t hits = 0, misses = 0, evictions = 0;
+
+    private:
+        std::list<std::pair<std::string, shared_ptr<const mip_image>>> images;  // newest first
+        size_t cached_bytes = 0;
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+};
+
+
+shared_ptr<const mip_image> texture_cache::get(const std::string& file, std::string& error) {
+    pthread_mutex_lock(&mutex);
+    for (auto it = images.begin(); it != images.end(); ++it) {
+        if (it->first == file) {
+            images.splice(images.begin(), images, it);
+            hits++;
+            auto image = it->second;
+            pthread_mutex_unlock(&mutex);
+            return image;
+        }
+    }
+    misses++;
+    pthread_mutex_unlock(&mutex);
+
+    // Decoded outside the lock; two threads that miss on the same file both decode it, and the
+    // one that gets back second takes the other's image.
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+        error = "cannot read " + file;
+        return nullptr;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<uint8_t> rgb;
+    int width, height;
+    if (!decode_image(data, rgb, width, height, error)) {
+        error = file + ": " + error;
+        return nullptr;
+    }
+    auto image = make_shared<const mip_image>(rgb, width, height);
+
+    pthread_mutex_lock(&mutex);
+    for (auto it = images.begin(); it != images.end(); ++it) {
+        if (it->first == file) {
+            images.splice(images.begin(), images, it);
+            auto cached = it->second;
+            pthread_mutex_unlock(&mutex);
+            return cached;
+        }
+    }
+    images.emplace_front(file, image);
+    cached_bytes += image->bytes();
+    while (cached_bytes > budget && images.size() > 1) {
+        cached_bytes -= images.back().second->bytes();
+        images.pop_back();
+        evictions++;
+    }
+    pthread_mutex_unlock(&mutex);
+    return image;
+}
+
+
+texture_cache shared_textures;
+
+
+#endif
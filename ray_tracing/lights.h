@@ -0,0 +1,376 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "aarect.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "triangle.h"
+
+#include <algorithm>
+#include <vector>
+
+
+// A flat light: a triangle (o, o + e1, o + e2) or the parallelogram on e1 and e2, emitting
+// radiance towards the side of e1 x e2 or, if two-sided, towards both.
+struct emitter {
+    point3 o;
+    vec3 e1, e2;
+    bool parallelogram;
+    bool two_sided;
+    vec3 normal;                // unit, e1 x e2
+    double area;
+    color radiance;
+    double power;               // radiant flux, up to a constant factor shared by all
+
+    point3 sample(double u1, double u2) const {
+        if (parallelogram)
+            return o + u1 * e1 + u2 * e2;
+        double su = sqrt(u1);
+        return o + su * (1 - u2) * e1 + su * u2 * e2;
+    }
+
+    point3 centre() const {
+        return o + (e1 + e2) / (parallelogram ? 2 : 3);
+    }
+
+    aabb bounds() const {
+        point3 lo = o, hi = o;
+        for (const vec3& corner : {o + e1, o + e2, parallelogram ? o + e1 + e2 : o})
+            for (int a = 0; a < 3; a++)
+                lo[a] = fmin(lo[a], corner[a]), hi[a] = fmax(hi[a], corner[a]);
+        return aabb(lo, hi);
+    }
+};
+
+
+// The emitters of a scene, for sampling lights at the vertices of paths (ray_color). Lights
+// are picked either in proportion to their power or, by default, by descending a BVH over
+// them whose nodes bound the position, facing (a cone of normals) and power of their lights,
+// choosing each child in proportion to how much its lights could give the shading point
+// (Conty Estevez and Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting",
+// 2018): close lights facing the point are picked most, so the cost of a pick grows with the
+// log of the number of lights and its noise hardly at all.
+class light_set {
+    public:
+        enum selection { by_power, by_bvh };
+
+        // Collects the triangles and rectangles of world made of diffuse_light, through lists,
+        // BVHs and instance ids, and numbers them (their hits report the number). Lights under
+        // other wrappers, on moving triangles or of other shapes are not sampled; rays still
+        // find them.
+        void build(hittable& world);
+
+        bool empty() const { return emitters.empty(); }
+        int size() const { return static_cast<int>(emitters.size()); }
+
+        // Picks a light for shading point p, whose material scatters towards the side of n
+        // (zero if to every side); -1 if none could light it. pmf is the probability of the
+        // pick.
+        int pick(const point3& p, const vec3& n, double u, double& pmf) const;
+        // The probability that pick() picks light from p.
+        double pick_pmf(int light, const point3& p, const vec3& n) const;
+
+        // The density per solid angle, at p, of sampling the point q of light.
+        double pdf(int light, const point3& p, const vec3& n, const point3& q) const;
+
+    public:
+        std::vector<emitter> emitters;
+        selection mode = by_bvh;
+
+    private:
+        struct node {
+            aabb bounds;
+            point3 centre;          // of the sphere around bounds
+            double radius2;         // its radius, squared
+            vec3 axis;              // of the cone of the lights' normals
+            double cos_theta, sin_theta;    // of its half angle
+            double power;
+            bool two_sided;
+            int second;             // child, the first being the next node; -1 for a leaf
+            int light;              // of a leaf
+        };
+
+        static node make_node(const aabb& bounds, const vec3& axis, double cos_theta,
+                              double power, bool two_sided, int second, int light) {
+            point3 centre = 0.5 * (bounds.min() + bounds.max());
+            return {bounds, centre, (bounds.max() - centre).length_squared(), axis, cos_theta,
+                    sqrt(fmax(0, 1 - cos_theta * cos_theta)), power, two_sided, second, light};
+        }
+
+        void collect(hittable* object);
+        int build_nodes(std::vector<int>& order, int begin, int end, uint64_t trail, int depth);
+        double importance(const node& n, const point3& p, const vec3& normal) const;
+
+        std::vector<node> nodes;
+        std::vector<uint64_t> trails;   // bit k: whether the way to the light turns to the
+                                        // second child at depth k
+        std::vector<double> cdf;        // of power, for by_power
+};
+
+
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+
+void light_set::build(hittable& world) {
+    emitters.clear();
+    collect(&world);
+
+    cdf.assign(emitters.size(), 0);
+    double total = 0;
+    for (size_t k = 0; k < emitters.size(); k++)
+        cdf[k] = total += emitters[k].power;
+
+    nodes.clear();
+    trails.assign(emitters.size(), 0);
+    if (emitters.empty())
+        return;
+    std::vector<int> order(emitters.size());
+    for (size_t k = 0; k < order.size(); k++)
+        order[k] = static_cast<int>(k);
+    build_nodes(order, 0, static_cast<int>(order.size()), 0, 0);
+}
+
+
+void light_set::collect(hittable* object) {
+    if (auto list = dynamic_cast<hittable_list*>(object)) {
+        for (const auto& o : list->objects)
+            collect(o.get());
+        return;
+    }
+    if (auto inner = dynamic_cast<bvh_node*>(object)) {
+        collect(inner->left.get());
+        if (inner->right != inner->left)
+            collect(inner->right.get());
+        return;
+    }
+    if (auto instance = dynamic_cast<instance_id*>(object)) {
+        collect(instance->ptr.get());
+        return;
+    }
+
+    emitter e;
+    shared_ptr<material> m;
+    int* number = nullptr;
+    if (auto tri = dynamic_cast<triangle*>(object)) {
+        if (dynamic_cast<moving_triangle*>(object))
+            return;
+        e = {tri->a, tri->b - tri->a, tri->c - tri->a, false, tri->two_sided};
+        m = tri->mat_ptr;
+        number = &tri->light;
+    } else if (auto rect = dynamic_cast<xy_rect*>(object)) {
+        e = {point3(rect->x0, rect->y0, rect->k), vec3(rect->x1 - rect->x0, 0, 0),
+             vec3(0, rect->y1 - rect->y0, 0), true, true};
+        m = rect->mp;
+        number = &rect->light;
+    } else if (auto rect = dynamic_cast<xz_rect*>(object)) {
+        e = {point3(rect->x0, rect->k, rect->z0), vec3(0, 0, rect->z1 - rect->z0),
+             vec3(rect->x1 - rect->x0, 0, 0), true, true};
+        m = rect->mp;
+        number = &rect->light;
+    } else if (auto rect = dynamic_cast<yz_rect*>(object)) {
+        e = {point3(rect->k, rect->y0, rect->z0), vec3(0, rect->y1 - rect->y0, 0),
+             vec3(0, 0, rect->z1 - rect->z0), true, true};
+        m = rect->mp;
+        number = &rect->light;
+    } else {
+        return;
+    }
+    *number = -1;
+    // Only lights of one color are sampled: the radiance of a textured one varies over it and
+    // is left to the paths that hit it.
+    auto light = dynamic_cast<diffuse_light*>(m.get());
+    if (!light || !dynamic_cast<solid_color*>(light->emit.get()))
+        return;
+
+    vec3 cross_product = cross(e.e1, e.e2);
+    e.area = cross_product.length() * (e.parallelogram ? 1 : 0.5);
+    if (e.area == 0)
+        return;
+    e.normal = cross_product / cross_product.length();
+    e.radiance = light->emitted(0.5, 0.5, e.centre());
+    e.power = luminance(e.radiance) * e.area * (e.two_sided ? 2 : 1);
+    if (e.power <= 0)
+        return;
+    *number = static_cast<int>(emitters.size());
+    emitters.push_back(e);
+}
+
+
+// Builds the subtree of the lights order[begin, end), splitting them in the middle of the
+// longest axis of their centres, and returns its root.
+int light_set::build_nodes(std::vector<int>& order, int begin, int end, uint64_t trail,
+                           int depth) {
+    int index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    if (end - begin == 1) {
+        const emitter& e = emitters[order[begin]];
+        nodes[index] = make_node(e.bounds(), e.normal, 1, e.power, e.two_sided, -1, order[begin]);
+        trails[order[begin]] = trail;
+        return index;
+    }
+
+    aabb centres;
+    for (int k = begin; k < end; k++) {
+        point3 c = emitters[order[k]].centre();
+        centres = k == begin ? aabb(c, c) : surrounding_box(centres, aabb(c, c));
+    }
+    int axis = centres.longest_axis();
+    int middle = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                     [&](int x, int y) {
+                         return emitters[x].centre()[axis] < emitters[y].centre()[axis];
+                     });
+    // Halving, the tree is far less than 64 levels deep, as deep as the trails go.
+    int first = build_nodes(order, begin, middle, trail, depth + 1);
+    int second = build_nodes(order, middle, end, trail | uint64_t(1) << depth, depth + 1);
+    const node& a = nodes[first];
+    const node& b = nodes[second];
+
+    // The smallest cone around both children's cones.
+    vec3 axis_v = a.axis;
+    double cos_theta = a.cos_theta;
+    double theta_a = acos(clamp(a.cos_theta, -1, 1)), theta_b = acos(clamp(b.cos_theta, -1, 1));
+    double theta_d = acos(clamp(dot(a.axis, b.axis), -1, 1));
+    if (fmin(theta_d + theta_b, pi) <= theta_a) {
+        // a's cone already holds b's
+    } else if (fmin(theta_d + theta_a, pi) <= theta_b) {
+        axis_v = b.axis, cos_theta = b.cos_theta;
+    } else {
+        double theta_o = (theta_a + theta_d + theta_b) / 2;
+        vec3 w = cross(a.axis, b.axis);
+        if (theta_o >= pi || w.length_squared() == 0) {
+            cos_theta = -1;
+        } else {
+            // a's axis turned towards b's by theta_o - theta_a (Rodrigues' formula).
+            w = w / w.length();
+            double turn = theta_o - theta_a;
+            axis_v = a.axis * cos(turn) + cross(w, a.axis) * sin(turn)
+                   + w * dot(w, a.axis) * (1 - cos(turn));
+            cos_theta = cos(theta_o);
+        }
+    }
+    nodes[index] = make_node(surrounding_box(a.bounds, b.bounds), axis_v, cos_theta,
+                             a.power + b.power, a.two_sided || b.two_sided, second, -1);
+    return index;
+}
+
+
+// How much the lights of a node could give p at most, roughly: their power over the squared
+// distance, times the cosines at the lights and at p of the smallest angles their bounds allow.
+double light_set::importance(const node& n, const point3& p, const vec3& normal) const {
+    vec3 to_p = p - n.centre;
+    double length2 = to_p.length_squared();
+    double d2 = fmax(length2, sqrt(n.radius2));
+    vec3 wi = length2 > 0 ? to_p / sqrt(length2) : vec3(0, 0, 1);
+
+    // The angle the bounds' sphere takes up as seen from p, all of it if p is inside.
+    double cos_b = -1, sin_b = 0;
+    if (n.radius2 < length2) {
+        double sin2 = n.radius2 / length2;
+        cos_b = sqrt(1 - sin2), sin_b = sqrt(sin2);
+    }
+
+    // cos(max(0, x - y)) and sin(max(0, x - y)) from the cosines and sines of x and y.
+    auto cos_sub = [](double sin_x, double cos_x, double sin_y, double cos_y) {
+        return cos_x > cos_y ? 1.0 : cos_x * cos_y + sin_x * sin_y;
+    };
+    auto sin_sub = [](double sin_x, double cos_x, double sin_y, double cos_y) {
+        return cos_x > cos_y ? 0.0 : sin_x * cos_y - cos_x * sin_y;
+    };
+
+    // At the lights: the angle between the cone and p, less the cone's and the bounds' angles.
+    double cos_w = dot(n.axis, wi);
+    if (n.two_sided)
+        cos_w = fabs(cos_w);
+    double sin_w = sqrt(fmax(0, 1 - cos_w * cos_w));
+    double cos_x = cos_sub(sin_w, cos_w, n.sin_theta, n.cos_theta);
+    double sin_x = sin_sub(sin_w, cos_w, n.sin_theta, n.cos_theta);
+    double cos_light = cos_sub(sin_x, cos_x, sin_b, cos_b);
+    if (cos_light <= 0)
+        return 0;
+
+    // At p: the angle between its normal and the lights, less the bounds' angle.
+    double cos_p = 1;
+    if (normal.length_squared() > 0) {
+        double cos_i = -dot(normal, wi);
+        double sin_i = sqrt(fmax(0, 1 - cos_i * cos_i));
+        cos_p = cos_sub(sin_i, cos_i, sin_b, cos_b);
+        if (cos_p <= 0)
+            return 0;
+    }
+    return n.power * cos_light * cos_p / d2;
+}
+
+
+int light_set::pick(const point3& p, const vec3& n, double u, double& pmf) const {
+    if (emitters.empty())
+        return -1;
+    if (mode == by_power) {
+        double total = cdf.back();
+        int k = static_cast<int>(std::upper_bound(cdf.begin(), cdf.end(), u * total) - cdf.begin());
+        k = std::min(k, size() - 1);
+        pmf = emitters[k].power / total;
+        return k;
+    }
+
+    pmf = 1;
+    int index = 0;
+    while (nodes[index].second >= 0) {
+        double first = importance(nodes[index + 1], p, n);
+        double second = importance(nodes[nodes[index].second], p, n);
+        if (first + second == 0)
+            return -1;
+        double p_first = first / (first + second);
+        if (u < p_first) {
+            u = fmin(u / p_first, 1 - 1e-16);
+            pmf *= p_first;
+            index = index + 1;
+        } else {
+            u = fmin((u - p_first) / (1 - p_first), 1 - 1e-16);
+            pmf *= 1 - p_first;
+            index = nodes[index].second;
+        }
+    }
+    return nodes[index].light;
+}
+
+
+double light_set::pick_pmf(int light, const point3& p, const vec3& n) const {
+    if (mode == by_power)
+        return emitters[light].power / cdf.back();
+
+    double pmf = 1;
+    uint64_t trail = trails[light];
+    for (int index = 0, depth = 0; nodes[index].second >= 0; depth++) {
+        double first = importance(nodes[index + 1], p, n);
+        double second = importance(nodes[nodes[index].second], p, n);
+        if (first + second == 0)
+            return 0;
+        bool go_second = trail >> depth & 1;
+        pmf *= (go_second ? second : first) / (first + second);
+        index = go_second ? nodes[index].second : index + 1;
+    }
+    return pmf;
+}
+
+
+double light_set::pdf(int light, const point3& p, const vec3& n, const point3& q) const {
+    const emitter& e = emitters[light];
+    vec3 to_q = q - p;
+    double d2 = to_q.length_squared();
+    double cosine = dot(e.normal, -to_q) / sqrt(d2);
+    if (e.two_sided)
+        cosine = fabs(cosine);
+    if (cosine <= 0)
+        return 0;
+    return pick_pmf(light, p, n) * d2 / (cosine * e.area);
+}
+
+
+#endif
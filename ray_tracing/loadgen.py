@@ -0,0 +1,185 @@
+"""Load generator for the render service: mixed interactive and batch renders.
+
+Requests of each class arrive as a Poisson process (open loop, so a slow server builds a
+queue instead of slowing the load down), each with a teapot at a random place so the cache
+can't answer it. A share of the interactive requests is superseded by another render from the
+same session shortly after, as when the scene is edited mid-render, which cancels the first.
+Reports per class how the requests ended, their queueing delay (submission to first slice)
+and latency percentiles, and the throughput.
+
+Either drives a running app.py over HTTP, or (--local) the scheduler in this process with a.out
+workers, from the directory of a.out and its teapot files.
+
+usage: python3 loadgen.py [--url http://127.0.0.1:5000 | --local N] [--duration 60]
+                          [--interactive-rate 0.5] [--batch-rate 0.1] [--supersede 0.2]
+"""
+import argparse
+import json
+import random
+import threading
+import time
+import urllib.error
+import urllib.request
+
+from scheduler import RenderJob, RenderScheduler, run_slice, scene_items
+
+
+def random_scene(rng):
+    scale = rng.uniform(2.3, 3.45)
+    x, y, z = rng.uniform(-50, 50), rng.uniform(-40, 0), rng.uniform(-230, -160)
+    return [{'mvMatrix': [scale, 0, 0, 0, 0, scale, 0, 0, 0, 0, scale, 0, x, y, z, 1],
+             'mvNormalMatrix': [1 / scale, 0, 0, 0, 1 / scale, 0, 0, 0, 1 / scale],
+             'meterial': rng.randrange(3)}]
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100 * len(values)))]
+
+
+class HttpClient:
+    def __init__(self, url):
+        self.url = url.rstrip('/') + '/render'
+
+    def render(self, request):
+        data = json.dumps(request).encode()
+        http_request = urllib.request.Request(self.url, data, {'Content-Type': 'application/json'})
+        try:
+            with urllib.request.urlopen(http_request, timeout=600) as response:
+                response.read()
+                return {'state': response.headers.get('X-Job-State', 'done'),
+                        'queue_ms': float(response.headers.get('X-Queue-Ms', 0)),
+                        'spp': int(response.headers.get('X-Samples-Per-Pixel', 0))}
+        except urllib.error.HTTPError as error:
+            states = {503: 'rejected', 409: 'cancelled'}
+            return {'state': states.get(error.code, 'failed'), 'queue_ms': 0, 'spp': 0}
+        except OSError:
+            return {'state': 'failed'}
+
+
+class LocalClient:
+    def __init__(self, workers, queue_limit, slice_seconds, binary):
+        run = lambda job, seconds: run_slice(job, seconds, binary)
+        self.scheduler = RenderScheduler(workers, queue_limit, slice_seconds, run=run)
+
+    def render(self, request):
+        options = {'samples_per_pixel': request['samples_per_pixel'],
+                   'time_budget': request['time_budget'], 'min_samples_per_pixel': 1,
+                   'format': 'png'}
+        job = RenderJob(None, scene_items(request['renderData']), options, request['priority'],
+                        request['session'])
+        if not self.scheduler.submit(job):
+            return {'state': 'rejected'}
+        job.done.wait()
+        return {'state': job.state, 'queue_ms': job.queue_delay() * 1000,
+                'spp': job.samples_per_pixel}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--url', default='http://127.0.0.1:5000')
+    parser.add_argument('--local', type=int, default=0,
+                        help="schedule in this process on N workers instead of calling --url")
+    parser.add_argument('--binary', default='./a.out')
+    parser.add_argument('--queue', type=int, default=16, help="queue limit with --local")
+    parser.add_argument('--slice', type=float, default=2.0, help="seconds per slice with --local")
+    parser.add_argument('--duration', type=float, default=60, help="seconds of arrivals")
+    parser.add_argument('--interactive-rate', type=float, default=0.5, help="requests per second")
+    parser.add_argument('--interactive-spp', type=int, default=4)
+    parser.add_argument('--interactive-budget', type=float, default=5)
+    parser.add_argument('--batch-rate', type=float, default=0.1)
+    parser.add_argument('--batch-spp', type=int, default=64)
+    parser.add_argument('--batch-budget', type=float, default=30)
+    parser.add_argument('--supersede', type=float, default=0.2,
+                        help="share of interactive requests replaced by a newer one")
+    parser.add_argument('--supersede-after', type=float, default=1.0, help="seconds")
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--json', help="also write the results here")
+    args = parser.parse_args()
+
+    client = (LocalClient(args.local, args.queue, args.slice, args.binary) if args.local
+              else HttpClient(args.url))
+    rng = random.Random(args.seed)
+    lock = threading.Lock()
+    results = []
+    threads = []
+
+    def send(priority, session, spp, budget):
+        request = {'renderData': random_scene(rng), 'samples_per_pixel': spp,
+                   'time_budget': budget, 'priority': priority, 'session': session}
+        start = time.monotonic()
+        result = client.render(request)
+        result.update(priority=priority, latency_ms=(time.monotonic() - start) * 1000,
+                      pixels=400 * 400)
+        with lock:
+            results.append(result)
+
+    def launch(*request):
+        thread = threading.Thread(target=send, args=request)
+        thread.start()
+        threads.append(thread)
+
+    # One merged arrival process; each arrival is of a class in proportion to its rate.
+    total_rate = args.interactive_rate + args.batch_rate
+    start = time.monotonic()
+    next_arrival = start
+    count = 0
+    while True:
+        next_arrival += rng.expovariate(total_rate)
+        if next_arrival - start > args.duration:
+            break
+        time.sleep(max(0.0, next_arrival - time.monotonic()))
+        count += 1
+        session = f"loadgen-{count}"
+        if rng.random() < args.interactive_rate / total_rate:
+            launch('interactive', session, args.interactive_spp, args.interactive_budget)
+            if rng.random() < args.supersede:
+                timer = threading.Timer(args.supersede_after, launch,
+                                        ('interactive', session, args.interactive_spp,
+                                         args.interactive_budget))
+                timer.start()
+                threads.append(timer)
+        else:
+            launch('batch', session, args.batch_spp, args.batch_budget)
+    for thread in threads:
+        thread.join()
+    elapsed = time.monotonic() - start
+
+    report = {'seconds': elapsed}
+    for priority in ('interactive', 'batch'):
+        mine = [r for r in results if r['priority'] == priority]
+        served = [r for r in mine if r['state'] in ('done', 'cancelled')]
+        done = [r for r in mine if r['state'] == 'done']
+        queue = [r['queue_ms'] for r in served]
+        latency = [r['latency_ms'] for r in done]
+        report[priority] = {
+            'requests': len(mine),
+            **{state: sum(r['state'] == state for r in mine)
+               for state in ('done', 'cancelled', 'rejected', 'failed')},
+            'queue_ms_mean': sum(queue) / len(queue) if queue else float('nan'),
+            'queue_ms_p50': percentile(queue, 50),
+            'queue_ms_p95': percentile(queue, 95),
+            'latency_ms_p50': percentile(latency, 50),
+            'latency_ms_p95': percentile(latency, 95),
+            'jobs_per_second': len(done) / elapsed,
+            'samples_per_second': sum(r['spp'] * r['pixels'] for r in served) / elapsed,
+        }
+    for priority in ('interactive', 'batch'):
+        r = report[priority]
+        print(f"{priority}: {r['requests']} requests, {r['done']} done, {r['cancelled']} cancelled, "
+              f"{r['rejected']} rejected, {r['failed']} failed")
+        print(f"    queueing delay mean {r['queue_ms_mean']:.0f} ms, p50 {r['queue_ms_p50']:.0f} ms, "
+              f"p95 {r['queue_ms_p95']:.0f} ms; latency p50 {r['latency_ms_p50']:.0f} ms, "
+              f"p95 {r['latency_ms_p95']:.0f} ms")
+        print(f"    throughput {r['jobs_per_second']:.3f} jobs/s, "
+              f"{r['samples_per_second'] / 1e6:.3f} M samples/s")
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(report, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
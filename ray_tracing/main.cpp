@@ -11,18 +11,33 @@
 
 #include "rtweekend.h"
 
+#include "animation.h"
 #include "box.h"
+#include "checkpoint.h"
 #include "bvh.h"
 #include "camera.h"
 #include "color.h"
 #include "constant_medium.h"
+#include "denoise.h"
+#include "environment.h"
+#include "framebuffer.h"
+#include "gbuffer.h"
+#include "image_texture.h"
 #include "hittable_list.h"
+#include "lights.h"
 #include "material.h"
 #include "moving_sphere.h"
+#include "renderer.h"
+#include "sampler.h"
+#include "scene.h"
 #include "sphere.h"
+#include "stats.h"
 #include "texture.h"
+#include "tile_stream.h"
+#include "trace.h"
 
 #include "triangle.h"
+#include "visibility.h"
 
 #include <iostream>
 #include <fstream>
@@ -30,171 +45,435 @@
 #include <pthread.h>
 #include "mat.h"
 #include <array>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <unistd.h>
 #include "stdio.h"
 
-// Global Materials
-auto my_metal   = make_shared<metal>(color(0.8, 0.8, 0.8), 0.3);
-auto my_glass   = make_shared<dielectric>(1.5);
-auto my_diffuse = make_shared<lambertian>(color(0.7, 0.3, 0.3));
-std::vector<shared_ptr<material>> materials = {my_metal, my_glass, my_diffuse};
+// Custom Properties
+int samples_per_pixel;
 
-color ray_color(const ray& r, const color& background, const hittable& world, int depth) {
-    hit_record rec;
+// Image
+auto aspect_ratio = 1.0;
+int image_width = 400;
+int image_height = 400;
 
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
-        return color(0,0,0);
+// The scene, its camera and the image; the render passes run in rt (renderer.h).
+renderer rt(image_width, image_height);
+
+// Progressive rendering
+std::vector<int> snapshots;         // spp at which a snapshot is written, ascending
+std::string snapshot_prefix = "out_";
+std::string sampler_name = "sobol";
+uint64_t sampler_seed = 0;
+image_format output_format = image_format::ppm;    // of the snapshots and the final image
+std::chrono::steady_clock::time_point program_start = std::chrono::steady_clock::now();
+std::chrono::steady_clock::time_point render_start;
+std::chrono::steady_clock::time_point last_pass_end;
+
+// Time budget: stop adding passes when the next one would end after the deadline, but never
+// before min_samples_per_pixel passes are done.
+double time_budget = 0;             // seconds since program start, 0 = no deadline
+int min_samples_per_pixel = 1;
+double slowest_pass = 0;
+int passes_done = 0;                // including the samples loaded from checkpoints
+
+// Checkpoints
+scene_hash scene;
+std::string checkpoint_file;        // written periodically and when the render ends
+double checkpoint_period = 60;      // seconds
+std::chrono::steady_clock::time_point last_checkpoint;
+std::vector<std::string> resume_files;
+checkpoint resumed;                 // merged contents of the resume files
+int passes_loaded = 0;
+uint32_t first_sample = 0;          // sample index of this run's first pass
+bool first_sample_set = false;
+
+// Only the pixels in [x0, x1) x [y0, y1) are rendered (-w), e.g. one tile of a distributed
+// render; the others keep zero samples.
+int window[4] = {0, 0, 0, 0};
+bool window_set = false;
+
+// Temporal reuse: -G writes this render's G-buffer, -H starts from the pixels of a previous
+// render (its checkpoint and G-buffer) that the edit since then didn't change.
+std::string gbuffer_file;
+std::string history_checkpoint, history_gbuffer;
+gbuffer frame_gbuffer;              // empty unless -G or -H
+bool history_used = false;
+
+// Denoising (-D) and its first-hit feature buffers, also written out with -A
+bool denoise_output = false;
+std::string aov_prefix;
+aov_buffer aovs;                    // empty unless -D or -A
+
+// Streaming (-p): stdout carries tile_stream messages, each thread's tile after passes 1, 2,
+// 4, ... and then the image, instead of the image alone.
+bool stream_progress = false;
+tile_stream* progress_stream = nullptr;
+
+// Animation (-a): the frames of the keyframed instances are rendered one after the other,
+// the BVHs of the moving instances refitted in between. The shutter stays open for this
+// fraction of a frame (-u), 0 for no motion blur.
+std::string animation_file;
+animation keyframes;
+double shutter = 0;
+
+// Image texture (-X) of the diffuse material, mapped around the teapots
+std::string texture_file;
+
+// HDR environment map (-E) that rays leaving the scene find, instead of the black background
+std::string environment_file;
+
+std::string stats_file;             // -S, needs a build with -DRT_STATS
+std::string trace_file;             // -T
+
+// Primary hits from a rasterized visibility buffer (-V)
+bool use_visibility = false;
+visibility_buffer visibility;
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int sig)
+{
+    stop_requested = 1;
+}
 
-    // If the ray hits nothing, return the background color.
-    if (!world.hit(r, 0.001, infinity, rec))
-        return background;
+bool save_checkpoint()
+{
+    TRACE_SCOPE("save_checkpoint");
+    checkpoint state = resumed;
+    state.hash = scene.value;
+    state.seed = sampler_seed;
+    state.sampler_name = sampler_name;
+    uint32_t run = passes_done - passes_loaded;
+    if (run > 0)
+        state.add_range({first_sample, first_sample + run});
+    state.image = rt.image;
+    last_checkpoint = std::chrono::steady_clock::now();
+    if (!state.save(checkpoint_file))
+    {
+        std::cerr << "cannot write checkpoint " << checkpoint_file << "\n";
+        return false;
+    }
+    return true;
+}
 
-    ray scattered;
-    color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+bool load_checkpoints()
+{
+    for (const auto& file : resume_files)
+    {
+        checkpoint loaded;
+        std::string error;
+        if (!loaded.load(file))
+            error = "not a checkpoint file";
+        else if (loaded.hash != scene.value)
+            error = "checkpoint is of a different scene";
+        else if (loaded.sampler_name != sampler_name || loaded.seed != sampler_seed)
+            error = "checkpoint used a different sampler or seed";
+        if (!error.empty() || !resumed.merge(loaded, error))
+        {
+            std::cerr << file << ": " << error << "\n";
+            return false;
+        }
+    }
+    if (resume_files.empty())
+        return true;
+
+    rt.image = resumed.image;
+    passes_done = passes_loaded = resumed.sample_count();
+    if (!first_sample_set)
+        first_sample = resumed.next_sample();
+    int remaining = std::max(0, samples_per_pixel - passes_loaded);
+    if (resumed.overlaps({first_sample, first_sample + remaining}))
+    {
+        std::cerr << "sample range starting at " << first_sample << " overlaps the checkpoints\n";
+        return false;
+    }
+    std::cerr << "resuming from " << passes_loaded << " samples per pixel\n";
+    return true;
+}
 
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
+// A history that can't be used only costs its speedup, so it is skipped with a warning.
+void load_history()
+{
+    TRACE_SCOPE("history");
+    checkpoint previous;
+    gbuffer previous_gbuffer;
+    std::string error;
+    if (!previous.load(history_checkpoint))
+        error = history_checkpoint + ": not a checkpoint file";
+    else if (!previous_gbuffer.load(history_gbuffer))
+        error = history_gbuffer + ": not a G-buffer file";
+    else if (previous.sampler_name != sampler_name || previous.seed != sampler_seed)
+        error = "the history used a different sampler or seed";
+    if (!error.empty())
+    {
+        std::cerr << "-H: rendering from scratch, " << error << "\n";
+        return;
+    }
 
-    return emitted + attenuation * ray_color(scattered, background, world, depth-1);
+    int kept = reuse_history(previous_gbuffer, previous.image, frame_gbuffer, rt.image);
+    int pixels = image_width * image_height;
+    std::cerr << "-H: kept the history of " << kept << " of " << pixels << " pixels ("
+              << 100.0 * kept / pixels << "%)\n";
+    if (kept == 0)
+        return;
+    // New samples continue after the history's, so no pixel gets the same sample twice. The
+    // checkpoint only records this run's range: that many samples are in every pixel, the
+    // kept ones just have more.
+    history_used = true;
+    if (!first_sample_set)
+        first_sample = previous.next_sample();
 }
 
-// Global Teapot 
-vector<std::array<double, 4>> teapot_pos;
-vector<std::array<double, 3>> teapot_norm;
-int teapot_vertex_cnt;
-
-void load_teapot()
+// Runs on exactly one thread once every worker has finished a pass; returns whether to render
+// another.
+bool finish_pass(int)
 {
-    std::ifstream teapot_file;
-    teapot_file.open("modify_teapot.txt");
-
-    std::string line;
-    while(std::getline(teapot_file, line))
+    trace_scope trace("finish_pass");
+    passes_done++;
+    trace.arg("spp", passes_done);
+    auto now = std::chrono::steady_clock::now();
+    slowest_pass = std::max(slowest_pass,
+        std::chrono::duration<double>(now - last_pass_end).count());
+    last_pass_end = now;
+    if (std::binary_search(snapshots.begin(), snapshots.end(), passes_done))
+    {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - render_start;
+        TRACE_SCOPE("snapshot");
+        std::string file = snapshot_prefix + std::to_string(passes_done)
+                         + image_extension(output_format);
+        if (!rt.image.write(file, output_format))
+            std::cerr << "cannot write snapshot " << file << "\n";
+        else
+            std::cerr << "\nsnapshot " << file << " " << elapsed.count() << "s\n";
+    }
+    if (!checkpoint_file.empty()
+        && std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_period)
+        save_checkpoint();
+    bool rendering = passes_done < samples_per_pixel && !stop_requested;
+    if (rendering && time_budget > 0 && passes_done >= min_samples_per_pixel)
     {
-        std::array<double, 4> pos;
-        std::array<double, 3> norm;
-        sscanf(line.c_str(), "%lf %lf %lf %lf %lf %lf", 
-            &pos[0], &pos[1], &pos[2], &norm[0], &norm[1], &norm[2]);
-        pos[3] = 1.0;
-        teapot_pos.push_back(pos);
-        teapot_norm.push_back(norm);
+        // Estimate the next pass from the slower of the average and the worst pass so far.
+        double elapsed = std::chrono::duration<double>(now - program_start).count();
+        double average = std::chrono::duration<double>(now - render_start).count()
+                       / (passes_done - passes_loaded);
+        rendering = elapsed + std::max(average, slowest_pass) <= time_budget;
     }
-    teapot_vertex_cnt = teapot_pos.size();
+    return rendering;
+}
+
+void write_stats()
+{
+    if (stats_file.empty())
+        return;
+#ifdef RT_STATS
+    std::ofstream stats_out(stats_file);
+    total_stats.write_json(stats_out);
+#else
+    std::cerr << "-S: statistics are not compiled in, build with -DRT_STATS\n";
+#endif
 }
 
-void add_teapot(hittable_list& objects, mat4 pos_mat, mat3 norm_mat, shared_ptr<material> m) {
+void write_trace_file()
+{
+    if (trace_file.empty())
+        return;
+    std::ofstream trace_out(trace_file);
+    write_trace(trace_out);
+    if (!trace_out)
+        std::cerr << "cannot write trace " << trace_file << "\n";
+}
 
-	hittable_list teapot;
-    // for glass
-    hittable_list inner_teapot; 
-    bool is_glass = (m == my_glass);
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
 
-    for(int i = 0; i < teapot_vertex_cnt / 3; i++)
+// -a: renders every frame with samples_per_pixel samples to prefix frame<number>, moving the
+// animated instances in between, and reports what a frame costs.
+int render_animation(std::vector<animated_instance>& animated, double build_seconds)
+{
+    rt.sampler_name = sampler_name;
+    rt.sampler_seed = sampler_seed;
+    rt.end_pass = [](int) { return !stop_requested; };
+    double setup_seconds = seconds_since(program_start);
+    double refit_seconds = 0, render_seconds = 0, output_seconds = 0;
+    int frame = 0;
+    for (; frame < keyframes.frames() && !stop_requested; frame++)
     {
-        vec3 pos[3];
-        vec3 norm[3];
-        vec3 inner_pos[3];
-        for(int j = 0; j < 3; j++)
+        trace_scope trace("frame");
+        trace.arg("frame", frame);
+        auto start = std::chrono::steady_clock::now();
         {
-            std::array<double, 4> new_pos;
-            mat4_mul(pos_mat, teapot_pos[i * 3 + j], new_pos);
-            std::array<double, 3> new_norm;
-            mat3_mul(norm_mat, teapot_norm[i * 3 + j], new_norm);
-
-            pos[j] = point3(new_pos[0], new_pos[1], new_pos[2]);
-            norm[j] = vec3(new_norm[0], new_norm[1], new_norm[2]);
-            norm[j] = normalize(norm[j]);
-            if(is_glass)
+            TRACE_SCOPE("refit");
+            for (auto& instance : animated)
             {
-                double inner_mat[4][4];
-                for(int k = 0; k < 4; k++)
-                    for(int l = 0; l < 4; l++)
-                        inner_mat[k][l] = pos_mat[k][l];
-                for(int k = 0; k < 4; k++)
-                    inner_mat[k][k] *= 0.95;
-                mat4_mul(inner_mat, teapot_pos[i * 3 + j], new_pos);
-                inner_pos[j] = point3(new_pos[0], new_pos[1], new_pos[2]);
+                mat4 pos, pos_end;
+                mat3 norm, norm_end;
+                keyframes.transform(instance.id, frame, pos, norm);
+                keyframes.transform(instance.id, frame + shutter, pos_end, norm_end);
+                instance.move(pos, norm, pos_end, norm_end);
             }
+            if (rt.sample_lights)
+                rt.lights.build(rt.world);
+        }
+        double refit = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        rt.image = framebuffer(image_width, image_height);
+        if (denoise_output || !aov_prefix.empty())
+        {
+            aovs = aov_buffer(image_width, image_height);
+            rt.aovs = &aovs;
         }
-        vec3 u = pos[1] - pos[0];
-        vec3 v = pos[2] - pos[0];
-        vec3 face_norm = normalize(cross(u, v));
-        vec3 avg_vertex_norm = (norm[0] + norm[1] + norm[2]) / 3;
-        face_norm = (dot(face_norm, avg_vertex_norm) > 0.0f)? face_norm : -face_norm;
-        shared_ptr<hittable> tri = 
-            make_shared<triangle>(pos[0], pos[1], pos[2], norm[0], norm[1], norm[2], face_norm, m);
-        teapot.add(tri);
-
-        if(is_glass)
+        rt.next_sample = first_sample;
+        rt.render(samples_per_pixel);
+        double render = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        char number[16];
+        snprintf(number, sizeof(number), "frame%04d", frame);
+        std::string file = snapshot_prefix + number + image_extension(output_format);
+        const framebuffer& output = denoise_output ? atrous_denoiser(rt.image, aovs).run() : rt.image;
+        if (!output.write(file, output_format))
         {
-            shared_ptr<hittable> inner_tri = 
-                make_shared<triangle>(inner_pos[0], inner_pos[1], inner_pos[2],
-                    -norm[0], -norm[1], -norm[2], -face_norm, m);
-            inner_teapot.add(inner_tri);
+            std::cerr << "cannot write frame " << file << "\n";
+            return -1;
         }
+        if (!aov_prefix.empty() && !aovs.write(aov_prefix + number + "_"))
+            std::cerr << "cannot write the AOVs " << aov_prefix << number << "_*.pfm\n";
+        double output_time = seconds_since(start);
+
+        std::cerr << file << ": refit " << refit * 1000 << " ms, render " << render * 1000
+                  << " ms, output " << output_time * 1000 << " ms\n";
+        refit_seconds += refit;
+        render_seconds += render;
+        output_seconds += output_time;
     }
 
-	objects.add(make_shared<bvh_node>(teapot, 0, 0));
-    if(is_glass)
-    {
-	    objects.add(make_shared<bvh_node>(inner_teapot, 0, 0));
-    }
+    write_stats();
+    write_trace_file();
+    int frames = std::max(frame, 1);
+    double total = seconds_since(program_start);
+    std::cerr << "\nRendered " << frame << " frames of " << samples_per_pixel << " samples per pixel in "
+              << total << "s: " << total / frames * 1000 << " ms per frame amortized.\n";
+    std::cerr << "Setup " << setup_seconds * 1000 << " ms once (of it " << build_seconds * 1000
+              << " ms building the BVHs of " << animated.size() << " animated instances); per frame"
+              << " refit " << refit_seconds / frames * 1000 << " ms, render "
+              << render_seconds / frames * 1000 << " ms, output " << output_seconds / frames * 1000
+              << " ms.\n";
+    if (stop_requested)
+        std::cerr << "\nStopped after " << frame << " frames.\n";
+    std::cerr << "\nDone.\n";
+    return 0;
 }
 
-// Custom Properties
-int samples_per_pixel;
-
-// Image
-auto aspect_ratio = 1.0;
-int image_width = 400;
-int image_height = 400;
-int max_depth = 50;
-
-// World
-hittable_list world;
-
-// Camera
-camera cam;
-color background;
-
-// Global(output file)
-std::vector<std::vector<std::string>> pixels;
-
-// Rednering Thread
-void *render_thread(void *argv)
+void parse_snapshots(const char *list)
 {
-    int *range = (int *)argv;
-    int min_width = range[0];
-    int min_height = range[1];
-    int max_width = range[2];
-    int max_height = range[3];
-    for (int j = max_height-1; j >= min_height; --j) {
-        for (int i = min_width; i < max_width; ++i) {
-            color pixel_color(0,0,0);
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / (image_width-1);
-                auto v = (j + random_double()) / (image_height-1);
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, background, world, max_depth);
-            }
-            write_color(i, j, pixel_color, samples_per_pixel);
-        }
-    }
-    pthread_exit(NULL);
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (atoi(item.c_str()) > 0)
+            snapshots.push_back(atoi(item.c_str()));
+    std::sort(snapshots.begin(), snapshots.end());
 }
 
 
 int main(int argc, char *argv[]) {
 
     // Arguments
-    if(argc < 3)
+    int opt;
+    while ((opt = getopt(argc, argv, "c:o:s:x:fe:t:m:k:i:r:b:w:S:T:VpG:H:DA:a:u:X:LE:")) != -1)
     {
-        std::cerr << "usage: ./a.out samples_per_pixel n [pos_mat norm_mat material] * n\n";
-        std::cerr << "materials: (0) metal; (1) glass; (2) diffuse material\n";
+        switch (opt)
+        {
+            case 'c': parse_snapshots(optarg); break;
+            case 'o': snapshot_prefix = optarg; break;
+            case 's': sampler_name = optarg; break;
+            case 'x': sampler_seed = strtoull(optarg, NULL, 10); break;
+            case 'f': output_format = image_format::pfm; break;
+            case 'e': if (!parse_image_format(optarg, output_format)) argc = 0; break;
+            case 't': time_budget = atof(optarg); break;
+            case 'm': min_samples_per_pixel = std::max(1, atoi(optarg)); break;
+            case 'k': checkpoint_file = optarg; break;
+            case 'i': checkpoint_period = atof(optarg); break;
+            case 'r': resume_files.push_back(optarg); break;
+            case 'b': first_sample = strtoul(optarg, NULL, 10); first_sample_set = true; break;
+            case 'S': stats_file = optarg; break;
+            case 'T': trace_file = optarg; tracing_enabled = true; break;
+            case 'V': use_visibility = true; break;
+            case 'p': stream_progress = true; break;
+            case 'G': gbuffer_file = optarg; break;
+            case 'D': denoise_output = true; break;
+            case 'A': aov_prefix = optarg; break;
+            case 'a': animation_file = optarg; break;
+            case 'u': shutter = std::min(std::max(atof(optarg), 0.0), 1.0); break;
+            case 'X': texture_file = optarg; break;
+            case 'L': rt.sample_lights = true; break;
+            case 'E': environment_file = optarg; break;
+            case 'H':
+            {
+                std::string files = optarg;
+                size_t comma = files.find(',');
+                if (comma == std::string::npos) { argc = 0; break; }
+                history_checkpoint = files.substr(0, comma);
+                history_gbuffer = files.substr(comma + 1);
+                break;
+            }
+            case 'w':
+                window_set = sscanf(optarg, "%d,%d,%d,%d",
+                                    &window[0], &window[1], &window[2], &window[3]) == 4;
+                if (!window_set) argc = 0;
+                break;
+            default: argc = 0; break;
+        }
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
+    if(argc < 3 || !std::unique_ptr<sampler>(make_sampler(sampler_name)))
+    {
+        std::cerr << "usage: ./a.out [-c spp,spp,...] [-o prefix] [-s sampler] [-x seed] [-f | -e format]\n"
+                     "               [-t seconds [-m min_spp]] [-k checkpoint [-i seconds]]\n"
+                     "               [-r checkpoint]... [-b first_sample] [-w x0,y0,x1,y1] [-S stats.json]\n"
+                     "               [-T trace.json] [-V] [-p] [-G gbuffer] [-H checkpoint,gbuffer] [-D] [-A prefix]\n"
+                     "               [-a keyframes [-u shutter]] [-X image] [-L] [-E map]\n"
+                     "               samples_per_pixel n [pos_mat norm_mat material] * n\n";
+        std::cerr << "materials: (0) metal; (1) glass; (2) diffuse material; (3) light\n";
+        std::cerr << "-c: write prefix<spp>.ppm snapshots while rendering progressively (default prefix out_)\n";
+        std::cerr << "-s: independent, sobol (default) or bluenoise; -x: seed of the sample sequences\n";
+        std::cerr << "-f: write the snapshots and the image as linear float PFM instead of PPM\n";
+        std::cerr << "-e: their format: ppm (default), pfm (same as -f), png or qoi\n";
+        std::cerr << "-t: stop before the wall-clock deadline (samples_per_pixel is then the upper limit);\n"
+                     "    -m: the samples per pixel rendered even if the deadline passes (default 1)\n";
+        std::cerr << "-k: save the render state every -i seconds (default 60) and when it ends or is stopped\n";
+        std::cerr << "-r: resume from checkpoints of the same scene, merging them if given several times;\n"
+                     "    samples_per_pixel is then the total to reach\n";
+        std::cerr << "-b: index of the first sample to render (default: after the resumed samples)\n";
+        std::cerr << "-w: render only the pixels x0 <= x < x1, y0 <= y < y1 (y = 0 is the bottom row)\n";
+        std::cerr << "-S: write ray statistics as JSON (build with -DRT_STATS)\n";
+        std::cerr << "-T: write a timeline of the render phases (chrome://tracing, ui.perfetto.dev)\n";
+        std::cerr << "-V: rasterize the primary hits instead of tracing them (pinhole camera, static triangles)\n";
+        std::cerr << "-p: stream the tiles to stdout as they are rendered, then the image (see tile_stream.h)\n";
+        std::cerr << "-G: write the G-buffer (depth, normal, instance, instances hit) next to -k's checkpoint\n";
+        std::cerr << "-H: start from a previous render of an edited scene (its -k and -G files), keeping\n"
+                     "    the pixels the edit didn't change and sampling only the others\n";
+        std::cerr << "-D: denoise the image (not the snapshots) guided by first-hit albedo, normal and depth\n";
+        std::cerr << "-A: write those as prefix{albedo,normal,depth}.pfm\n";
+        std::cerr << "-a: render the frames of keyframed instances (see animation.h) to prefix frame<n>,\n"
+                     "    -u: with the shutter open for this fraction of a frame (default 0, no motion blur)\n";
+        std::cerr << "-X: texture the diffuse material (2) with this PPM, QOI or PNG image, wrapped around\n"
+                     "    the teapots and mipmapped\n";
+        std::cerr << "-L: sample the lights (the ceiling's and glowing teapots) at every diffuse bounce,\n"
+                     "    picking them with a light BVH, and weigh that against the paths finding them\n";
+        std::cerr << "-E: light the scene, through the box's open front, with this PFM or Radiance HDR\n"
+                     "    latitude-longitude map; with -L it is sampled by its luminance too\n";
         return -1;
     }
     samples_per_pixel = atoi(argv[1]);
+    if(!snapshots.empty())
+        samples_per_pixel = std::max(samples_per_pixel, snapshots.back());
     int number_of_teapot = atoi(argv[2]);
     if(argc - 3 !=  3 * number_of_teapot)
     {
@@ -210,26 +489,72 @@ int main(int argc, char *argv[]) {
         create_mat3(norm_matices[i], argv[3 + 3 * i + 1]);
         teapot_materials[i] = atoi(argv[3 + 3 * i + 2]);
     }
+    if (!animation_file.empty())
+    {
+        std::string error;
+        if (!keyframes.load(animation_file, error))
+        {
+            std::cerr << "-a: " << error << "\n";
+            return -1;
+        }
+        if (!keyframes.keys.empty() && keyframes.keys.rbegin()->first >= number_of_teapot)
+        {
+            std::cerr << "-a: keys of instance " << keyframes.keys.rbegin()->first << " of "
+                      << number_of_teapot << "\n";
+            return -1;
+        }
+        if (!snapshots.empty() || time_budget > 0 || !checkpoint_file.empty() || !resume_files.empty()
+            || window_set || use_visibility || stream_progress || !gbuffer_file.empty()
+            || !history_checkpoint.empty() || !texture_file.empty())
+        {
+            std::cerr << "-a: cannot be combined with -c, -t, -k, -r, -w, -V, -p, -G, -H or -X\n";
+            return -1;
+        }
+    }
 
     // World
-    auto red   = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(15, 15, 15));
-
-    // Teapot
     load_teapot();
-
-    world.add(make_shared<yz_rect>(-100, 100, -300,    0, -100, green));
-    world.add(make_shared<yz_rect>(-100, 100, -300,    0,  100,   red));
-    world.add(make_shared<xz_rect>( -25,  25, -175, -125,   96, light));
-    world.add(make_shared<xz_rect>(-100, 100, -300,    0,  100, white));
-    world.add(make_shared<xz_rect>(-100, 100, -300,    0, -100, white));
-    world.add(make_shared<xy_rect>(-100, 100, -100,  100, -200, white));
-
+    std::vector<shared_ptr<material>> material_list = default_materials(rt.pool);
+    shared_ptr<const mip_image> texture_image;
+    if (!texture_file.empty())
+    {
+        std::string error;
+        texture_image = shared_textures.get(texture_file, error);
+        if (!texture_image)
+        {
+            std::cerr << "-X: " << error << "\n";
+            return -1;
+        }
+        cylindrical_uvs(teapot);
+        material_list[2] = rt.pool.make<lambertian>(
+            arena::materials, rt.pool.make<image_texture>(arena::materials, texture_image));
+        std::cerr << "Texture " << texture_file << ": " << texture_image->width() << "x"
+                  << texture_image->height() << ", " << texture_image->levels() << " levels, "
+                  << texture_image->bytes() / 1024 << " KiB\n";
+    }
+    add_cornell_box(rt.world, rt.pool);
+    std::vector<animated_instance> animated;
+    double build_seconds = 0;
     for(int i = 0; i < number_of_teapot; i++)
     {
-        add_teapot(world, pos_matices[i], norm_matices[i], materials[teapot_materials[i]]);
+        if (keyframes.animated(i))
+        {
+            // Built where the first frame has it, then refitted frame after frame.
+            auto start = std::chrono::steady_clock::now();
+            keyframes.transform(i, 0, pos_matices[i], norm_matices[i]);
+            animated.emplace_back(rt.world, teapot, material_list[teapot_materials[i]], i, rt.pool,
+                                  shutter > 0, pos_matices[i], norm_matices[i]);
+            build_seconds += seconds_since(start);
+            continue;
+        }
+        add_mesh(rt.world, teapot, pos_matices[i], norm_matices[i],
+                 material_list[teapot_materials[i]], i, rt.pool);
+    }
+    rt.pool.report(std::cerr);
+    if (rt.sample_lights)
+    {
+        rt.lights.build(rt.world);
+        std::cerr << "Sampling " << rt.lights.size() << " lights\n";
     }
 
     // Camera
@@ -237,42 +562,212 @@ int main(int argc, char *argv[]) {
     point3 lookat = point3(0, 0, -400);
     auto vfov = 40.0;
     auto aperture = 0.0;
-    background = color(0.0,0.0,0.0);
+    const color background(0.0,0.0,0.0);
+    rt.background = background;
+    if (!environment_file.empty())
+    {
+        std::string error;
+        if (!load_environment(environment_file, rt.background, error))
+        {
+            std::cerr << "-E: " << error << "\n";
+            return -1;
+        }
+        std::cerr << "Environment " << environment_file << ": " << rt.background.width() << "x"
+                  << rt.background.height() << "\n";
+    }
     const vec3 vup(0,1,0);
     const auto dist_to_focus = 10.0;
-    cam = camera(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
-    
-    // Render
-    pixels.resize(image_width);
-    for(int i = 0; i < image_width; i++)
+    rt.set_camera(lookfrom, lookat, vup, vfov, aperture, dist_to_focus);
+
+    if (!animation_file.empty())
     {
-        pixels[i].resize(image_height, "");
+        signal(SIGINT, request_stop);
+        signal(SIGTERM, request_stop);
+        return render_animation(animated, build_seconds);
     }
 
-    pthread_t render_workers[16];
-    int width_interval = image_width / 4;
-    int height_interval = image_height / 4;
-    int range[16][4];
-    for(int j = 3; j >= 0; j--)
+    if (use_visibility)
     {
-        for(int i = 0; i < 4; i++)
+        TRACE_SCOPE("visibility_setup");
+        std::string reason;
+        use_visibility = visibility.build(rt.world, rt.cam, image_width, image_height, reason);
+        if (!use_visibility)
+            std::cerr << "-V: tracing the primary rays, " << reason << "\n";
+    }
+
+    if (!gbuffer_file.empty() || !history_checkpoint.empty())
+    {
+        TRACE_SCOPE("gbuffer");
+        frame_gbuffer = gbuffer(image_width, image_height);
+        frame_gbuffer.set_view(lookfrom, lookat, vup, vfov, aspect_ratio);
+        for(int i = 0; i < number_of_teapot; i++)
         {
-            int idx = i + 4 * j;
-            range[idx][0] = i * width_interval;
-            range[idx][1] = j * height_interval;
-            range[idx][2] = (i + 1) * width_interval;
-            range[idx][3] = (j + 1) * height_interval;
-            pthread_create(&render_workers[idx], NULL, render_thread, (void *)range[idx]);
+            scene_hash fingerprint;
+            fingerprint.add(pos_matices[i], sizeof(mat4));
+            fingerprint.add(norm_matices[i], sizeof(mat3));
+            fingerprint.add(teapot_materials[i]);
+            frame_gbuffer.instances.push_back(fingerprint.value);
         }
+        frame_gbuffer.trace_primary(rt.world);
     }
 
-    for(int i = 0; i < 16; i++)
-        pthread_join(render_workers[i], NULL);
+    // Scene hash
+    scene.add(image_width);
+    scene.add(image_height);
+    scene.add(rt.max_depth);
+    scene.add(lookfrom);
+    scene.add(lookat);
+    scene.add(vup);
+    scene.add(vfov);
+    scene.add(aperture);
+    scene.add(dist_to_focus);
+    scene.add(background);
+    scene.add(rt.background.width());
+    scene.add(rt.background.height());
+    scene.add(rt.background.data(), rt.background.size() * sizeof(color));
+    scene.add(teapot.pos.data(), teapot.pos.size() * sizeof(teapot.pos[0]));
+    scene.add(teapot.norm.data(), teapot.norm.size() * sizeof(teapot.norm[0]));
+    if (texture_image)
+    {
+        // The texels rather than the file name, so an image replaced under the same name
+        // can't be resumed into.
+        scene.add(texture_image->width());
+        scene.add(texture_image->height());
+        scene.add(texture_image->texels(), texture_image->texel_count() * sizeof(uint32_t));
+    }
+    if (rt.sample_lights)
+        scene.add(1);
+    for(int i = 0; i < number_of_teapot; i++)
+    {
+        scene.add(pos_matices[i], sizeof(mat4));
+        scene.add(norm_matices[i], sizeof(mat3));
+        scene.add(teapot_materials[i]);
+    }
 
-    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-    for (int j = image_height-1; j >= 0; --j) 
-        for (int i = 0; i < image_width; ++i) 
-            std::cout << pixels[i][j];
+    // Render
+    trace_scope render_trace("render");
+    render_trace.arg("spp", samples_per_pixel);
+    render_trace.arg("triangles", number_of_teapot * teapot.triangles());
+    if (!window_set)
+    {
+        window[2] = image_width;
+        window[3] = image_height;
+    }
+    window[0] = std::max(window[0], 0);
+    window[1] = std::max(window[1], 0);
+    window[2] = std::min(window[2], image_width);
+    window[3] = std::min(window[3], image_height);
+    if (denoise_output || !aov_prefix.empty())
+        aovs = aov_buffer(image_width, image_height);
+    if (!load_checkpoints())
+        return -1;
+    if (!history_checkpoint.empty())
+    {
+        if (!resume_files.empty())
+        {
+            std::cerr << "-H: cannot be combined with -r\n";
+            return -1;
+        }
+        load_history();
+    }
+    tile_stream stream(std::cout, program_start);
+    if (stream_progress)
+    {
+        progress_stream = &stream;
+        // What is there before the first pass: resumed samples or the kept history.
+        if (passes_loaded > 0 || history_used)
+            stream.send_tile(rt.image, 0, 0, image_width, image_height, passes_loaded);
+        // Often at first, then less often as every pass changes the image less.
+        rt.end_tile = [](int x0, int y0, int x1, int y1, int pass) {
+            if ((pass & (pass + 1)) != 0)
+                return;
+            TRACE_SCOPE("stream_tile");
+            progress_stream->send_tile(rt.image, x0, y0, x1, y1, passes_loaded + pass + 1);
+        };
+    }
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    std::copy(window, window + 4, rt.window);
+    rt.sampler_name = sampler_name;
+    rt.sampler_seed = sampler_seed;
+    rt.next_sample = first_sample;
+    rt.aovs = &aovs;
+    rt.paths = &frame_gbuffer;
+    if (use_visibility)
+        rt.visibility = &visibility;
+    // Pixels that kept enough history are skipped, so the passes go to the changed ones.
+    if (history_used)
+        rt.skip_samples = samples_per_pixel;
+    rt.end_pass = finish_pass;
+    render_start = last_pass_end = last_checkpoint = std::chrono::steady_clock::now();
+    rt.render(std::max(0, samples_per_pixel - passes_done));
+    render_trace.end();
+
+    if (!checkpoint_file.empty() && !save_checkpoint())
+        return -1;
+    if (!gbuffer_file.empty())
+        frame_gbuffer.finish_paths();
+    if (!gbuffer_file.empty() && !frame_gbuffer.save(gbuffer_file))
+    {
+        std::cerr << "cannot write G-buffer " << gbuffer_file << "\n";
+        return -1;
+    }
+
+    write_stats();
+
+    if (!aov_prefix.empty() && !aovs.write(aov_prefix))
+        std::cerr << "cannot write the AOVs " << aov_prefix << "*.pfm\n";
+
+    framebuffer denoised;
+    double denoise_seconds = 0;
+    if (denoise_output)
+    {
+        TRACE_SCOPE("denoise");
+        auto start = std::chrono::steady_clock::now();
+        denoised = atrous_denoiser(rt.image, aovs).run();
+        denoise_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    double encode_seconds;
+    size_t encoded_bytes;
+    {
+        trace_scope trace("image_output");
+        trace.arg("spp", passes_done);
+        const framebuffer& output = denoise_output ? denoised : rt.image;
+        auto start = std::chrono::steady_clock::now();
+        std::ostringstream encoded;
+        output.write(encoded, output_format);
+        encode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::string bytes = encoded.str();
+        encoded_bytes = bytes.size();
+        if (progress_stream)
+            progress_stream->send_image(bytes, image_width, image_height, passes_done);
+        else
+            std::cout.write(bytes.data(), bytes.size());
+    }
 
+    write_trace_file();
+
+    if (use_visibility)
+    {
+        uint64_t primary = rt.primary_resolved + rt.primary_fallback + rt.primary_uncovered;
+        int passes = std::max(1, passes_done - passes_loaded);
+        std::cerr << "\nVisibility buffer: " << rt.primary_resolved << " of " << primary
+                  << " primary hits without traversal (" << rt.primary_fallback << " traced after a miss, "
+                  << rt.primary_uncovered << " uncovered), rasterized in "
+                  << rt.raster_nanoseconds / 1e6 / passes << " ms per pass.\n";
+    }
+    std::cerr << "\nEncoded the image (" << image_extension(output_format) + 1 << ") in "
+              << encode_seconds * 1000 << " ms: " << encoded_bytes << " bytes.\n";
+    if (progress_stream && progress_stream->first_pixel_seconds() >= 0)
+        std::cerr << "\nFirst pixels streamed after " << progress_stream->first_pixel_seconds() * 1000
+                  << " ms.\n";
+    if (denoise_output)
+        std::cerr << "\nDenoised in " << denoise_seconds * 1000 << " ms.\n";
+    if (stop_requested)
+        std::cerr << "\nStopped after " << passes_done << " samples per pixel.\n";
+    std::chrono::duration<double> total = std::chrono::steady_clock::now() - program_start;
+    std::cerr << "\nRendered " << passes_done << " samples per pixel in " << total.count() << "s.\n";
     std::cerr << "\nDone.\n";
 }
@@ -14,6 +14,8 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "onb.h"
+#include "sampler.h"
 #include "texture.h"
 
 
@@ -26,6 +28,27 @@ class material {
         virtual bool scatter(
             const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
         ) const = 0;
+
+        // Reflectance at the hit, for the denoiser's albedo AOV; 1 for glass.
+        virtual color surface_albedo(const hit_record& rec) const {
+            return color(1,1,1);
+        }
+
+        // For sampling lights (lights.h): the density per solid angle with which scatter()
+        // sends r_in on in direction wi, and the BSDF times the cosine there. Materials that
+        // scatter into sharp directions leave them 0, and only their scattered rays find lights.
+        virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& wi) const {
+            return 0;
+        }
+
+        virtual color reflectance(const ray& r_in, const hit_record& rec, const vec3& wi) const {
+            return color(0,0,0);
+        }
+
+        // The side of the hit it scatters to, zero if to every side.
+        virtual vec3 scattering_side(const hit_record& rec) const {
+            return rec.normal;
+        }
 };
 
 
@@ -37,17 +60,31 @@ class lambertian : public material {
         virtual bool scatter(
             const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
         ) const override {
-            auto scatter_direction = rec.normal + random_unit_vector();
-
-            // Catch degenerate scatter direction
-            if (scatter_direction.near_zero())
-                scatter_direction = rec.normal;
+            double u1, u2;
+            sample_2d(u1, u2);
+            onb uvw;
+            uvw.build_from_w(rec.normal);
+            auto scatter_direction = uvw.local(random_cosine_direction(u1, u2));
 
             scattered = ray(rec.p, scatter_direction, r_in.time());
-            attenuation = albedo->value(rec.u, rec.v, rec.p);
+            attenuation = albedo->filtered(rec.u, rec.v, rec.p, rec.footprint);
             return true;
         }
 
+        virtual color surface_albedo(const hit_record& rec) const override {
+            return albedo->filtered(rec.u, rec.v, rec.p, rec.footprint);
+        }
+
+        virtual double scattering_pdf(const ray& r_in, const hit_record& rec,
+                                      const vec3& wi) const override {
+            return fmax(0, dot(rec.normal, wi) / wi.length()) / pi;
+        }
+
+        virtual color reflectance(const ray& r_in, const hit_record& rec,
+                                  const vec3& wi) const override {
+            return scattering_pdf(r_in, rec, wi) * albedo->filtered(rec.u, rec.v, rec.p, rec.footprint);
+        }
+
     public:
         shared_ptr<texture> albedo;
 };
@@ -61,11 +98,18 @@ class metal : public material {
             const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
         ) const override {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(), r_in.time());
+            double u1, u2;
+            sample_2d(u1, u2);
+            auto fuzz_offset = random_in_unit_sphere(u1, u2, sample_1d());
+            scattered = ray(rec.p, reflected + fuzz*fuzz_offset, r_in.time());
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
 
+        virtual color surface_albedo(const hit_record& rec) const override {
+            return albedo;
+        }
+
     public:
         color albedo;
         double fuzz;
@@ -74,12 +118,18 @@ class metal : public material {
 
 class dielectric : public material {
     public:
-        dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+        // With a thickness > 0 the surface is a thin wall of glass, a slab of that thickness
+        // with air on both sides, rather than the boundary of a solid.
+        dielectric(double index_of_refraction, double wall_thickness = 0)
+            : ir(index_of_refraction), thickness(wall_thickness) {}
 
         virtual bool scatter(
             const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
         ) const override {
             attenuation = color(1.0, 1.0, 1.0);
+            if (thickness > 0)
+                return scatter_thin(r_in, rec, scattered);
+
             double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
 
             vec3 unit_direction = unit_vector(r_in.direction());
@@ -89,7 +139,7 @@ class dielectric : public material {
             bool cannot_refract = refraction_ratio * sin_theta > 1.0;
             vec3 direction;
 
-            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > sample_1d())
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -100,8 +150,28 @@ class dielectric : public material {
 
     public:
         double ir; // Index of Refraction
+        double thickness;
 
     private:
+        // The light bouncing between the two faces of the slab sums to a reflectance of
+        // 2F / (1 + F); the rest leaves the far face in the incoming direction, shifted along
+        // the refracted path through the wall. Both sides are air, so the face hit doesn't
+        // matter and the exit is found without tracing the far face.
+        bool scatter_thin(const ray& r_in, const hit_record& rec, ray& scattered) const {
+            vec3 unit_direction = unit_vector(r_in.direction());
+            double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+            double f = reflectance(cos_theta, 1.0/ir);
+
+            if (2*f / (1 + f) > sample_1d()) {
+                scattered = ray(rec.p, reflect(unit_direction, rec.normal), r_in.time());
+            } else {
+                vec3 inside = refract(unit_direction, rec.normal, 1.0/ir);
+                double cos_inside = dot(-inside, rec.normal);
+                scattered = ray(rec.p + (thickness / cos_inside) * inside, unit_direction, r_in.time());
+            }
+            return true;
+        }
+
         static double reflectance(double cosine, double ref_idx) {
             // Use Schlick's approximation for reflectance.
             auto r0 = (1-ref_idx) / (1+ref_idx);
@@ -126,6 +196,10 @@ class diffuse_light : public material {
             return emit->value(u, v, p);
         }
 
+        virtual color surface_albedo(const hit_record& rec) const override {
+            return color(0,0,0);
+        }
+
     public:
         shared_ptr<texture> emit;
 };
@@ -139,11 +213,31 @@ class isotropic : public material {
         virtual bool scatter(
             const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
         ) const override {
-            scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
-            attenuation = albedo->value(rec.u, rec.v, rec.p);
+            double u1, u2;
+            sample_2d(u1, u2);
+            scattered = ray(rec.p, random_unit_vector(u1, u2), r_in.time());
+            attenuation = albedo->filtered(rec.u, rec.v, rec.p, rec.footprint);
             return true;
         }
 
+        virtual color surface_albedo(const hit_record& rec) const override {
+            return albedo->filtered(rec.u, rec.v, rec.p, rec.footprint);
+        }
+
+        virtual double scattering_pdf(const ray& r_in, const hit_record& rec,
+                                      const vec3& wi) const override {
+            return 1 / (4*pi);
+        }
+
+        virtual color reflectance(const ray& r_in, const hit_record& rec,
+                                  const vec3& wi) const override {
+            return albedo->filtered(rec.u, rec.v, rec.p, rec.footprint) / (4*pi);
+        }
+
+        virtual vec3 scattering_side(const hit_record& rec) const override {
+            return vec3(0,0,0);
+        }
+
     public:
         shared_ptr<texture> albedo;
 };
@@ -78,6 +78,7 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
+    rec.light = -1;
     rec.mat_ptr = mat_ptr;
 
     return true;
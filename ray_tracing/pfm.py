@@ -0,0 +1,22 @@
+"""Reads and writes the renderer's float images: RGB Portable Float Maps, bottom row first."""
+import struct
+
+
+def read_pfm(path):
+    with open(path, 'rb') as f:
+        if f.readline().strip() != b'PF':
+            raise ValueError(f"{path} is not an RGB PFM file")
+        width, height = map(int, f.readline().split())
+        scale = float(f.readline())
+        endian = '<' if scale < 0 else '>'
+        data = f.read(width * height * 3 * 4)
+    if len(data) != width * height * 3 * 4:
+        raise ValueError(f"{path} is truncated")
+    return width, height, struct.unpack(f"{endian}{width * height * 3}f", data)
+
+
+def write_pfm(path, width, height, values):
+    """Writes width * height RGB triples, little-endian like the renderer."""
+    with open(path, 'wb') as f:
+        f.write(f"PF\n{width} {height}\n-1.0\n".encode())
+        f.write(struct.pack(f"<{width * height * 3}f", *values))
@@ -0,0 +1,244 @@
+"""Image-quality regression harness: error against wall time, with a bias check.
+
+The reference command renders every reference scene (the teapot materials main.cpp supports,
+alone and together) once at a high spp as the average of independent runs, and stores the
+float images and their estimated noise in a directory. The compare command renders the same
+scenes with a candidate a.out, optionally also with a baseline a.out, writing snapshots at a
+series of spp in one run, and reports RMSE, relMSE and PSNR against the reference with the
+wall time of each snapshot.
+
+A candidate is rejected when it is biased, however fast it is: the MSE of an unbiased
+renderer falls like variance / spp down to the noise of the reference, so the floor of a fit
+MSE = a / spp + b above the reference noise estimates the squared bias. A shift of the image
+mean is rejected too. The efficiency (1 / (MSE * seconds) at the largest spp) is compared
+with the baseline.
+
+usage: python3 quality.py reference [--spp 4096] [--runs 4] [--dir references]
+       python3 quality.py compare [--binary ./a.out] [--baseline old/a.out] [--spp 1,4,16,64]
+                                  [--plot DIR] [--diff DIR] [--csv file]
+"""
+import argparse
+import json
+import math
+import os
+import sys
+import tempfile
+
+from convergence import render
+from pfm import read_pfm, write_pfm
+
+# Teapot instances (scale, offset, material) of the reference scenes; a negative scale also
+# turns the teapot around, as in the UI. Materials: 0 metal, 1 glass, 2 diffuse.
+SCENES = {
+    'diffuse': [(-3.45, (-40, 0, -160), 2)],
+    'metal': [(-3.45, (-40, 0, -160), 0)],
+    'glass': [(3.45, (40, 0, -160), 1)],
+    'all': [(-3.45, (-40, 0, -160), 0), (3.45, (40, 0, -160), 1), (2.3, (0, -40, -230), 2)],
+}
+
+
+def scene_args(name, directory):
+    """The a.out arguments after samples_per_pixel, with the matrix files written to directory."""
+    args = [str(len(SCENES[name]))]
+    for k, (scale, (x, y, z), material) in enumerate(SCENES[name]):
+        pos = os.path.join(directory, f"{name}_pos_{k}.txt")
+        norm = os.path.join(directory, f"{name}_norm_{k}.txt")
+        with open(pos, 'w') as f:
+            f.write(f"{scale} 0 0 {x}\n0 {abs(scale)} 0 {y}\n0 0 {scale} {z}\n0 0 0 1\n")
+        with open(norm, 'w') as f:
+            f.write(f"{1 / scale} 0 0\n0 {1 / abs(scale)} 0\n0 0 {1 / scale}\n")
+        args += [pos, norm, str(material)]
+    return args
+
+
+def metrics(image, reference):
+    squared = relative = clamped = 0.0
+    for a, b in zip(image, reference):
+        squared += (a - b) * (a - b)
+        relative += (a - b) * (a - b) / (b * b + 0.01)
+        d = min(max(a, 0.0), 1.0) - min(max(b, 0.0), 1.0)
+        clamped += d * d
+    n = len(reference)
+    return {
+        'mse': squared / n,
+        'rmse': math.sqrt(squared / n),
+        'relmse': relative / n,
+        'psnr': 10 * math.log10(n / clamped) if clamped > 0 else math.inf,
+        'mean_shift': (sum(image) - sum(reference)) / sum(reference),
+    }
+
+
+def bias_floor(series):
+    """Least-squares fit of mse = a / spp + b over [(spp, mse)]; returns b."""
+    xs = [1 / spp for spp, _ in series]
+    ys = [mse for _, mse in series]
+    n = len(series)
+    mean_x, mean_y = sum(xs) / n, sum(ys) / n
+    var_x = sum((x - mean_x) ** 2 for x in xs)
+    if var_x == 0:
+        return ys[-1]
+    slope = sum((x - mean_x) * (y - mean_y) for x, y in zip(xs, ys)) / var_x
+    return mean_y - slope * mean_x
+
+
+def make_reference(args):
+    os.makedirs(args.dir, exist_ok=True)
+    manifest = {'spp': args.spp, 'runs': args.runs, 'binary': args.binary, 'scenes': {}}
+    spp_per_run = max(1, args.spp // args.runs)
+    with tempfile.TemporaryDirectory() as tmp:
+        for name in args.scenes.split(','):
+            scene = scene_args(name, tmp)
+            runs, seconds = [], 0.0
+            for run in range(args.runs):
+                print(f"{name}: run {run + 1}/{args.runs} at {spp_per_run} spp", file=sys.stderr)
+                prefix = os.path.join(tmp, f"{name}_{run}_")
+                # Seeds from 1 on keep the reference independent of the candidates (seed 0).
+                times = render(args.binary, 'independent', [spp_per_run], prefix, scene, seed=run + 1)
+                seconds += times[spp_per_run]
+                width, height, image = read_pfm(f"{prefix}{spp_per_run}.pfm")
+                runs.append(image)
+            mean = [sum(values) / len(runs) for values in zip(*runs)]
+            # Variance of the mean from the spread of the runs; unknown with a single run.
+            noise = 0.0
+            if len(runs) > 1:
+                noise = sum(sum((v - m) ** 2 for v in values) / (len(runs) - 1) / len(runs)
+                            for values, m in zip(zip(*runs), mean)) / len(mean)
+            write_pfm(os.path.join(args.dir, f"{name}.pfm"), width, height, mean)
+            manifest['scenes'][name] = {'image': f"{name}.pfm", 'noise_mse': noise,
+                                        'seconds': seconds}
+    with open(os.path.join(args.dir, 'manifest.json'), 'w') as f:
+        json.dump(manifest, f, indent=2)
+
+
+def write_plot(path, title, curves):
+    """Log-log SVG plot of RMSE against seconds; curves is [(label, [(seconds, rmse)])]."""
+    points = [p for _, curve in curves for p in curve if p[0] > 0 and p[1] > 0]
+    if not points:
+        return
+    x0, x1 = math.log10(min(p[0] for p in points)), math.log10(max(p[0] for p in points))
+    y0, y1 = math.log10(min(p[1] for p in points)), math.log10(max(p[1] for p in points))
+    x1, y1 = max(x1, x0 + 1e-6), max(y1, y0 + 1e-6)
+    width, height, margin = 640, 400, 60
+    px = lambda x: margin + (math.log10(x) - x0) / (x1 - x0) * (width - 2 * margin)
+    py = lambda y: height - margin - (math.log10(y) - y0) / (y1 - y0) * (height - 2 * margin)
+    colors = ['#d62728', '#1f77b4', '#2ca02c', '#9467bd']
+    svg = [f'<svg xmlns="http://www.w3.org/2000/svg" width="{width}" height="{height}" '
+           f'font-family="sans-serif" font-size="12">',
+           f'<rect width="{width}" height="{height}" fill="white"/>',
+           f'<text x="{width / 2}" y="20" text-anchor="middle">{title}</text>',
+           f'<line x1="{margin}" y1="{height - margin}" x2="{width - margin}" y2="{height - margin}" stroke="black"/>',
+           f'<line x1="{margin}" y1="{margin}" x2="{margin}" y2="{height - margin}" stroke="black"/>',
+           f'<text x="{width / 2}" y="{height - 20}" text-anchor="middle">seconds (log)</text>',
+           f'<text x="15" y="{height / 2}" transform="rotate(-90 15 {height / 2})" '
+           f'text-anchor="middle">RMSE (log)</text>']
+    for k, (label, curve) in enumerate(curves):
+        color = colors[k % len(colors)]
+        line = ' '.join(f"{px(s):.1f},{py(e):.1f}" for s, e in curve if s > 0 and e > 0)
+        svg.append(f'<polyline points="{line}" fill="none" stroke="{color}" stroke-width="2"/>')
+        for s, e in curve:
+            if s > 0 and e > 0:
+                svg.append(f'<circle cx="{px(s):.1f}" cy="{py(e):.1f}" r="3" fill="{color}"/>')
+        svg.append(f'<text x="{width - margin - 150}" y="{margin + 16 * k}" fill="{color}">{label}</text>')
+    svg.append('</svg>')
+    with open(path, 'w') as f:
+        f.write('\n'.join(svg) + '\n')
+
+
+def compare(args):
+    with open(os.path.join(args.dir, 'manifest.json')) as f:
+        manifest = json.load(f)
+    checkpoints = sorted(int(s) for s in args.spp.split(','))
+    binaries = [('candidate', args.binary)]
+    if args.baseline:
+        binaries.insert(0, ('baseline', args.baseline))
+    for directory in (args.plot, args.diff):
+        if directory:
+            os.makedirs(directory, exist_ok=True)
+
+    rows, rejected = [], []
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, entry in manifest['scenes'].items():
+            width, height, reference = read_pfm(os.path.join(args.dir, entry['image']))
+            reference_rms = math.sqrt(sum(v * v for v in reference) / len(reference))
+            scene = scene_args(name, tmp)
+            curves, efficiency = [], {}
+            for label, binary in binaries:
+                prefix = os.path.join(tmp, f"{name}_{label}_")
+                times = render(binary, args.sampler, checkpoints, prefix, scene)
+                series = []
+                for spp in checkpoints:
+                    _, _, image = read_pfm(f"{prefix}{spp}.pfm")
+                    m = metrics(image, reference)
+                    series.append((spp, m['mse']))
+                    rows.append((name, label, spp, times[spp], m))
+                curves.append((label, [(times[spp], math.sqrt(mse)) for spp, mse in series]))
+                if args.diff:
+                    write_pfm(os.path.join(args.diff, f"{name}_{label}.pfm"), width, height,
+                              [abs(a - b) for a, b in zip(image, reference)])
+
+                bias = math.sqrt(max(0.0, bias_floor(series) - entry['noise_mse'])) / reference_rms
+                shift = m['mean_shift']
+                efficiency[label] = 1 / (m['mse'] * times[checkpoints[-1]])
+                verdict = 'ok'
+                if bias > args.bias_tolerance or abs(shift) > args.shift_tolerance:
+                    verdict = 'BIASED'
+                    if label == 'candidate':
+                        rejected.append(name)
+                print(f"{name} {label}: relative bias {bias:.4f}, mean shift {100 * shift:+.2f}%,"
+                      f" {verdict}", file=sys.stderr)
+            if 'baseline' in efficiency:
+                ratio = efficiency['candidate'] / efficiency['baseline']
+                print(f"{name}: candidate efficiency x{ratio:.2f} of the baseline", file=sys.stderr)
+            if args.plot:
+                write_plot(os.path.join(args.plot, f"{name}.svg"), f"{name}, {args.sampler}", curves)
+
+    print(f"{'scene':<8} {'binary':<10} {'spp':>6} {'seconds':>9} {'rmse':>10} {'relmse':>10} {'psnr':>7}")
+    for name, label, spp, seconds, m in rows:
+        print(f"{name:<8} {label:<10} {spp:>6} {seconds:>9.3f} {m['rmse']:>10.5f} "
+              f"{m['relmse']:>10.5f} {m['psnr']:>7.2f}")
+    if args.csv:
+        with open(args.csv, 'w') as f:
+            f.write("scene,binary,spp,seconds,rmse,relmse,psnr\n")
+            for name, label, spp, seconds, m in rows:
+                f.write(f"{name},{label},{spp},{seconds},{m['rmse']},{m['relmse']},{m['psnr']}\n")
+
+    if rejected:
+        sys.exit(f"rejected: the candidate is biased on {', '.join(rejected)}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    reference = commands.add_parser('reference', help="render the reference images")
+    reference.add_argument('--binary', default='./a.out')
+    reference.add_argument('--spp', type=int, default=4096, help="total over all runs")
+    reference.add_argument('--runs', type=int, default=4,
+                           help="independent runs, their spread estimates the reference noise")
+    reference.add_argument('--scenes', default=','.join(SCENES))
+    reference.add_argument('--dir', default='references')
+
+    candidate = commands.add_parser('compare', help="compare renders against the references")
+    candidate.add_argument('--binary', default='./a.out')
+    candidate.add_argument('--baseline', help="a.out to compare the candidate's efficiency with")
+    candidate.add_argument('--sampler', default='sobol')
+    candidate.add_argument('--spp', default='1,2,4,8,16,32,64')
+    candidate.add_argument('--dir', default='references')
+    candidate.add_argument('--bias-tolerance', type=float, default=0.02,
+                           help="largest bias allowed, relative to the reference's RMS")
+    candidate.add_argument('--shift-tolerance', type=float, default=0.01,
+                           help="largest relative change of the image mean allowed")
+    candidate.add_argument('--plot', help="directory for SVG plots of RMSE against seconds")
+    candidate.add_argument('--diff', help="directory for absolute error images (PFM)")
+    candidate.add_argument('--csv', help="also write the results to this CSV file")
+
+    args = parser.parse_args()
+    if args.command == 'reference':
+        make_reference(args)
+    else:
+        compare(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -33,10 +33,17 @@ class ray {
             return orig + t*dir;
         }
 
+        // Width of the ray's cone at t, for filtering textures (see camera::set_resolution).
+        double width_at(double t) const {
+            return cone_spread == 0 ? cone_width : cone_width + cone_spread * t * dir.length();
+        }
+
     public:
         point3 orig;
         vec3 dir;
         double tm;
+        double cone_width = 0;      // at the origin
+        double cone_spread = 0;     // widening per unit of distance; 0 for a ray of no width
 };
 
 #endif
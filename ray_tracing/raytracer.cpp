@@ -0,0 +1,214 @@
+// The renderer as a shared library, see raytracer.h for the API and how to build it.
+
+#include "raytracer.h"
+
+#include "renderer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+struct rt_scene {
+    rt_scene(int width, int height) : rt(width, height), pixels(3 * size_t(width) * height) {
+        rt.set_camera(point3(0, 0, 200), point3(0, 0, -400), vec3(0, 1, 0), 40, 0, 10);
+    }
+
+    renderer rt;
+    std::vector<mesh> meshes;
+    std::vector<shared_ptr<material>> materials;
+    int instances = 0;
+    int triangles = 0;
+    std::vector<float> pixels;
+    std::string encoded;
+    std::string error;
+};
+
+
+namespace {
+
+int fail(rt_scene* scene, const std::string& error) {
+    scene->error = error;
+    return -1;
+}
+
+// Averages of the accumulated samples, top row first.
+void resolve(const framebuffer& image, float* rgb) {
+    for (int j = 0; j < image.height; j++) {
+        float* row = rgb + 3 * size_t(image.height - 1 - j) * image.width;
+        for (int i = 0; i < image.width; i++) {
+            color c = image.average(i, j);
+            for (int k = 0; k < 3; k++)
+                row[3 * i + k] = static_cast<float>(c[k]);
+        }
+    }
+}
+
+}
+
+
+extern "C" {
+
+rt_scene* rt_create(int width, int height) {
+    if (width <= 1 || height <= 1)
+        return nullptr;
+    try {
+        return new rt_scene(width, height);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void rt_destroy(rt_scene* scene) {
+    delete scene;
+}
+
+const char* rt_error(const rt_scene* scene) {
+    return scene->error.c_str();
+}
+
+int rt_add_mesh(rt_scene* scene, const double* positions, const double* normals, int vertices) {
+    if (vertices <= 0 || vertices % 3 != 0)
+        return fail(scene, "a mesh needs a positive multiple of 3 vertices");
+    mesh m;
+    for (int k = 0; k < vertices; k++) {
+        m.pos.push_back({positions[3*k], positions[3*k + 1], positions[3*k + 2], 1.0});
+        m.norm.push_back({normals[3*k], normals[3*k + 1], normals[3*k + 2]});
+    }
+    scene->meshes.push_back(std::move(m));
+    return static_cast<int>(scene->meshes.size()) - 1;
+}
+
+int rt_load_mesh(rt_scene* scene, const char* file) {
+    mesh m;
+    if (!load_mesh(file, m) || m.pos.empty())
+        return fail(scene, std::string("cannot read a mesh from ") + file);
+    scene->meshes.push_back(std::move(m));
+    return static_cast<int>(scene->meshes.size()) - 1;
+}
+
+int rt_add_material(rt_scene* scene, int kind, double r, double g, double b, double parameter) {
+    arena& pool = scene->rt.pool;
+    color c(r, g, b);
+    shared_ptr<material> m;
+    switch (kind) {
+        case RT_DIFFUSE:
+            m = pool.make<lambertian>(arena::materials, pool.make<solid_color>(arena::materials, c));
+            break;
+        case RT_METAL: m = pool.make<metal>(arena::materials, c, parameter); break;
+        case RT_GLASS: m = pool.make<dielectric>(arena::materials, parameter); break;
+        case RT_THIN_GLASS: m = pool.make<dielectric>(arena::materials, 1.5, parameter); break;
+        case RT_LIGHT:
+            m = pool.make<diffuse_light>(arena::materials, pool.make<solid_color>(arena::materials, c));
+            break;
+        default: return fail(scene, "unknown material kind " + std::to_string(kind));
+    }
+    scene->materials.push_back(m);
+    return static_cast<int>(scene->materials.size()) - 1;
+}
+
+int rt_add_instance(rt_scene* scene, int mesh_number, const double position_matrix[16],
+                    const double normal_matrix[9], int material_number) {
+    if (mesh_number < 0 || mesh_number >= static_cast<int>(scene->meshes.size()))
+        return fail(scene, "no mesh " + std::to_string(mesh_number));
+    if (material_number < 0 || material_number >= static_cast<int>(scene->materials.size()))
+        return fail(scene, "no material " + std::to_string(material_number));
+    mat4 pos;
+    mat3 norm;
+    for (int i = 0; i < 16; i++)
+        pos[i / 4][i % 4] = position_matrix[i];
+    for (int i = 0; i < 9; i++)
+        norm[i / 3][i % 3] = normal_matrix[i];
+    const mesh& shape = scene->meshes[mesh_number];
+    add_mesh(scene->rt.world, shape, pos, norm, scene->materials[material_number],
+             scene->instances, scene->rt.pool);
+    scene->triangles += shape.triangles();
+    return scene->instances++;
+}
+
+int rt_add_cornell_box(rt_scene* scene) {
+    add_cornell_box(scene->rt.world, scene->rt.pool);
+    return 0;
+}
+
+void rt_set_camera(rt_scene* scene, const double lookfrom[3], const double lookat[3],
+                   const double vup[3], double vfov, double aperture, double focus_distance) {
+    scene->rt.set_camera(point3(lookfrom[0], lookfrom[1], lookfrom[2]),
+                         point3(lookat[0], lookat[1], lookat[2]), vec3(vup[0], vup[1], vup[2]),
+                         vfov, aperture, focus_distance);
+}
+
+void rt_set_background(rt_scene* scene, double r, double g, double b) {
+    scene->rt.background = color(r, g, b);
+}
+
+int rt_set_sampler(rt_scene* scene, const char* name, uint64_t seed) {
+    if (!std::unique_ptr<sampler>(make_sampler(name)))
+        return fail(scene, std::string("unknown sampler ") + name);
+    scene->rt.sampler_name = name;
+    scene->rt.sampler_seed = seed;
+    return 0;
+}
+
+int rt_render(rt_scene* scene, int samples_per_pixel, double seconds, float* rgb) {
+    renderer& rt = scene->rt;
+    auto start = std::chrono::steady_clock::now();
+    rt.end_pass = [&](int passes) {
+        if (seconds <= 0)
+            return true;
+        // Stop unless another pass as long as the average one still fits.
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return elapsed + elapsed / passes <= seconds;
+    };
+    int passes = rt.render(std::max(0, samples_per_pixel));
+    rt.end_pass = nullptr;
+    resolve(rt.image, rgb ? rgb : scene->pixels.data());
+    return passes;
+}
+
+void rt_cancel(rt_scene* scene) {
+    scene->rt.stop();
+}
+
+void rt_clear(rt_scene* scene) {
+    renderer& rt = scene->rt;
+    rt.image = framebuffer(rt.width, rt.height);
+    rt.next_sample = 0;
+    rt.passes_rendered = 0;
+    rt.render_seconds = 0;
+}
+
+const float* rt_pixels(const rt_scene* scene) {
+    return scene->pixels.data();
+}
+
+const char* rt_encode(rt_scene* scene, const char* format, size_t* size) {
+    image_format f;
+    if (!parse_image_format(format, f)) {
+        fail(scene, std::string("unknown image format ") + format);
+        return nullptr;
+    }
+    std::ostringstream out;
+    scene->rt.image.write(out, f);
+    scene->encoded = out.str();
+    *size = scene->encoded.size();
+    return scene->encoded.data();
+}
+
+void rt_get_stats(const rt_scene* scene, rt_stats* stats) {
+    const renderer& rt = scene->rt;
+    stats->width = rt.width;
+    stats->height = rt.height;
+    stats->samples_per_pixel = rt.passes_rendered;
+    stats->triangles = scene->triangles;
+    stats->render_seconds = rt.render_seconds;
+    stats->samples_per_second = rt.render_seconds > 0
+        ? double(rt.width) * rt.height * rt.passes_rendered / rt.render_seconds : 0;
+    stats->scene_bytes = rt.pool.reserved();
+}
+
+}
@@ -0,0 +1,106 @@
+#ifndef RAYTRACER_H
+#define RAYTRACER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// C API of the renderer (renderer.h), for programs that link it instead of running a.out,
+// and for Python through ctypes (raytracer.py). Build the library with
+//
+//     g++ -O2 -shared -fPIC -fvisibility=hidden -o libraytracer.so raytracer.cpp -lpthread -lz
+//
+// A scene holds meshes, materials and the instances of the meshes, a camera and the image it
+// is rendered into. Every rt_render() adds samples to that image, so a render can be continued
+// or stopped at any time; rt_clear() starts over, e.g. after moving the camera. Pixels are
+// linear RGB floats, three per pixel, top row first.
+//
+// Calls on one scene must not overlap, except rt_cancel(). Functions that can fail return -1
+// (or NULL) and leave a message for rt_error().
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define RT_API __attribute__((visibility("default")))
+#else
+#define RT_API
+#endif
+
+typedef struct rt_scene rt_scene;
+
+enum rt_material_kind {
+    RT_DIFFUSE = 0,     // Lambertian, of color (r, g, b)
+    RT_METAL = 1,       // parameter: fuzz, 0 for a mirror
+    RT_GLASS = 2,       // parameter: index of refraction; the color is ignored
+    RT_LIGHT = 3,       // emits (r, g, b)
+    RT_THIN_GLASS = 4   // a hollow shell of glass of index 1.5, parameter: its thickness
+};
+
+typedef struct rt_stats {
+    int width, height;
+    int samples_per_pixel;      // in the image
+    int triangles;
+    double render_seconds;      // of every rt_render() since the last rt_clear()
+    double samples_per_second;
+    size_t scene_bytes;         // reserved for the objects of the scene
+} rt_stats;
+
+// An empty scene with a width x height image, black background and the camera of a.out.
+RT_API rt_scene* rt_create(int width, int height);
+RT_API void rt_destroy(rt_scene* scene);
+// The reason the last call on scene failed.
+RT_API const char* rt_error(const rt_scene* scene);
+
+// Meshes are triangle soups, every three vertices a triangle, each vertex a position (x, y,
+// z) and a normal. rt_load_mesh() reads the format of modify_teapot.txt. Both return the
+// number of the mesh.
+RT_API int rt_add_mesh(rt_scene* scene, const double* positions, const double* normals,
+                       int vertices);
+RT_API int rt_load_mesh(rt_scene* scene, const char* file);
+
+// Returns the number of the material.
+RT_API int rt_add_material(rt_scene* scene, int kind, double r, double g, double b,
+                           double parameter);
+
+// Adds mesh, its positions transformed by the 4x4 and its normals by the 3x3 matrix (row
+// major, p' = M p, as in a.out's matrix files). Returns the number of the instance.
+RT_API int rt_add_instance(rt_scene* scene, int mesh, const double position_matrix[16],
+                           const double normal_matrix[9], int material);
+
+// The Cornell box of a.out's scene, with its light.
+RT_API int rt_add_cornell_box(rt_scene* scene);
+
+RT_API void rt_set_camera(rt_scene* scene, const double lookfrom[3], const double lookat[3],
+                          const double vup[3], double vfov, double aperture, double focus_distance);
+RT_API void rt_set_background(rt_scene* scene, double r, double g, double b);
+// Sampler "independent", "sobol" (the default) or "bluenoise", and the seed of its sequences.
+RT_API int rt_set_sampler(rt_scene* scene, const char* name, uint64_t seed);
+
+// Adds up to samples_per_pixel samples to every pixel, fewer if the next pass would end more
+// than seconds (unless 0) after the call or rt_cancel() is called, and returns how many it
+// added. Then writes the image to rgb (width * height * 3 floats), or if rgb is NULL to the
+// scene's buffer, which rt_pixels() returns.
+RT_API int rt_render(rt_scene* scene, int samples_per_pixel, double seconds, float* rgb);
+// Makes the rt_render() in flight, or else the next one, return after its current pass.
+RT_API void rt_cancel(rt_scene* scene);
+// Drops the samples of the image.
+RT_API void rt_clear(rt_scene* scene);
+
+// The scene's buffer, width * height * 3 floats, as the last rt_render() without a buffer
+// of its own left it.
+RT_API const float* rt_pixels(const rt_scene* scene);
+
+// The image encoded as "png", "qoi", "ppm" or "pfm"; size is set to its length. The bytes are
+// the scene's, valid until the next rt_encode() or rt_destroy().
+RT_API const char* rt_encode(rt_scene* scene, const char* format, size_t* size);
+
+RT_API void rt_get_stats(const rt_scene* scene, rt_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,185 @@
+"""ctypes binding of libraytracer.so (raytracer.h): the renderer in this process.
+
+Renders into the library's float buffer, which pixels() shows without copying, or into a
+writable buffer of the caller's (an array('f'), a numpy array...). As a script it renders
+a.out's scene, the Cornell box with teapots given by matrix files, and writes an image.
+
+usage: python3 raytracer.py [--library ./libraytracer.so] [-e png] [-t seconds]
+                            samples_per_pixel output [pos_mat norm_mat material]...
+"""
+import argparse
+import ctypes
+import os
+import sys
+
+RT_DIFFUSE, RT_METAL, RT_GLASS, RT_LIGHT, RT_THIN_GLASS = range(5)
+
+
+class Stats(ctypes.Structure):
+    _fields_ = [('width', ctypes.c_int), ('height', ctypes.c_int),
+                ('samples_per_pixel', ctypes.c_int), ('triangles', ctypes.c_int),
+                ('render_seconds', ctypes.c_double), ('samples_per_second', ctypes.c_double),
+                ('scene_bytes', ctypes.c_size_t)]
+
+
+def load_library(path=None):
+    path = path or os.path.join(os.path.dirname(os.path.abspath(__file__)), 'libraytracer.so')
+    lib = ctypes.CDLL(path)
+    scene, double, doubles = ctypes.c_void_p, ctypes.c_double, ctypes.POINTER(ctypes.c_double)
+    signatures = {
+        'rt_create': (scene, [ctypes.c_int, ctypes.c_int]),
+        'rt_destroy': (None, [scene]),
+        'rt_error': (ctypes.c_char_p, [scene]),
+        'rt_add_mesh': (ctypes.c_int, [scene, doubles, doubles, ctypes.c_int]),
+        'rt_load_mesh': (ctypes.c_int, [scene, ctypes.c_char_p]),
+        'rt_add_material': (ctypes.c_int, [scene, ctypes.c_int, double, double, double, double]),
+        'rt_add_instance': (ctypes.c_int, [scene, ctypes.c_int, doubles, doubles, ctypes.c_int]),
+        'rt_add_cornell_box': (ctypes.c_int, [scene]),
+        'rt_set_camera': (None, [scene, doubles, doubles, doubles, double, double, double]),
+        'rt_set_background': (None, [scene, double, double, double]),
+        'rt_set_sampler': (ctypes.c_int, [scene, ctypes.c_char_p, ctypes.c_uint64]),
+        'rt_render': (ctypes.c_int, [scene, ctypes.c_int, double, ctypes.c_void_p]),
+        'rt_cancel': (None, [scene]),
+        'rt_clear': (None, [scene]),
+        'rt_pixels': (ctypes.c_void_p, [scene]),
+        'rt_encode': (ctypes.c_void_p, [scene, ctypes.c_char_p, ctypes.POINTER(ctypes.c_size_t)]),
+        'rt_get_stats': (None, [scene, ctypes.POINTER(Stats)]),
+    }
+    for name, (restype, argtypes) in signatures.items():
+        function = getattr(lib, name)
+        function.restype, function.argtypes = restype, argtypes
+    return lib
+
+
+def doubles(values):
+    return (ctypes.c_double * len(values))(*values)
+
+
+class Scene:
+    def __init__(self, width=400, height=400, library=None):
+        self.lib = library or load_library()
+        self.width, self.height = width, height
+        self.handle = self.lib.rt_create(width, height)
+        if not self.handle:
+            raise ValueError(f"cannot create a {width}x{height} scene")
+
+    def close(self):
+        if self.handle:
+            self.lib.rt_destroy(self.handle)
+            self.handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def check(self, result):
+        if result < 0:
+            raise RuntimeError(self.lib.rt_error(self.handle).decode())
+        return result
+
+    def add_mesh(self, positions, normals):
+        return self.check(self.lib.rt_add_mesh(self.handle, doubles(positions), doubles(normals),
+                                               len(positions) // 3))
+
+    def load_mesh(self, file):
+        return self.check(self.lib.rt_load_mesh(self.handle, os.fsencode(file)))
+
+    def add_material(self, kind, color=(0, 0, 0), parameter=0.0):
+        return self.check(self.lib.rt_add_material(self.handle, kind, *color, parameter))
+
+    def add_instance(self, mesh, position_matrix, normal_matrix, material):
+        """Matrices row major, 16 and 9 numbers."""
+        return self.check(self.lib.rt_add_instance(self.handle, mesh, doubles(position_matrix),
+                                                   doubles(normal_matrix), material))
+
+    def add_cornell_box(self):
+        return self.check(self.lib.rt_add_cornell_box(self.handle))
+
+    def set_camera(self, lookfrom, lookat, vup=(0, 1, 0), vfov=40, aperture=0, focus_distance=10):
+        self.lib.rt_set_camera(self.handle, doubles(lookfrom), doubles(lookat), doubles(vup),
+                               vfov, aperture, focus_distance)
+
+    def set_background(self, color):
+        self.lib.rt_set_background(self.handle, *color)
+
+    def set_sampler(self, name, seed=0):
+        self.check(self.lib.rt_set_sampler(self.handle, name.encode(), seed))
+
+    def render(self, samples_per_pixel, seconds=0, out=None):
+        """Adds up to samples_per_pixel samples and returns how many it added. The image goes
+        to out, a writable buffer of width * height * 3 floats, or to pixels()."""
+        target = None
+        if out is not None:
+            count = self.width * self.height * 3
+            target = ctypes.addressof((ctypes.c_float * count).from_buffer(out))
+        return self.lib.rt_render(self.handle, samples_per_pixel, seconds, target)
+
+    def cancel(self):
+        """From another thread: ends the render in flight after its current pass."""
+        self.lib.rt_cancel(self.handle)
+
+    def clear(self):
+        self.lib.rt_clear(self.handle)
+
+    def pixels(self):
+        """The library's buffer as floats, RGB top row first; it changes with every render()."""
+        count = self.width * self.height * 3
+        buffer = (ctypes.c_float * count).from_address(self.lib.rt_pixels(self.handle))
+        # ctypes gives the view the format '<f', which memoryview can't index.
+        return memoryview(buffer).cast('B').cast('f')
+
+    def encode(self, image_format='png'):
+        size = ctypes.c_size_t()
+        data = self.lib.rt_encode(self.handle, image_format.encode(), ctypes.byref(size))
+        if not data:
+            raise ValueError(self.lib.rt_error(self.handle).decode())
+        return ctypes.string_at(data, size.value)
+
+    def stats(self):
+        stats = Stats()
+        self.lib.rt_get_stats(self.handle, ctypes.byref(stats))
+        return {name: getattr(stats, name) for name, _ in Stats._fields_}
+
+
+def read_matrix(file, rows):
+    with open(file) as f:
+        return [float(v) for line in f.readlines()[:rows] for v in line.split()]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--library')
+    parser.add_argument('-e', '--format', default='png')
+    parser.add_argument('-t', '--seconds', type=float, default=0)
+    parser.add_argument('samples_per_pixel', type=int)
+    parser.add_argument('output')
+    parser.add_argument('teapots', nargs='*')
+    args = parser.parse_args()
+    if len(args.teapots) % 3:
+        parser.error("number of file and material does not match")
+
+    with Scene(library=load_library(args.library)) as scene:
+        teapot = scene.load_mesh('modify_teapot.txt')
+        # a.out's materials: (0) metal; (1) glass, a thin wall; (2) diffuse
+        materials = [scene.add_material(RT_METAL, (0.8, 0.8, 0.8), 0.3),
+                     scene.add_material(RT_THIN_GLASS, parameter=1.5),
+                     scene.add_material(RT_DIFFUSE, (0.7, 0.3, 0.3))]
+        scene.add_cornell_box()
+        for k in range(0, len(args.teapots), 3):
+            pos, norm, material = args.teapots[k:k + 3]
+            scene.add_instance(teapot, read_matrix(pos, 4), read_matrix(norm, 3),
+                               materials[int(material)])
+        passes = scene.render(args.samples_per_pixel, args.seconds)
+        with open(args.output, 'wb') as f:
+            f.write(scene.encode(args.format))
+        stats = scene.stats()
+        print(f"Rendered {passes} samples per pixel of {stats['triangles']} triangles in "
+              f"{stats['render_seconds']:.3f}s, {stats['samples_per_second'] / 1e6:.3f} M samples/s.",
+              file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,101 @@
+"""LRU cache of render results for the /render endpoint.
+
+Entries are keyed by a hash of the canonical scene and hold the renderer's checkpoint (the
+accumulation buffer, see checkpoint.h) together with the images encoded from it, one per
+format and denoising. A request for at most the cached samples per pixel in an image it has
+is answered from the cache; any other resumes the cached checkpoint, so only the missing
+samples are traced, whatever format or denoising the earlier renders used. Entries also keep the
+render's G-buffer (gbuffer.h), so the render of an edited scene can start from the pixels of
+the scene its session (page) asked for before that the edit didn't change.
+"""
+import hashlib
+import json
+import threading
+from collections import OrderedDict
+
+# Fixed by the renderer for now, but part of the key so a change can't serve stale images.
+MESH_ID = 'teapot'
+CAMERA = {'lookfrom': [0, 0, 200], 'lookat': [0, 0, -400], 'vup': [0, 1, 0], 'vfov': 40.0,
+          'aperture': 0.0, 'focus_dist': 10.0}
+RESOLUTION = [400, 400]
+
+# Sessions whose latest scene is remembered for history(), the least recent dropped first.
+MAX_SESSIONS = 4096
+
+
+def scene_key(render_data, sampler='sobol'):
+    scene = {
+        'mesh': MESH_ID,
+        'camera': CAMERA,
+        'resolution': RESOLUTION,
+        'sampler': sampler,
+        'instances': [{'mvMatrix': [float(x) for x in item['mvMatrix']],
+                       'mvNormalMatrix': [float(x) for x in item['mvNormalMatrix']],
+                       'material': int(item['meterial'])} for item in render_data],
+    }
+    canonical = json.dumps(scene, sort_keys=True, separators=(',', ':'))
+    return hashlib.sha256(canonical.encode()).hexdigest()
+
+
+class CacheEntry:
+    def __init__(self, samples_per_pixel, checkpoint, images, gbuffer=b''):
+        self.samples_per_pixel = samples_per_pixel
+        self.checkpoint = checkpoint
+        self.images = images            # (format, denoise) -> image of the checkpoint
+        self.gbuffer = gbuffer
+
+    def image(self, image_format, denoise):
+        return self.images.get((image_format, denoise), b'')
+
+    def size(self):
+        return len(self.checkpoint) + sum(map(len, self.images.values())) + len(self.gbuffer)
+
+
+class RenderCache:
+    def __init__(self, budget_bytes):
+        self.budget_bytes = budget_bytes
+        self.used_bytes = 0
+        self.entries = OrderedDict()
+        self.sessions = OrderedDict()   # session -> key of the scene it asked for last
+        self.lock = threading.Lock()
+
+    def get(self, key):
+        with self.lock:
+            entry = self.entries.get(key)
+            if entry is not None:
+                self.entries.move_to_end(key)
+            return entry
+
+    def history(self, session, key):
+        """The entry of the scene session asked for before key, e.g. the scene before an edit;
+        None if there is none or it isn't cached. key becomes the session's latest scene."""
+        if session is None:
+            return None
+        with self.lock:
+            previous = self.sessions.pop(session, None)
+            self.sessions[session] = key
+            if len(self.sessions) > MAX_SESSIONS:
+                self.sessions.popitem(last=False)
+            return self.entries.get(previous) if previous is not None else None
+
+    def put(self, key, entry):
+        with self.lock:
+            old = self.entries.get(key)
+            # Keep the entry with more samples if two requests raced on the same scene, and the
+            # old one if the new one can't be stored.
+            if old is not None and old.samples_per_pixel > entry.samples_per_pixel:
+                return
+            if old is not None and old.samples_per_pixel == entry.samples_per_pixel:
+                # The same samples in another format: keep the images of both.
+                entry = CacheEntry(entry.samples_per_pixel, entry.checkpoint,
+                                   {**old.images, **entry.images}, entry.gbuffer)
+            if entry.size() > self.budget_bytes:
+                return
+            if old is not None:
+                del self.entries[key]
+                self.used_bytes -= old.size()
+            self.entries[key] = entry
+            self.used_bytes += entry.size()
+            while self.used_bytes > self.budget_bytes:
+                _, evicted = self.entries.popitem(last=False)
+                self.used_bytes -= evicted.size()
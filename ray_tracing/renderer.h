@@ -0,0 +1,260 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "rtweekend.h"
+
+#include "arena.h"
+#include "camera.h"
+#include "denoise.h"
+#include "environment.h"
+#include "framebuffer.h"
+#include "gbuffer.h"
+#include "hittable_list.h"
+#include "lights.h"
+#include "sampler.h"
+#include "scene.h"
+#include "stats.h"
+#include "trace.h"
+#include "visibility.h"
+
+#include <pthread.h>
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <functional>
+#include <string>
+#include <vector>
+
+
+// A scene, its camera and the accumulation buffer it is rendered into: the renderer without
+// the command line, so main.cpp and the C API of the library (raytracer.h) share it.
+//
+// render() adds passes, one sample per pixel each, on a 4 x 4 grid of tiles with a thread
+// per tile; the threads meet at a barrier between passes so the whole image always holds the
+// same number of samples. The objects of the scene live in pool.
+class renderer {
+    public:
+        renderer(int width = 400, int height = 400)
+            : width(width), height(height), image(width, height) {
+            window[2] = width;
+            window[3] = height;
+        }
+
+        renderer(const renderer&) = delete;
+        renderer& operator=(const renderer&) = delete;
+
+        void set_camera(const point3& lookfrom, const point3& lookat, const vec3& vup,
+                        double vfov, double aperture, double focus_dist) {
+            cam = camera(lookfrom, lookat, vup, vfov, double(width) / height, aperture,
+                         focus_dist, 0.0, 1.0);
+            cam.set_resolution(height);
+        }
+
+        // Adds up to passes samples per pixel and returns how many it added: fewer if
+        // end_pass says to stop or stop() is called.
+        int render(int passes);
+
+        // Makes the render() in flight, or else the next one, return once its pass is done;
+        // safe from any thread or a signal handler.
+        void stop() { stop_requested = 1; }
+
+    public:
+        arena pool;
+        hittable_list world;
+        camera cam;
+        environment background;     // a constant color (black) or an HDR map
+        int width, height;
+        int max_depth = 50;
+        // Lights sampled at the vertices of the paths when set, built from world by
+        // lights.build() once it is complete (and again after it changes).
+        light_set lights;
+        bool sample_lights = false;
+
+        framebuffer image;
+        std::string sampler_name = "sobol";
+        uint64_t sampler_seed = 0;
+        uint32_t next_sample = 0;       // sample index of the next pass
+
+        // Only the pixels in [x0, x1) x [y0, y1) are rendered, e.g. one tile of a
+        // distributed render; the others keep zero samples.
+        int window[4] = {0, 0, 0, 0};
+        // Pixels that already have this many samples are skipped (0: none are), so the
+        // passes go to the others, e.g. the pixels an edit changed.
+        int skip_samples = 0;
+
+        // Optional, filled in while rendering when set: the first-hit features of the
+        // camera rays, the instances each path hit, and rasterized primary hits.
+        aov_buffer* aovs = nullptr;
+        gbuffer* paths = nullptr;
+        const visibility_buffer* visibility = nullptr;
+
+        // Run on one thread after each pass with the passes done so far in this render();
+        // returning false ends it.
+        std::function<bool(int)> end_pass;
+        // Run on a tile's thread after each of its passes with the tile and the pass.
+        std::function<void(int, int, int, int, int)> end_tile;
+
+        // Totals over every render()
+        int passes_rendered = 0;
+        double render_seconds = 0;
+        std::atomic<uint64_t> primary_resolved{0};     // hit the rasterized primitive
+        std::atomic<uint64_t> primary_fallback{0};     // missed it, traced through the BVH
+        std::atomic<uint64_t> primary_uncovered{0};
+        std::atomic<int64_t> raster_nanoseconds{0};    // summed over the threads
+
+    private:
+        struct tile {
+            renderer* self;
+            int x0, y0, x1, y1;
+        };
+
+        static void* render_tile(void* arg);
+        bool finish_pass();
+
+        pthread_barrier_t pass_barrier;
+        int passes_wanted = 0;
+        int passes_done = 0;            // in this render()
+        bool rendering = false;
+        volatile sig_atomic_t stop_requested = 0;
+};
+
+
+int renderer::render(int passes) {
+    passes_wanted = passes;
+    passes_done = 0;
+    rendering = passes > 0 && !stop_requested;
+    auto start = std::chrono::steady_clock::now();
+
+    pthread_t workers[16];
+    tile tiles[16];
+    pthread_barrier_init(&pass_barrier, NULL, 16);
+    int window_width = window[2] - window[0];
+    int window_height = window[3] - window[1];
+    for (int j = 3; j >= 0; j--) {
+        for (int i = 0; i < 4; i++) {
+            int idx = i + 4 * j;
+            tiles[idx] = {this,
+                          window[0] + i * window_width / 4, window[1] + j * window_height / 4,
+                          window[0] + (i + 1) * window_width / 4,
+                          window[1] + (j + 1) * window_height / 4};
+            pthread_create(&workers[idx], NULL, render_tile, &tiles[idx]);
+        }
+    }
+    for (int i = 0; i < 16; i++)
+        pthread_join(workers[i], NULL);
+    pthread_barrier_destroy(&pass_barrier);
+
+    stop_requested = 0;
+    next_sample += passes_done;
+    passes_rendered += passes_done;
+    render_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return passes_done;
+}
+
+
+// Runs on exactly one thread once every worker has finished a pass.
+bool renderer::finish_pass() {
+    passes_done++;
+    bool more = passes_done < passes_wanted && !stop_requested;
+    if (end_pass && !end_pass(passes_done))
+        more = false;
+    return more;
+}
+
+
+void* renderer::render_tile(void* arg) {
+    auto t = static_cast<tile*>(arg);
+    renderer& r = *t->self;
+    int min_width = t->x0, min_height = t->y0, max_width = t->x1, max_height = t->y1;
+    thread_sampler = make_sampler(r.sampler_name);
+    thread_sampler->seed = r.sampler_seed;
+    trace_thread_name("render " + std::to_string(min_width) + "," + std::to_string(min_height));
+
+    int tile_width = max_width - min_width;
+    int tile_pixels = tile_width * (max_height - min_height);
+    std::vector<int> tile_triangles;
+    std::vector<double> jitter_u(tile_pixels), jitter_v(tile_pixels), depth;
+    std::vector<int> nearest;
+    bool track_instances = r.paths && !r.paths->pixels.empty();
+    bool track_aovs = r.aovs && !r.aovs->samples.empty();
+    first_hit first;
+    uint64_t resolved = 0, fallback = 0, uncovered = 0;
+    if (r.visibility)
+        tile_triangles = r.visibility->overlapping(min_width, min_height, max_width, max_height);
+
+    for (int pass = 0; r.rendering; pass++) {
+        uint32_t sample_index = r.next_sample + pass;
+        trace_scope tile("tile");
+        tile.arg("sample", sample_index);
+        tile.arg("pixels", tile_pixels);
+        if (r.visibility) {
+            TRACE_SCOPE("visibility");
+            auto start = std::chrono::steady_clock::now();
+            for (int j = min_height; j < max_height; ++j) {
+                for (int i = min_width; i < max_width; ++i) {
+                    int k = (j - min_height) * tile_width + (i - min_width);
+                    thread_sampler->start_sample(i, j, sample_index);
+                    thread_sampler->get_2d(jitter_u[k], jitter_v[k]);
+                }
+            }
+            r.visibility->rasterize(tile_triangles, min_width, min_height, max_width, max_height,
+                                    jitter_u, jitter_v, nearest, depth);
+            r.raster_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+        for (int j = max_height-1; j >= min_height; --j) {
+            for (int i = min_width; i < max_width; ++i) {
+                if (r.skip_samples > 0 && r.image.samples[r.image.index(i, j)] >= r.skip_samples)
+                    continue;
+                double du, dv;
+                thread_sampler->start_sample(i, j, sample_index);
+                thread_sampler->get_2d(du, dv);
+                auto u = (i + du) / (r.width-1);
+                auto v = (j + dv) / (r.height-1);
+                ray ray_in = r.cam.get_ray(u, v);
+
+                hit_record primary;
+                const hit_record* known_hit = nullptr;
+                if (r.visibility) {
+                    int nearest_primitive = nearest[(j - min_height) * tile_width + (i - min_width)];
+                    if (nearest_primitive < 0)
+                        uncovered++;
+                    else if (r.visibility->primitive(nearest_primitive)->hit(ray_in, 0.001, infinity,
+                                                                              primary)) {
+                        resolved++, known_hit = &primary;
+                        primary.instance = r.visibility->instance(nearest_primitive);
+                    } else
+                        fallback++;
+                }
+                path_instances = 0;
+                color sample = ray_color(ray_in, r.background, r.world, r.max_depth, known_hit,
+                                         track_aovs ? &first : nullptr,
+                                         r.sample_lights ? &r.lights : nullptr);
+                r.image.add_sample(i, j, sample);
+                if (track_aovs)
+                    r.aovs->add_sample(i, j, first.albedo, first.normal, first.depth,
+                                       first.emitted, sample);
+                if (track_instances)
+                    r.paths->count_path(i, j, path_instances);
+                STAT_PATH_END();
+            }
+        }
+        tile.end();
+        if (r.end_tile)
+            r.end_tile(min_width, min_height, max_width, max_height, pass);
+        if (pthread_barrier_wait(&r.pass_barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+            r.rendering = r.finish_pass();
+        pthread_barrier_wait(&r.pass_barrier);
+    }
+    r.primary_resolved += resolved;
+    r.primary_fallback += fallback;
+    r.primary_uncovered += uncovered;
+    delete thread_sampler;
+    thread_sampler = nullptr;
+    merge_thread_stats();
+    return nullptr;
+}
+
+
+#endif
@@ -10,6 +10,7 @@
 //==============================================================================================
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
@@ -38,9 +39,34 @@ inline double clamp(double x, double min, double max) {
     return x;
 }
 
+// Each thread owns a PCG32 generator, so render threads neither contend on rand() nor
+// disturb each other's sequences, and a sample can be replayed by reseeding (see sampler.h).
+struct pcg32_state {
+    uint64_t state = 0x853c49e6748fea9bULL;
+    uint64_t inc = 0xda3e39cb94b95bdbULL;
+};
+
+thread_local pcg32_state rng;
+
+inline uint32_t random_uint32() {
+    uint64_t old = rng.state;
+    rng.state = old * 6364136223846793005ULL + rng.inc;
+    uint32_t xorshifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = static_cast<uint32_t>(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+inline void seed_random(uint64_t seed, uint64_t stream = 0) {
+    rng.state = 0;
+    rng.inc = (stream << 1u) | 1u;
+    random_uint32();
+    rng.state += seed;
+    random_uint32();
+}
+
 inline double random_double() {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    return random_uint32() / 4294967296.0;
 }
 
 inline double random_double(double min, double max) {
@@ -0,0 +1,188 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rtweekend.h"
+
+#include <string>
+
+
+// A sampler hands out the random numbers of one pixel sample, dimension by dimension: the
+// camera takes the pixel jitter, lens and time, then every bounce takes what its material
+// needs. start_sample() rewinds to the first dimension of sample `index` of pixel (i, j).
+class sampler {
+    public:
+        virtual ~sampler() {}
+
+        virtual void start_sample(int i, int j, uint32_t index) {
+            dimension = 0;
+            // Anything not drawn through the sampler is still replayable per sample.
+            seed_random(mix_bits(mix_bits(mix_bits(seed ^ i) ^ j) ^ index));
+        }
+
+        virtual double get_1d() = 0;
+        virtual void get_2d(double& u, double& v) = 0;
+
+        static uint64_t mix_bits(uint64_t v) {
+            // splitmix64 finalizer
+            v ^= v >> 31;
+            v *= 0x7fb5d329728ea185ULL;
+            v ^= v >> 27;
+            v *= 0x81dadef4bc2dd44dULL;
+            v ^= v >> 33;
+            return v;
+        }
+
+    public:
+        uint64_t seed = 0;
+
+    protected:
+        int dimension = 0;
+};
+
+
+// Plain Monte Carlo: independent uniform numbers for every dimension.
+class independent_sampler : public sampler {
+    public:
+        virtual double get_1d() override {
+            dimension++;
+            return random_double();
+        }
+
+        virtual void get_2d(double& u, double& v) override {
+            dimension += 2;
+            u = random_double();
+            v = random_double();
+        }
+};
+
+
+// Owen-scrambled Sobol points, padded per pair of dimensions: every 2D request is the first
+// two Sobol dimensions with its own index shuffle and scramble, so each pair is stratified
+// on its own while pairs stay uncorrelated (Burley, "Practical Hash-based Owen Scrambling").
+class sobol_sampler : public sampler {
+    public:
+        virtual void start_sample(int i, int j, uint32_t index) override {
+            sampler::start_sample(i, j, index);
+            sample_index = index;
+            pixel_seed = static_cast<uint32_t>(mix_bits(mix_bits(seed ^ i) ^ j));
+        }
+
+        virtual double get_1d() override {
+            uint32_t dim_seed = hash(pixel_seed, dimension++);
+            uint32_t index = nested_uniform_scramble(sample_index, dim_seed);
+            return to_unit(nested_uniform_scramble(reverse_bits(index), hash(dim_seed, 1)));
+        }
+
+        virtual void get_2d(double& u, double& v) override {
+            uint32_t dim_seed = hash(pixel_seed, dimension);
+            dimension += 2;
+            uint32_t index = nested_uniform_scramble(sample_index, dim_seed);
+            u = to_unit(nested_uniform_scramble(reverse_bits(index), hash(dim_seed, 1)));
+            v = to_unit(nested_uniform_scramble(sobol_second(index), hash(dim_seed, 2)));
+        }
+
+    protected:
+        uint32_t sample_index = 0;
+        uint32_t pixel_seed = 0;
+
+        static uint32_t hash(uint32_t a, uint32_t b) {
+            return static_cast<uint32_t>(mix_bits((static_cast<uint64_t>(a) << 32) | b));
+        }
+
+        static double to_unit(uint32_t x) {
+            return x / 4294967296.0;
+        }
+
+        static uint32_t reverse_bits(uint32_t x) {
+            x = (x << 16) | (x >> 16);
+            x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+            x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+            x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+            x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+            return x;
+        }
+
+        static uint32_t sobol_second(uint32_t index) {
+            // Second Sobol dimension; its generator matrix is the Pascal matrix mod 2.
+            uint32_t result = 0;
+            for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+                if (index & 1)
+                    result ^= v;
+            return result;
+        }
+
+        static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+            // Laine-Karras style hash on the reversed bits acts as an Owen scramble.
+            x = reverse_bits(x);
+            x += seed;
+            x ^= x * 0x6c50b47cu;
+            x ^= x * 0xb82f1e52u;
+            x ^= x * 0xc7afe638u;
+            x ^= x * 0x8d22f6e6u;
+            return reverse_bits(x);
+        }
+};
+
+
+// The same Owen-scrambled Sobol set in every pixel, toroidally shifted by a per-pixel offset
+// from the R2 dither mask (Roberts 2018). Neighbouring pixels get well separated offsets, so
+// the remaining error is spread as high-frequency, blue-noise-like dither.
+class blue_noise_sampler : public sobol_sampler {
+    public:
+        virtual void start_sample(int i, int j, uint32_t index) override {
+            sobol_sampler::start_sample(i, j, index);
+            pixel_seed = static_cast<uint32_t>(seed);
+            offset_u = fract(0.5 + i * 0.7548776662466927 + j * 0.5698402909980532);
+            offset_v = fract(0.5 + i * 0.5698402909980532 + j * 0.7548776662466927);
+        }
+
+        virtual double get_1d() override {
+            auto shift = to_unit(hash(pixel_seed, dimension + 0x9e3779b9u));
+            return fract(sobol_sampler::get_1d() + offset_u + shift);
+        }
+
+        virtual void get_2d(double& u, double& v) override {
+            auto shift = to_unit(hash(pixel_seed, dimension + 0x9e3779b9u));
+            sobol_sampler::get_2d(u, v);
+            u = fract(u + offset_u + shift);
+            v = fract(v + offset_v + shift);
+        }
+
+    private:
+        double offset_u = 0;
+        double offset_v = 0;
+
+        static double fract(double x) {
+            x -= floor(x);
+            return x < 1 ? x : 0;
+        }
+};
+
+
+inline sampler* make_sampler(const std::string& name) {
+    if (name == "independent") return new independent_sampler();
+    if (name == "sobol")       return new sobol_sampler();
+    if (name == "bluenoise")   return new blue_noise_sampler();
+    return nullptr;
+}
+
+
+// The sampler of the calling render thread. Outside of a render (scene setup, tools) the
+// draws fall back to the thread's random generator.
+thread_local sampler *thread_sampler = nullptr;
+
+inline double sample_1d() {
+    return thread_sampler ? thread_sampler->get_1d() : random_double();
+}
+
+inline void sample_2d(double& u, double& v) {
+    if (thread_sampler) {
+        thread_sampler->get_2d(u, v);
+    } else {
+        u = random_double();
+        v = random_double();
+    }
+}
+
+
+#endif
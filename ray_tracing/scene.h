@@ -0,0 +1,362 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "rtweekend.h"
+
+#include "aarect.h"
+#include "arena.h"
+#include "bvh.h"
+#include "environment.h"
+#include "hittable_list.h"
+#include "lights.h"
+#include "mat.h"
+#include "material.h"
+#include "stats.h"
+#include "trace.h"
+#include "triangle.h"
+
+#include <array>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+// The Cornell-box teapot scene and its integrator, shared by the renderer (main.cpp) and the
+// benchmarks (bench.cpp). Its objects live in scene_arena, so replacing the scene is
+// reset_scene() rather than freeing every triangle and BVH node.
+
+arena scene_arena;
+
+// Global Materials, created by create_materials()
+shared_ptr<material> my_metal;
+shared_ptr<material> my_glass;
+shared_ptr<material> my_diffuse;
+std::vector<shared_ptr<material>> materials;
+
+// The materials of the teapots (0 metal, 1 glass, 2 diffuse, 3 light), made in pool.
+std::vector<shared_ptr<material>> default_materials(arena& pool) {
+    auto metal_teapot = pool.make<metal>(arena::materials, color(0.8, 0.8, 0.8), 0.3);
+    // Glass teapots are hollow: the wall is about as thick as the gap to the inner copy of the
+    // mesh at 95% scale that used to model it.
+    auto glass_teapot = pool.make<dielectric>(arena::materials, 1.5, 1.5);
+    auto diffuse_teapot = pool.make<lambertian>(arena::materials,
+                              pool.make<solid_color>(arena::materials, color(0.7, 0.3, 0.3)));
+    auto glowing_teapot = pool.make<diffuse_light>(arena::materials,
+                              pool.make<solid_color>(arena::materials, color(4, 3, 2)));
+    return {metal_teapot, glass_teapot, diffuse_teapot, glowing_teapot};
+}
+
+void create_materials() {
+    materials = default_materials(scene_arena);
+    my_metal = materials[0];
+    my_glass = materials[1];
+    my_diffuse = materials[2];
+}
+
+// Frees every object of the scene; hittables that point into it must be dropped first.
+void reset_scene() {
+    materials.clear();
+    scene_arena.reset();
+    create_materials();
+}
+
+// The instances hit by the paths traced on this thread since it last cleared the set.
+thread_local uint64_t path_instances = 0;
+
+// What a camera ray hit first, for the denoiser's AOVs (denoise.h).
+struct first_hit {
+    color albedo;
+    vec3 normal;
+    double depth;       // distance along the ray, 0 if it escaped
+    color emitted;      // by what it hit, or the background
+};
+
+// Where a ray of a path left from, for weighing a light it finds against sampling that light
+// from there.
+struct path_vertex {
+    point3 p;
+    vec3 side;          // the material's scattering_side()
+    double pdf;         // of the ray's direction, per solid angle; 0 if sharp
+};
+
+inline double power_heuristic(double f, double g) {
+    return f*f / (f*f + g*g);
+}
+
+// The chance that sample_light() samples the environment rather than one of the lights: all
+// of it without lights, half with them, none if it isn't sampled.
+inline double environment_share(const light_set& lights, const environment& background) {
+    if (!background.sampled())
+        return 0;
+    return lights.empty() ? 1 : 0.5;
+}
+
+// Light reaching rec from a light of lights picked for it, or from the environment (next
+// event estimation), weighed against the chance that the material's own scattering finds it.
+color sample_light(const ray& r, const hit_record& rec, const vec3& side, const hittable& world,
+                   const light_set& lights, const environment& background) {
+    double pmf, u1, u2;
+    double u = sample_1d();
+    sample_2d(u1, u2);
+    double share = environment_share(lights, background);
+    if (u < share) {
+        double pdf;
+        vec3 wi = background.sample(side, u1, u2, pdf);
+        pdf *= share;
+        if (pdf <= 0)
+            return color(0,0,0);
+        color f = rec.mat_ptr->reflectance(r, rec, wi);
+        if (f.x() == 0 && f.y() == 0 && f.z() == 0)
+            return color(0,0,0);
+        STAT_RAY();
+        double through = world.transmittance(ray(rec.p, wi, r.time()), 0.001, infinity);
+        STAT_RAY_END();
+        if (through == 0)
+            return color(0,0,0);
+        double weight = power_heuristic(pdf, rec.mat_ptr->scattering_pdf(r, rec, wi));
+        return f * background.value(wi) * (through * weight / pdf);
+    }
+
+    int light = lights.pick(rec.p, side, (u - share) / (1 - share), pmf);
+    if (light < 0)
+        return color(0,0,0);
+    pmf *= 1 - share;
+
+    const emitter& e = lights.emitters[light];
+    vec3 to_light = e.sample(u1, u2) - rec.p;
+    double distance = to_light.length();
+    vec3 wi = to_light / distance;
+    double cosine = e.two_sided ? fabs(dot(e.normal, wi)) : -dot(e.normal, wi);
+    if (cosine <= 0)
+        return color(0,0,0);
+    color f = rec.mat_ptr->reflectance(r, rec, wi);
+    if (f.x() == 0 && f.y() == 0 && f.z() == 0)
+        return color(0,0,0);
+
+    // Through media by their transmittance, which ratio tracking estimates with less noise
+    // than the all or nothing of a delta-tracked hit.
+    STAT_RAY();
+    double through = world.transmittance(ray(rec.p, wi, r.time()), 0.001, distance - 0.001);
+    STAT_RAY_END();
+    if (through == 0)
+        return color(0,0,0);
+
+    double pdf = pmf * distance * distance / (cosine * e.area);
+    double weight = power_heuristic(pdf, rec.mat_ptr->scattering_pdf(r, rec, wi));
+    return f * e.radiance * (through * weight / pdf);
+}
+
+// known_hit, if given, is where r hits the world, e.g. from the visibility buffer; first, if
+// given, is filled in for r itself. With lights, a light (or the environment, if it is a map)
+// is also sampled at each hit on a material that scatters diffusely, and the lights of the
+// set and the environment that rays find are weighed against that sampling by the power
+// heuristic (multiple importance sampling); from is the vertex r left from.
+color ray_color(const ray& r, const environment& background, const hittable& world, int depth,
+                const hit_record* known_hit = nullptr, first_hit* first = nullptr,
+                const light_set* lights = nullptr, const path_vertex* from = nullptr) {
+    hit_record rec;
+
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if (depth <= 0)
+        return color(0,0,0);
+
+    // If the ray hits nothing, return the background color.
+    STAT_RAY();
+    bool hit = true;
+    if (known_hit)
+        rec = *known_hit;
+    else
+        hit = world.hit(r, 0.001, infinity, rec);
+    STAT_RAY_END();
+    if (!hit) {
+        color sky = background.value(r.direction());
+        if (from && from->pdf > 0)
+            sky = sky * power_heuristic(from->pdf, environment_share(*lights, background)
+                                                   * background.pdf(from->side, r.direction()));
+        if (first)
+            *first = first_hit{color(1,1,1), vec3(0,0,0), 0, sky};
+        return sky;
+    }
+    path_instances |= instance_bit(rec.instance);
+
+    ray scattered;
+    color attenuation;
+    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    if (from && from->pdf > 0 && rec.light >= 0)
+        emitted = emitted * power_heuristic(from->pdf,
+                                            (1 - environment_share(*lights, background))
+                                            * lights->pdf(rec.light, from->p, from->side, rec.p));
+    STAT_MATERIAL(*rec.mat_ptr);
+    if (first)
+        *first = first_hit{rec.mat_ptr->surface_albedo(rec), rec.normal,
+                           rec.t * r.direction().length(), emitted};
+
+    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+        return emitted;
+    // The cone goes on from its width at the hit; curvature and roughness, which would widen
+    // it, are left out.
+    scattered.cone_width = r.width_at(rec.t);
+    scattered.cone_spread = r.cone_spread;
+
+    if (!lights || (lights->empty() && !background.sampled()))
+        return emitted + attenuation * ray_color(scattered, background, world, depth-1);
+
+    path_vertex here = {rec.p, rec.mat_ptr->scattering_side(rec),
+                        rec.mat_ptr->scattering_pdf(r, rec, scattered.direction())};
+    color direct = here.pdf > 0 ? sample_light(r, rec, here.side, world, *lights,
+                                                     background) : color(0,0,0);
+    return emitted + direct + attenuation * ray_color(scattered, background, world, depth-1,
+                                                      nullptr, nullptr, lights, &here);
+}
+
+// A triangle soup: every three vertices are a triangle. Texture coordinates are optional.
+struct mesh {
+    std::vector<std::array<double, 4>> pos;
+    std::vector<std::array<double, 3>> norm;
+    std::vector<std::array<double, 2>> uv;
+
+    int triangles() const { return static_cast<int>(pos.size() / 3); }
+};
+
+// Global Teapot
+mesh teapot;
+
+// Reads a mesh in the format of modify_teapot.txt, a vertex per line: position, then normal.
+bool load_mesh(const std::string& file, mesh& m)
+{
+    std::ifstream mesh_file;
+    mesh_file.open(file);
+    if (!mesh_file)
+        return false;
+
+    std::string line;
+    while(std::getline(mesh_file, line))
+    {
+        std::array<double, 4> pos;
+        std::array<double, 3> norm;
+        if (sscanf(line.c_str(), "%lf %lf %lf %lf %lf %lf",
+                   &pos[0], &pos[1], &pos[2], &norm[0], &norm[1], &norm[2]) != 6)
+            continue;
+        pos[3] = 1.0;
+        m.pos.push_back(pos);
+        m.norm.push_back(norm);
+    }
+    m.pos.resize(m.pos.size() / 3 * 3);
+    m.norm.resize(m.pos.size());
+    return true;
+}
+
+void load_teapot()
+{
+    trace_scope trace("load_teapot");
+    load_mesh("modify_teapot.txt", teapot);
+    trace.arg("triangles", teapot.triangles());
+}
+
+// Gives m texture coordinates by projecting it onto a cylinder around its vertical axis, for
+// meshes that come without: u goes once around, v up, at the scale of u so texels stay
+// square. Triangles across the seam get u past 1 rather than spanning the whole texture.
+void cylindrical_uvs(mesh& m)
+{
+    double lo[3] = {infinity, infinity, infinity}, hi[3] = {-infinity, -infinity, -infinity};
+    for (const auto& p : m.pos)
+        for (int a = 0; a < 3; a++)
+            lo[a] = fmin(lo[a], p[a]), hi[a] = fmax(hi[a], p[a]);
+    double cx = (lo[0] + hi[0]) / 2, cz = (lo[2] + hi[2]) / 2;
+    double circumference = pi * fmax(hi[0] - lo[0], hi[2] - lo[2]);
+
+    m.uv.resize(m.pos.size());
+    for (size_t k = 0; k < m.pos.size(); k++) {
+        const auto& p = m.pos[k];
+        m.uv[k] = {atan2(p[2] - cz, p[0] - cx) / (2*pi) + 0.5, (p[1] - lo[1]) / circumference};
+    }
+    for (size_t k = 0; k < m.uv.size(); k += 3) {
+        double u_max = fmax(m.uv[k][0], fmax(m.uv[k+1][0], m.uv[k+2][0]));
+        for (int j = 0; j < 3; j++)
+            if (u_max - m.uv[k+j][0] > 0.5)
+                m.uv[k+j][0] += 1;
+    }
+}
+
+// Vertices, vertex normals and face normal of triangle i of shape, the positions transformed
+// by pos_mat and the normals by norm_mat.
+void transform_triangle(const mesh& shape, int i, mat4 pos_mat, mat3 norm_mat,
+                        vec3 pos[3], vec3 norm[3], vec3& face_norm) {
+    for(int j = 0; j < 3; j++)
+    {
+        std::array<double, 4> old_pos = shape.pos[i * 3 + j], new_pos;
+        mat4_mul(pos_mat, old_pos, new_pos);
+        std::array<double, 3> old_norm = shape.norm[i * 3 + j], new_norm;
+        mat3_mul(norm_mat, old_norm, new_norm);
+
+        pos[j] = point3(new_pos[0], new_pos[1], new_pos[2]);
+        norm[j] = vec3(new_norm[0], new_norm[1], new_norm[2]);
+        norm[j] = normalize(norm[j]);
+    }
+    vec3 u = pos[1] - pos[0];
+    vec3 v = pos[2] - pos[0];
+    face_norm = normalize(cross(u, v));
+    vec3 avg_vertex_norm = (norm[0] + norm[1] + norm[2]) / 3;
+    face_norm = (dot(face_norm, avg_vertex_norm) > 0.0f)? face_norm : -face_norm;
+}
+
+// Adds an instance of the mesh, its vertices transformed by pos_mat and its normals by
+// norm_mat, as a BVH made in pool. Hits on it carry id, unless it is -1.
+void add_mesh(hittable_list& objects, const mesh& shape, mat4 pos_mat, mat3 norm_mat,
+              shared_ptr<material> m, int id, arena& pool) {
+    trace_scope trace("add_mesh");
+    trace.arg("triangles", shape.triangles());
+
+	hittable_list instance;
+    // Rays that refract into glass leave it through the back faces.
+    bool two_sided = dynamic_cast<dielectric*>(m.get()) != nullptr;
+
+    for(int i = 0; i < shape.triangles(); i++)
+    {
+        vec3 pos[3];
+        vec3 norm[3];
+        vec3 face_norm;
+        transform_triangle(shape, i, pos_mat, norm_mat, pos, norm, face_norm);
+        shared_ptr<hittable> tri;
+        if (shape.uv.empty())
+            tri = pool.make<triangle>(arena::primitives,
+                pos[0], pos[1], pos[2], norm[0], norm[1], norm[2], face_norm, m, two_sided);
+        else
+            tri = pool.make<textured_triangle>(arena::primitives,
+                pos[0], pos[1], pos[2], norm[0], norm[1], norm[2], face_norm, m, two_sided,
+                shape.uv[i*3], shape.uv[i*3 + 1], shape.uv[i*3 + 2]);
+        instance.add(tri);
+    }
+
+    trace_scope build("bvh_build");
+    build.arg("triangles", instance.objects.size());
+    shared_ptr<hittable> bvh = pool.make<bvh_node>(arena::bvh_nodes, instance, 0, 0, &pool);
+    build.end();
+    if (id >= 0)
+        bvh = pool.make<instance_id>(arena::other, bvh, id);
+    objects.add(bvh);
+}
+
+void add_teapot(hittable_list& objects, mat4 pos_mat, mat3 norm_mat, shared_ptr<material> m,
+                int id = -1) {
+    add_mesh(objects, teapot, pos_mat, norm_mat, m, id, scene_arena);
+}
+
+void add_cornell_box(hittable_list& objects, arena& pool = scene_arena) {
+    auto solid = [&](color c) { return pool.make<solid_color>(arena::materials, c); };
+    auto red   = pool.make<lambertian>(arena::materials, solid(color(.65, .05, .05)));
+    auto white = pool.make<lambertian>(arena::materials, solid(color(.73, .73, .73)));
+    auto green = pool.make<lambertian>(arena::materials, solid(color(.12, .45, .15)));
+    auto light = pool.make<diffuse_light>(arena::materials, solid(color(15, 15, 15)));
+
+    auto rect = arena::primitives;
+    objects.add(pool.make<yz_rect>(rect, -100, 100, -300,    0, -100, green));
+    objects.add(pool.make<yz_rect>(rect, -100, 100, -300,    0,  100,   red));
+    objects.add(pool.make<xz_rect>(rect,  -25,  25, -175, -125,   96, light));
+    objects.add(pool.make<xz_rect>(rect, -100, 100, -300,    0,  100, white));
+    objects.add(pool.make<xz_rect>(rect, -100, 100, -300,    0, -100, white));
+    objects.add(pool.make<xy_rect>(rect, -100, 100, -100,  100, -200, white));
+}
+
+
+#endif
@@ -0,0 +1,280 @@
+"""Runs the renders of the /render endpoint (app.py) on a pool of workers.
+
+A job runs as a series of slices: a.out renders for at most slice_seconds, saves its
+checkpoint and exits, and the job's next slice resumes from that checkpoint (-r). The job's
+time_budget is a deadline counted from its submission, queueing included; past it, a job that
+has fewer than min_samples_per_pixel gets one last slice that renders the rest of them. Between
+slices a worker takes the queued job that has had the least render time for its priority's
+weight, so interactive previews (weight 4) get ahead of batch renders (weight 1) without
+starving them, and a long render can't hold a worker while others wait. Admission is
+bounded: once workers + queue_limit jobs are in, submit() turns new ones away.
+
+Cancelling a queued job drops it. A running job's a.out is asked to stop (SIGTERM), which it
+does once the pass in flight is done; the samples rendered so far are kept, like the
+result of a job that finished.
+"""
+import os
+import queue
+import re
+import signal
+import struct
+import subprocess
+import tempfile
+import threading
+import time
+
+WEIGHTS = {'interactive': 4, 'batch': 1}
+
+# Streamed renders (a.out -p, see tile_stream.h) are sent as framed messages.
+STREAM_HEADER = struct.Struct('>BHHHHII')
+STREAM_IMAGE, STREAM_STATS = 2, 3
+
+
+def stream_message(kind, width, height, samples_per_pixel, payload):
+    return STREAM_HEADER.pack(kind, 0, 0, width, height, samples_per_pixel, len(payload)) + payload
+
+
+def scene_items(render_data):
+    """The contents of the a.out matrix files and the material of each teapot of a request."""
+    items = []
+    for item in render_data:
+        mv, norm = item['mvMatrix'], item['mvNormalMatrix']
+        pos_text = ''.join(f"{mv[j]} {mv[j + 4]} {mv[j + 8]} {mv[j + 12]}\n" for j in range(4))
+        norm_text = ''.join(f"{norm[j]} {norm[j + 3]} {norm[j + 6]}\n" for j in range(3))
+        items.append((pos_text, norm_text, item['meterial']))
+    return items
+
+
+class RenderJob:
+    def __init__(self, key, items, options, priority='interactive', session=None,
+                 cached=None, history=None):
+        self.key = key
+        self.items = items
+        self.options = options          # samples_per_pixel, time_budget, format, ... (app.py)
+        self.priority = priority if priority in WEIGHTS else 'interactive'
+        self.session = session
+        self.history = history          # cache entry to start from with -H, first slice only
+        self.messages = queue.Queue() if options.get('stream') else None
+
+        self.state = 'queued'           # then running, and done, failed or cancelled
+        self.cancelled = False
+        self.process = None
+        self.submitted = time.monotonic()
+        self.deadline = self.submitted + options['time_budget']
+        self.final = False              # the last slice, past the deadline
+        self.started = None             # first slice
+        self.finished = None
+        self.service = 0.0              # seconds of slices so far
+        self.slices = 0
+        self.done = threading.Event()
+
+        # The render so far: the cached one it extends, then each slice's.
+        self.checkpoint = cached.checkpoint if cached is not None else None
+        self.gbuffer = cached.gbuffer if cached is not None else b''
+        self.image = (cached.image(options['format'], options.get('denoise', False))
+                      if cached is not None else b'')
+        self.samples_per_pixel = cached.samples_per_pixel if cached is not None else 0
+        self.headers = {'X-Cache': 'extend' if cached is not None else 'miss'}
+
+    def queue_delay(self):
+        return (self.started if self.started is not None else time.monotonic()) - self.submitted
+
+    def complete(self):
+        spp = self.options['samples_per_pixel']
+        late = time.monotonic() >= self.deadline
+        if not self.image:              # a cached checkpoint, to encode in another format
+            return False
+        return self.final or self.samples_per_pixel >= spp or (
+            late and self.samples_per_pixel >= self.options['min_samples_per_pixel'])
+
+
+def run_slice(job, seconds, binary='./a.out'):
+    """Renders one slice of job with a.out; returns False if it failed."""
+    options = job.options
+    with tempfile.TemporaryDirectory() as tmp:
+        checkpoint_file = os.path.join(tmp, 'render.ckpt')
+        gbuffer_file = os.path.join(tmp, 'render.gbuf')
+        stats_file = os.path.join(tmp, 'stats.json')
+        # -m counts the resumed samples too: the last slice renders until the job has
+        # min_samples_per_pixel, any other at least one pass.
+        min_spp = options['min_samples_per_pixel'] if job.final else 1
+        command = [binary, '-t', f"{seconds:.3f}", '-m', str(min_spp), '-k', checkpoint_file,
+                   '-G', gbuffer_file, '-e', options['format']]
+        if options.get('stats'):
+            # Only filled in when a.out is built with -DRT_STATS.
+            command += ['-S', stats_file]
+        if options.get('denoise'):
+            command += ['-D']
+        if job.messages is not None:
+            command += ['-p']
+        if job.checkpoint is not None:
+            # Resume the job, or the cached accumulation buffer it extends.
+            resume_file = os.path.join(tmp, 'resume.ckpt')
+            with open(resume_file, 'wb') as f:
+                f.write(job.checkpoint)
+            command += ['-r', resume_file]
+        elif job.history is not None and job.history.gbuffer:
+            # Keep the previous render's pixels that the edit didn't change and spend
+            # the time budget on the others.
+            history_files = [os.path.join(tmp, 'history.ckpt'), os.path.join(tmp, 'history.gbuf')]
+            for name, data in zip(history_files, [job.history.checkpoint, job.history.gbuffer]):
+                with open(name, 'wb') as f:
+                    f.write(data)
+            command += ['-H', ','.join(history_files)]
+        command += [str(options['samples_per_pixel']), str(len(job.items))]
+        for k, (pos_text, norm_text, material) in enumerate(job.items):
+            pos, norm = os.path.join(tmp, f"mv_mat_{k}.txt"), os.path.join(tmp, f"norm_mat_{k}.txt")
+            with open(pos, 'w') as f:
+                f.write(pos_text)
+            with open(norm, 'w') as f:
+                f.write(norm_text)
+            command += [pos, norm, str(material)]
+
+        with open(os.path.join(tmp, 'stderr'), 'w+b') as errors:
+            job.process = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=errors)
+            if job.cancelled:
+                job.process.send_signal(signal.SIGTERM)
+            image = read_output(job, job.process.stdout)
+            returncode = job.process.wait()
+            errors.seek(0)
+            stderr = errors.read()
+
+        rendered = re.search(rb"Rendered (\d+) samples per pixel", stderr)
+        if returncode != 0 or not rendered:
+            return False
+        with open(checkpoint_file, 'rb') as f, open(gbuffer_file, 'rb') as g:
+            job.checkpoint, job.gbuffer = f.read(), g.read()
+        job.image = image
+        job.samples_per_pixel = int(rendered.group(1))
+        reused = re.search(rb"-H: kept the history of (\d+)", stderr)
+        if reused and int(reused.group(1)) > 0:
+            job.headers['X-Cache'] = 'reuse'
+        encoded = re.search(rb"Encoded the image \(\w+\) in ([\d.e+-]+) ms", stderr)
+        if encoded:
+            job.headers['X-Encode-Ms'] = encoded.group(1).decode()
+        if os.path.exists(stats_file):
+            with open(stats_file) as f:
+                job.headers['X-Render-Stats'] = f.read().strip()
+    return True
+
+
+def read_output(job, pipe):
+    """The image a.out writes; passes the messages of a streamed render on as they come."""
+    if job.messages is None:
+        return pipe.read()
+    image = b''
+    while True:
+        header = pipe.read(STREAM_HEADER.size)
+        if len(header) < STREAM_HEADER.size:
+            return image
+        kind, _, _, _, _, _, length = STREAM_HEADER.unpack(header)
+        payload = pipe.read(length)
+        if kind == STREAM_IMAGE:
+            image = payload
+        job.messages.put(header + payload)
+
+
+class RenderScheduler:
+    def __init__(self, workers=2, queue_limit=16, slice_seconds=2.0, on_finish=None,
+                 run=run_slice):
+        self.workers = workers
+        self.queue_limit = queue_limit
+        self.slice_seconds = slice_seconds
+        self.on_finish = on_finish      # called with each job that stops, e.g. to cache it
+        self.run = run
+        self.queue = []                 # admitted jobs waiting for their next slice
+        self.running = set()
+        self.condition = threading.Condition()
+        for _ in range(workers):
+            threading.Thread(target=self.work, daemon=True).start()
+
+    def submit(self, job):
+        """Admits job unless the queue is full. Once it is admitted, a job of the same session
+        (the same page) is cancelled: its scene is out of date. The slot that job frees counts
+        for the admission, but a job that isn't admitted leaves the old one running."""
+        with self.condition:
+            replaced = [other for other in self.queue + list(self.running)
+                        if job.session is not None and other.session == job.session
+                        and not other.cancelled]
+            occupied = len(self.queue) + len(self.running) - len(replaced)
+            if occupied >= self.workers + self.queue_limit:
+                return False
+            for other in replaced:
+                self.cancel_locked(other)
+            self.queue.append(job)
+            self.condition.notify()
+            return True
+
+    def cancel(self, job):
+        with self.condition:
+            self.cancel_locked(job)
+
+    def cancel_locked(self, job):
+        job.cancelled = True
+        if job in self.queue:
+            self.queue.remove(job)
+            self.finish_locked(job, 'cancelled')
+        elif job.process is not None and job.process.poll() is None:
+            job.process.send_signal(signal.SIGTERM)
+
+    def finish_locked(self, job, state):
+        job.state = state
+        job.finished = time.monotonic()
+        if job.messages is not None:
+            job.messages.put(None)
+        job.done.set()
+        if self.on_finish is not None:
+            self.on_finish(job)
+
+    def next_job(self):
+        # Least weighted service first; on a tie the higher priority, then the older job.
+        job = min(self.queue, key=lambda j: (j.service / WEIGHTS[j.priority],
+                                             -WEIGHTS[j.priority], j.submitted))
+        self.queue.remove(job)
+        return job
+
+    def work(self):
+        while True:
+            with self.condition:
+                while not self.queue:
+                    self.condition.wait()
+                job = self.next_job()
+                if job.complete():
+                    # Its deadline passed in the queue, with the samples it needs.
+                    self.finish_locked(job, 'done')
+                    continue
+                self.running.add(job)
+                job.state = 'running'
+                if job.started is None:
+                    job.started = time.monotonic()
+
+            # Past the deadline, one slice renders the missing min_samples_per_pixel however
+            # long they take, rather than a pass per slice.
+            remaining = job.deadline - time.monotonic()
+            job.final = remaining <= 0
+            seconds = max(min(self.slice_seconds, remaining), 0.001)
+            start = time.monotonic()
+            try:
+                ok = self.run(job, seconds)
+            except OSError:
+                ok = False
+            job.service += time.monotonic() - start
+            job.slices += 1
+
+            with self.condition:
+                self.running.discard(job)
+                job.process = None
+                if not ok:
+                    self.finish_locked(job, 'failed')
+                elif job.cancelled:
+                    self.finish_locked(job, 'cancelled')
+                elif job.complete():
+                    self.finish_locked(job, 'done')
+                else:
+                    job.state = 'queued'
+                    self.queue.append(job)
+                    self.condition.notify()
+
+    def load(self):
+        with self.condition:
+            return {'queued': len(self.queue), 'running': len(self.running)}
@@ -28,6 +28,9 @@ class sphere : public hittable {
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual bool interval(const ray& r, double t_min, double t_max, double& t0,
+                              double& t1) const override;
+
     public:
         point3 center;
         double radius;
@@ -84,10 +87,28 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.footprint = cone_footprint(r, root, outward_normal, 1 / (pi*radius));
+    rec.light = -1;
     rec.mat_ptr = mat_ptr;
 
     return true;
 }
 
 
+bool sphere::interval(const ray& r, double t_min, double t_max, double& t0, double& t1) const {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius*radius;
+
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant <= 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    t0 = fmax((-half_b - sqrtd) / a, t_min);
+    t1 = fmin((-half_b + sqrtd) / a, t_max);
+    return t0 < t1;
+}
+
+
 #endif
@@ -0,0 +1,161 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Ray tracing statistics, compiled in with -DRT_STATS. Every thread counts into its own
+// thread_local render_stats (no atomics or locks on the hot path) and adds it to the totals
+// with merge_thread_stats() when it is done. Without RT_STATS the STAT_* macros expand to
+// nothing, so the instrumented code is unchanged.
+
+#ifdef RT_STATS
+
+#include <cxxabi.h>
+#include <pthread.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <ostream>
+#include <string>
+#include <typeinfo>
+
+
+struct render_stats {
+    static const int path_buckets = 65;     // rays per camera path, the last bucket is 64+
+    static const int node_buckets = 33;     // BVH nodes per ray, bucket k holds [2^(k-1), 2^k)
+    static const int material_slots = 16;
+
+    uint64_t paths = 0;
+    uint64_t rays = 0;
+    uint64_t bvh_node_visits = 0;
+    uint64_t triangle_tests = 0;
+    uint64_t triangle_hits = 0;
+    uint64_t texture_lookups = 0;           // bilinear, two per trilinear
+    uint64_t texture_lines = 0;             // distinct 64-byte lines of the texels they read
+    uint64_t path_length[path_buckets] = {};
+    uint64_t nodes_per_ray[node_buckets] = {};
+
+    // Hits by material type.
+    struct material_count {
+        const std::type_info* type;
+        uint64_t hits;
+    } materials[material_slots] = {};
+
+    // State of the path and ray being traced.
+    int path_rays = 0;
+    uint64_t ray_nodes = 0;
+
+    void end_ray() {
+        int bucket = 0;
+        while (bucket < node_buckets - 1 && (1ULL << bucket) <= ray_nodes)
+            bucket++;
+        nodes_per_ray[bucket]++;
+        ray_nodes = 0;
+    }
+
+    void end_path() {
+        paths++;
+        path_length[path_rays < path_buckets ? path_rays : path_buckets - 1]++;
+        path_rays = 0;
+    }
+
+    void add(const render_stats& other) {
+        paths += other.paths;
+        rays += other.rays;
+        bvh_node_visits += other.bvh_node_visits;
+        triangle_tests += other.triangle_tests;
+        triangle_hits += other.triangle_hits;
+        texture_lookups += other.texture_lookups;
+        texture_lines += other.texture_lines;
+        for (int k = 0; k < path_buckets; k++)
+            path_length[k] += other.path_length[k];
+        for (int k = 0; k < node_buckets; k++)
+            nodes_per_ray[k] += other.nodes_per_ray[k];
+        for (const auto& m : other.materials)
+            if (m.type)
+                add_material(*m.type, m.hits);
+    }
+
+    void add_material(const std::type_info& type, uint64_t hits = 1) {
+        for (auto& m : materials) {
+            if (m.type == &type || m.type == nullptr) {
+                m.type = &type;
+                m.hits += hits;
+                return;
+            }
+        }
+    }
+
+    void write_json(std::ostream& out) const;
+};
+
+
+void render_stats::write_json(std::ostream& out) const {
+    auto list = [&out](const uint64_t* values, int count) {
+        out << '[';
+        for (int k = 0; k < count; k++)
+            out << (k ? "," : "") << values[k];
+        out << ']';
+    };
+
+    out << "{\"paths\":" << paths
+        << ",\"rays\":" << rays
+        << ",\"bvh_node_visits\":" << bvh_node_visits
+        << ",\"triangle_tests\":" << triangle_tests
+        << ",\"triangle_hits\":" << triangle_hits
+        << ",\"texture_lookups\":" << texture_lookups
+        << ",\"texture_bytes\":" << 64 * texture_lines
+        << ",\"average_path_length\":" << (paths ? double(rays) / paths : 0.0)
+        << ",\"average_nodes_per_ray\":" << (rays ? double(bvh_node_visits) / rays : 0.0)
+        << ",\"path_length_histogram\":";
+    list(path_length, path_buckets);
+    out << ",\"nodes_per_ray_log2_histogram\":";
+    list(nodes_per_ray, node_buckets);
+    out << ",\"material_hits\":{";
+    bool first = true;
+    for (const auto& m : materials) {
+        if (!m.type)
+            continue;
+        int status;
+        char* name = abi::__cxa_demangle(m.type->name(), nullptr, nullptr, &status);
+        out << (first ? "" : ",") << '"' << (status == 0 ? name : m.type->name()) << "\":" << m.hits;
+        std::free(name);
+        first = false;
+    }
+    out << "}}\n";
+}
+
+
+thread_local render_stats thread_stats;
+render_stats total_stats;
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+inline void merge_thread_stats() {
+    pthread_mutex_lock(&stats_mutex);
+    total_stats.add(thread_stats);
+    pthread_mutex_unlock(&stats_mutex);
+    thread_stats = render_stats();
+}
+
+#define STAT_COUNT(counter)        (thread_stats.counter++)
+#define STAT_ADD(counter, n)       (thread_stats.counter += (n))
+#define STAT_BVH_NODE()            (thread_stats.bvh_node_visits++, thread_stats.ray_nodes++)
+#define STAT_RAY()                 (thread_stats.rays++, thread_stats.path_rays++)
+#define STAT_RAY_END()             (thread_stats.end_ray())
+#define STAT_PATH_END()            (thread_stats.end_path())
+#define STAT_MATERIAL(mat)         (thread_stats.add_material(typeid(mat)))
+
+#else
+
+inline void merge_thread_stats() {}
+
+#define STAT_COUNT(counter)        ((void)0)
+#define STAT_ADD(counter, n)       ((void)0)
+#define STAT_BVH_NODE()            ((void)0)
+#define STAT_RAY()                 ((void)0)
+#define STAT_RAY_END()             ((void)0)
+#define STAT_PATH_END()            ((void)0)
+#define STAT_MATERIAL(mat)         ((void)0)
+
+#endif
+
+
+#endif
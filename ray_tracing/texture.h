@@ -22,6 +22,12 @@
 class texture  {
     public:
         virtual color value(double u, double v, const vec3& p) const = 0;
+
+        // The average over a footprint that wide in (u, v) units around (u, v), see
+        // hit_record::footprint; textures without detail to lose need not filter.
+        virtual color filtered(double u, double v, const vec3& p, double footprint) const {
+            return value(u, v, p);
+        }
 };
 
 
@@ -70,16 +76,20 @@ class noise_texture : public texture {
     public:
         noise_texture() {}
         noise_texture(double sc) : scale(sc) {}
+        // Approximate, the turbulence looked up in a precomputed volume (see noise_volume).
+        noise_texture(double sc, shared_ptr<noise_volume> v) : scale(sc), volume(v) {}
 
         virtual color value(double u, double v, const vec3& p) const override {
             // return color(1,1,1)*0.5*(1 + noise.turb(scale * p));
             // return color(1,1,1)*noise.turb(scale * p);
-            return color(1,1,1)*0.5*(1 + sin(scale*p.z() + 10*noise.turb(p)));
+            double turb = volume ? volume->turb(p) : noise.turb_fast(p);
+            return color(1,1,1)*0.5*(1 + sin(scale*p.z() + 10*turb));
         }
 
     public:
         perlin noise;
         double scale;
+        shared_ptr<noise_volume> volume;
 };
 
 #endif
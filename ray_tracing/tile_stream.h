@@ -0,0 +1,75 @@
+#ifndef TILE_STREAM_H
+#define TILE_STREAM_H
+
+#include "framebuffer.h"
+#include "image_codec.h"
+
+#include <pthread.h>
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+
+// Progress of a render as a stream of messages (-p), so a client can paint the tiles as they
+// are rendered instead of waiting for the image. Every message is
+//
+//     kind (1 byte), x, y, width, height (uint16), samples per pixel, length (uint32),
+//     then length bytes of payload
+//
+// with integers big-endian and (x, y) the top left corner of the region, y = 0 at the top
+// row as in image files. A tile message carries a PNG of the region; the image message at the
+// end carries the whole image in the output format; other kinds (app.py adds its timings)
+// are skipped by readers that don't know them.
+//
+// Render threads send their tiles themselves: the encoding happens on the thread, only the
+// write is serialized.
+class tile_stream {
+    public:
+        enum kind : uint8_t { tile = 1, image = 2, stats = 3 };
+
+        tile_stream(std::ostream& out, std::chrono::steady_clock::time_point start)
+            : out(out), start(start) {}
+
+        // Sends pixels [x0, x1) x [y0, y1) of image (y = 0 at the bottom, as in the framebuffer).
+        void send_tile(const framebuffer& image, int x0, int y0, int x1, int y1, int spp) {
+            std::string png = encode_png(image.rgb8(x0, y0, x1, y1), x1 - x0, y1 - y0, 1);
+            send(tile, x0, image.height - y1, x1 - x0, y1 - y0, spp, png);
+        }
+
+        void send_image(const std::string& encoded, int width, int height, int spp) {
+            send(image, 0, 0, width, height, spp, encoded);
+        }
+
+        // Seconds from start to the first tile, or a negative number before it.
+        double first_pixel_seconds() const { return first_pixels; }
+
+    private:
+        void send(kind k, int x, int y, int width, int height, int spp, const std::string& payload) {
+            std::string header(1, static_cast<char>(k));
+            for (int v : {x, y, width, height}) {
+                header += static_cast<char>(v >> 8);
+                header += static_cast<char>(v);
+            }
+            append_be32(header, spp);
+            append_be32(header, payload.size());
+
+            pthread_mutex_lock(&mutex);
+            if (first_pixels < 0 && k == tile)
+                first_pixels = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+            out.write(header.data(), header.size());
+            out.write(payload.data(), payload.size());
+            out.flush();
+            pthread_mutex_unlock(&mutex);
+        }
+
+        std::ostream& out;
+        std::chrono::steady_clock::time_point start;
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        double first_pixels = -1;
+};
+
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Timeline tracing in the Chrome trace-event format (chrome://tracing, ui.perfetto.dev).
+// TRACE_SCOPE marks a span from its declaration to the end of the enclosing block. Events go
+// into a fixed-size ring buffer owned by the recording thread, so recording takes neither a
+// lock nor an atomic; a thread only takes the registry lock once, when it records its first
+// event, and when it exits. A buffer left by a thread that exited is taken over by the next
+// thread of the same name, so threads started anew for every render (tiles, one per frame of
+// an animation) share one buffer and one tid per tile. When tracing is off a scope costs one
+// branch.
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+struct trace_event {
+    static const int max_args = 3;
+
+    const char* name;
+    int64_t begin;                  // ns since trace_start
+    int64_t end;
+    int arg_count;
+    const char* arg_names[max_args];
+    int64_t arg_values[max_args];
+};
+
+
+struct trace_buffer {
+    static constexpr size_t capacity = 1 << 14;
+
+    std::vector<trace_event> events = std::vector<trace_event>(capacity);
+    size_t recorded = 0;            // events ever recorded; the oldest are overwritten
+    int tid = 0;
+    std::string thread_name;
+    bool owned = false;             // by a running thread
+};
+
+
+bool tracing_enabled = false;
+std::chrono::steady_clock::time_point trace_start = std::chrono::steady_clock::now();
+std::vector<trace_buffer*> trace_buffers;
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+thread_local trace_buffer* thread_trace = nullptr;
+thread_local std::string thread_trace_name;
+
+// Hands the thread's buffer back when the thread exits.
+struct trace_buffer_release {
+    ~trace_buffer_release() {
+        if (!thread_trace)
+            return;
+        pthread_mutex_lock(&trace_mutex);
+        thread_trace->owned = false;
+        pthread_mutex_unlock(&trace_mutex);
+    }
+};
+thread_local trace_buffer_release thread_trace_release;
+
+inline int64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - trace_start).count();
+}
+
+inline trace_buffer* current_trace_buffer() {
+    if (!thread_trace) {
+        pthread_mutex_lock(&trace_mutex);
+        for (auto* buffer : trace_buffers)
+            if (!buffer->owned && buffer->thread_name == thread_trace_name) {
+                thread_trace = buffer;
+                break;
+            }
+        if (!thread_trace) {
+            thread_trace = new trace_buffer();
+            thread_trace->thread_name = thread_trace_name;
+            thread_trace->tid = trace_buffers.size() + 1;
+            trace_buffers.push_back(thread_trace);
+        }
+        thread_trace->owned = true;
+        pthread_mutex_unlock(&trace_mutex);
+        (void)&thread_trace_release;    // constructed, so that it runs at exit
+    }
+    return thread_trace;
+}
+
+inline void trace_thread_name(const std::string& name) {
+    thread_trace_name = name;
+    if (thread_trace) {
+        pthread_mutex_lock(&trace_mutex);
+        thread_trace->thread_name = name;
+        pthread_mutex_unlock(&trace_mutex);
+    }
+}
+
+
+class trace_scope {
+    public:
+        trace_scope(const char* name) : open(tracing_enabled) {
+            if (open) {
+                event.name = name;
+                event.arg_count = 0;
+                event.begin = trace_now();
+            }
+        }
+
+        ~trace_scope() { end(); }
+
+        void arg(const char* name, int64_t value) {
+            if (open && event.arg_count < trace_event::max_args) {
+                event.arg_names[event.arg_count] = name;
+                event.arg_values[event.arg_count++] = value;
+            }
+        }
+
+        // Ends the span before the end of the block.
+        void end() {
+            if (!open)
+                return;
+            open = false;
+            event.end = trace_now();
+            trace_buffer* buffer = current_trace_buffer();
+            buffer->events[buffer->recorded++ % trace_buffer::capacity] = event;
+        }
+
+    private:
+        bool open;
+        trace_event event;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+
+// Writes every buffered event. Call once the traced threads are done.
+void write_trace(std::ostream& out) {
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    for (const auto* buffer : trace_buffers) {
+        out << (first ? "" : ",\n")
+            << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+            << ",\"args\":{\"name\":\"" << (buffer->thread_name.empty() ? "main" : buffer->thread_name)
+            << "\"}}";
+        first = false;
+
+        size_t count = std::min(buffer->recorded, trace_buffer::capacity);
+        for (size_t k = buffer->recorded - count; k < buffer->recorded; k++) {
+            const trace_event& e = buffer->events[k % trace_buffer::capacity];
+            out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                << ",\"ts\":" << e.begin / 1000.0 << ",\"dur\":" << (e.end - e.begin) / 1000.0
+                << ",\"args\":{";
+            for (int a = 0; a < e.arg_count; a++)
+                out << (a ? "," : "") << '"' << e.arg_names[a] << "\":" << e.arg_values[a];
+            out << "}}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+
+#endif
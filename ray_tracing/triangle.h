@@ -4,6 +4,9 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "stats.h"
+
+#include <array>
 
 
 using std::max;
@@ -16,8 +19,10 @@ class triangle : public hittable
         triangle(point3 a, point3 b, point3 c, 
                  vec3 n_a, vec3 n_b, vec3 n_c, 
                  vec3 norm,
-                 shared_ptr<material> m) 
-            : a(a), b(b), c(c), n_a(n_a), n_b(n_b), n_c(n_c), norm(norm), mat_ptr(m) {};
+                 shared_ptr<material> m,
+                 bool two_sided = false) 
+            : a(a), b(b), c(c), n_a(n_a), n_b(n_b), n_c(n_c), norm(norm), mat_ptr(m),
+              two_sided(two_sided) {};
 
         virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
@@ -27,9 +32,53 @@ class triangle : public hittable
         vec3 n_a, n_b, n_c;
         vec3 norm;
         shared_ptr<material> mat_ptr;
+        bool two_sided;     // also hit from behind, e.g. by rays leaving a glass mesh
+        int light = -1;     // its number in the scene's light_set, if it is one
 };
 
-bool triangle::bounding_box(double time0, double time1, aabb& output_box) const
+// A triangle whose vertices move linearly while the shutter is open, from a, b, c at its start
+// (ray time 0) to a1, b1, c1 at its end (time 1), as those of an animated mesh with motion blur.
+class moving_triangle : public triangle
+{
+    public:
+        moving_triangle(point3 a, point3 b, point3 c, vec3 n_a, vec3 n_b, vec3 n_c, vec3 norm,
+                        shared_ptr<material> m, bool two_sided = false)
+            : triangle(a, b, c, n_a, n_b, n_c, norm, m, two_sided),
+              a1(a), b1(b), c1(c), n_a1(n_a), n_b1(n_b), n_c1(n_c) {}
+
+        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+        virtual bool motion_boxes(aabb& start, aabb& end) const override;
+
+    public:
+        point3 a1, b1, c1;
+        vec3 n_a1, n_b1, n_c1;
+};
+
+// A triangle with texture coordinates at its vertices: hits get (u, v) interpolated from
+// them, and the footprint of the ray's cone in those units.
+class textured_triangle : public triangle
+{
+    public:
+        textured_triangle(point3 a, point3 b, point3 c, vec3 n_a, vec3 n_b, vec3 n_c, vec3 norm,
+                          shared_ptr<material> m, bool two_sided, std::array<double, 2> uv_a,
+                          std::array<double, 2> uv_b, std::array<double, 2> uv_c)
+            : triangle(a, b, c, n_a, n_b, n_c, norm, m, two_sided),
+              uv_a(uv_a), uv_b(uv_b), uv_c(uv_c) {
+            double area = cross(b - a, c - a).length();
+            double uv_area = fabs((uv_b[0] - uv_a[0]) * (uv_c[1] - uv_a[1])
+                                  - (uv_c[0] - uv_a[0]) * (uv_b[1] - uv_a[1]));
+            uv_per_unit = area > 0 ? sqrt(uv_area / area) : 0;
+        }
+
+        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+
+    public:
+        std::array<double, 2> uv_a, uv_b, uv_c;
+        double uv_per_unit;     // change of (u, v) over a unit of length, on average
+};
+
+aabb triangle_box(const point3& a, const point3& b, const point3& c)
 {
     double x_max = max(a.x(), max(b.x(), c.x()));
     double y_max = max(a.y(), max(b.y(), c.y()));
@@ -37,42 +86,67 @@ bool triangle::bounding_box(double time0, double time1, aabb& output_box) const
     double x_min = min(a.x(), min(b.x(), c.x()));
     double y_min = min(a.y(), min(b.y(), c.y()));
     double z_min = min(a.z(), min(b.z(), c.z()));
-    output_box = aabb(
+    return aabb(
         vec3(x_min - 0.001, y_min - 0.001, z_min - 0.001),
         vec3(x_max + 0.001, y_max + 0.001, z_max + 0.001));
+}
+
+bool triangle::bounding_box(double time0, double time1, aabb& output_box) const
+{
+    output_box = triangle_box(a, b, c);
     return true;
 }
 
 
-bool triangle::hit(const ray &r, double t_min, double t_max, hit_record &rec) const
+// Moller-Trumbore: whether r hits the triangle (a, b, c) between t_min and t_max, from the
+// front only unless two_sided, and if so where, at t and barycentrics u, v (of b and c).
+inline bool intersect_triangle(const ray &r, const point3& a, const point3& b, const point3& c,
+                               bool two_sided, double t_min, double t_max,
+                               double& t, double& u, double& v)
 {
-    // Moller-Trumbore
+    STAT_COUNT(triangle_tests);
+
     vec3 E1 = b - a;
     vec3 E2 = c - a;
     vec3 P = cross(r.direction(), E2);
     double det = dot(P, E1);
 
-    if(det < 0.0001)
+    if(two_sided ? fabs(det) < 0.0001 : det < 0.0001)
         return false;
 
     double inv = 1 / det;
     vec3 T = r.origin() - a;
-    double u = inv * dot(P, T);
+    u = inv * dot(P, T);
     if(u < 0 || u > 1)
         return false;
 
     vec3 Q = cross(T, E1);
-    double v = inv * dot(Q, r.direction());
+    v = inv * dot(Q, r.direction());
     if(v < 0 || u + v > 1)
         return false;
 
-    double t = inv * dot(Q, E2);
+    t = inv * dot(Q, E2);
 
     if(t < t_min || t > t_max)
         return false;
 
+    STAT_COUNT(triangle_hits);
+    return true;
+}
+
+
+bool triangle::hit(const ray &r, double t_min, double t_max, hit_record &rec) const
+{
+    double t, u, v;
+    if (!intersect_triangle(r, a, b, c, two_sided, t_min, t_max, t, u, v))
+        return false;
+
     rec.p = r.origin() + t * r.direction();
     rec.t = t;
+    rec.u = u;                  // barycentric, of b and c
+    rec.v = v;
+    rec.footprint = 0;
+    rec.light = light;
     rec.mat_ptr = mat_ptr;
 
     vec3 normal = normalize((1 - u - v) * n_a + u * n_b + v * n_c);
@@ -121,4 +195,54 @@ bool triangle::hit(const ray &r, double t_min, double t_max, hit_record &rec) co
 */
 }
 
+
+bool textured_triangle::hit(const ray &r, double t_min, double t_max, hit_record &rec) const
+{
+    if (!triangle::hit(r, t_min, t_max, rec))
+        return false;
+    double w = 1 - rec.u - rec.v;
+    double u = w * uv_a[0] + rec.u * uv_b[0] + rec.v * uv_c[0];
+    double v = w * uv_a[1] + rec.u * uv_b[1] + rec.v * uv_c[1];
+    rec.u = u;
+    rec.v = v;
+    rec.footprint = cone_footprint(r, rec.t, norm, uv_per_unit);
+    return true;
+}
+
+
+bool moving_triangle::hit(const ray &r, double t_min, double t_max, hit_record &rec) const
+{
+    // The vertices where the ray's time has them; the normals only for a hit.
+    double s = r.time();
+    double t, u, v;
+    if (!intersect_triangle(r, (1-s)*a + s*a1, (1-s)*b + s*b1, (1-s)*c + s*c1, two_sided,
+                            t_min, t_max, t, u, v))
+        return false;
+
+    rec.p = r.origin() + t * r.direction();
+    rec.t = t;
+    rec.u = u;
+    rec.v = v;
+    rec.footprint = 0;
+    rec.light = light;
+    rec.mat_ptr = mat_ptr;
+
+    vec3 n0 = (1-s)*n_a + s*n_a1, n1 = (1-s)*n_b + s*n_b1, n2 = (1-s)*n_c + s*n_c1;
+    rec.set_face_normal(r, normalize((1 - u - v) * n0 + u * n1 + v * n2));
+    return true;
+}
+
+bool moving_triangle::bounding_box(double time0, double time1, aabb& output_box) const
+{
+    output_box = surrounding_box(triangle_box(a, b, c), triangle_box(a1, b1, c1));
+    return true;
+}
+
+bool moving_triangle::motion_boxes(aabb& start, aabb& end) const
+{
+    start = triangle_box(a, b, c);
+    end = triangle_box(a1, b1, c1);
+    return true;
+}
+
 #endif
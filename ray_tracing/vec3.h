@@ -126,24 +126,57 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
-inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
+// The mappings below turn uniform numbers in [0,1) directly into points, instead of looping
+// until a random point is accepted, so stratified samples stay stratified after the mapping.
+
+inline vec3 random_in_unit_disk(double u1, double u2) {
+    // Shirley-Chiu concentric mapping from the square to the disk.
+    auto a = 2*u1 - 1;
+    auto b = 2*u2 - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    double r, theta;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        theta = (pi/4) * (b/a);
+    } else {
+        r = b;
+        theta = pi/2 - (pi/4) * (a/b);
     }
+    return vec3(r*cos(theta), r*sin(theta), 0);
+}
+
+inline vec3 random_unit_vector(double u1, double u2) {
+    // Uniform direction on the unit sphere.
+    auto z = 1 - 2*u1;
+    auto r = sqrt(fmax(0.0, 1 - z*z));
+    auto phi = 2*pi*u2;
+    return vec3(r*cos(phi), r*sin(phi), z);
+}
+
+inline vec3 random_in_unit_sphere(double u1, double u2, double u3) {
+    return std::cbrt(u3) * random_unit_vector(u1, u2);
+}
+
+inline vec3 random_cosine_direction(double u1, double u2) {
+    // Cosine-weighted direction around +z.
+    auto z = sqrt(1 - u2);
+    auto phi = 2*pi*u1;
+    auto r = sqrt(u2);
+    return vec3(r*cos(phi), r*sin(phi), z);
+}
+
+inline vec3 random_in_unit_disk() {
+    return random_in_unit_disk(random_double(), random_double());
 }
 
 inline vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1,1);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
+    return random_in_unit_sphere(random_double(), random_double(), random_double());
 }
 
 inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+    return random_unit_vector(random_double(), random_double());
 }
 
 inline vec3 random_in_hemisphere(const vec3& normal) {
@@ -0,0 +1,221 @@
+#ifndef VISIBILITY_H
+#define VISIBILITY_H
+
+#include "rtweekend.h"
+
+#include "aarect.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "triangle.h"
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+
+// Visibility buffer for the primary rays of a pinhole camera. The scene's triangles (and rects,
+// as two triangles each) are projected once; every pass then rasterizes them per tile at that
+// pass's jittered sample position of each pixel, keeping the nearest primitive. Path tracing
+// starts by intersecting the ray with that one primitive instead of traversing the BVH.
+//
+// Coverage is tested a little conservatively, so a sample on a shared edge is never lost to a
+// crack; when the nearest covering primitive turns out to miss the ray, the caller traces the
+// ray as usual. Uncovered pixels are traced as usual too.
+class visibility_buffer {
+    public:
+        // Projects the primitives of world. Returns false, with the reason, when the primary
+        // hits can't be rasterized: a lens, geometry behind the eye, or primitives other than
+        // triangles and rects (spheres, moving or instanced objects, media).
+        bool build(const hittable& world, const camera& view, int width, int height,
+                   std::string& reason);
+
+        // Indices of the triangles whose samples can land in pixels [x0, x1) x [y0, y1).
+        std::vector<int> overlapping(int x0, int y0, int x1, int y1) const;
+
+        // Fills nearest[k] for the pixels of the tile, k = (j - y0) * (x1 - x0) + (i - x0),
+        // given the sample offsets (du, dv) of each pixel: the index of the nearest covering
+        // triangle, -1 where nothing is covered.
+        void rasterize(const std::vector<int>& triangles, int x0, int y0, int x1, int y1,
+                       const std::vector<double>& du, const std::vector<double>& dv,
+                       std::vector<int>& nearest, std::vector<double>& depth) const;
+
+        // The primitive a triangle came from, and the id of the instance_id it is in (-1 for
+        // none), which a hit on the primitive alone doesn't set.
+        const hittable* primitive(int k) const { return triangles[k].primitive; }
+        int instance(int k) const { return triangles[k].instance; }
+
+    private:
+        struct screen_triangle {
+            double x[3], y[3];          // sample coordinates: pixel i spans [i, i+1)
+            double area;                // twice the signed area
+            point3 a;                   // plane, for the depth along each sample's ray
+            vec3 n;
+            const hittable* primitive;
+            int instance;
+        };
+
+        bool add(const hittable* object, std::string& reason);
+        bool add_triangle(const point3& a, const point3& b, const point3& c, bool two_sided,
+                          const hittable* primitive, std::string& reason);
+
+        camera cam;
+        int current_instance = -1;      // while adding the contents of an instance_id
+        int width = 0;
+        int height = 0;
+        std::vector<screen_triangle> triangles;
+};
+
+
+bool visibility_buffer::build(const hittable& world, const camera& view, int w, int h,
+                              std::string& reason) {
+    cam = view;
+    width = w;
+    height = h;
+    triangles.clear();
+    if (!cam.pinhole()) {
+        reason = "the camera has a lens";
+        return false;
+    }
+    return add(&world, reason);
+}
+
+
+bool visibility_buffer::add(const hittable* object, std::string& reason) {
+    if (auto list = dynamic_cast<const hittable_list*>(object)) {
+        for (const auto& child : list->objects)
+            if (!add(child.get(), reason))
+                return false;
+        return true;
+    }
+    if (auto node = dynamic_cast<const bvh_node*>(object))
+        return add(node->left.get(), reason)
+            && (node->right == node->left || add(node->right.get(), reason));
+    if (auto tagged = dynamic_cast<const instance_id*>(object)) {
+        int outer = current_instance;
+        current_instance = tagged->id;
+        bool added = add(tagged->ptr.get(), reason);
+        current_instance = outer;
+        return added;
+    }
+    if (dynamic_cast<const moving_triangle*>(object)) {
+        reason = "the scene has moving triangles";
+        return false;
+    }
+    if (auto tri = dynamic_cast<const triangle*>(object))
+        return add_triangle(tri->a, tri->b, tri->c, tri->two_sided, tri, reason);
+
+    // Rects are hit from both sides.
+    point3 corner[4];
+    if (auto rect = dynamic_cast<const xy_rect*>(object)) {
+        corner[0] = point3(rect->x0, rect->y0, rect->k);
+        corner[1] = point3(rect->x1, rect->y0, rect->k);
+        corner[2] = point3(rect->x1, rect->y1, rect->k);
+        corner[3] = point3(rect->x0, rect->y1, rect->k);
+    } else if (auto rect = dynamic_cast<const xz_rect*>(object)) {
+        corner[0] = point3(rect->x0, rect->k, rect->z0);
+        corner[1] = point3(rect->x1, rect->k, rect->z0);
+        corner[2] = point3(rect->x1, rect->k, rect->z1);
+        corner[3] = point3(rect->x0, rect->k, rect->z1);
+    } else if (auto rect = dynamic_cast<const yz_rect*>(object)) {
+        corner[0] = point3(rect->k, rect->y0, rect->z0);
+        corner[1] = point3(rect->k, rect->y1, rect->z0);
+        corner[2] = point3(rect->k, rect->y1, rect->z1);
+        corner[3] = point3(rect->k, rect->y0, rect->z1);
+    } else {
+        reason = "the scene has primitives other than triangles and rects";
+        return false;
+    }
+    return add_triangle(corner[0], corner[1], corner[2], true, object, reason)
+        && add_triangle(corner[0], corner[2], corner[3], true, object, reason);
+}
+
+
+bool visibility_buffer::add_triangle(const point3& a, const point3& b, const point3& c,
+                                     bool two_sided, const hittable* primitive,
+                                     std::string& reason) {
+    vec3 n = cross(b - a, c - a);
+    // triangle::hit only accepts rays against the winding normal.
+    if (!two_sided && dot(a - cam.eye(), n) >= 0)
+        return true;
+
+    screen_triangle t;
+    const point3* vertex[3] = {&a, &b, &c};
+    for (int k = 0; k < 3; k++) {
+        double s, v;
+        if (!cam.project(*vertex[k], s, v)) {
+            reason = "geometry is behind the eye";
+            return false;
+        }
+        t.x[k] = s * (width - 1);
+        t.y[k] = v * (height - 1);
+    }
+    t.area = (t.x[1] - t.x[0]) * (t.y[2] - t.y[0]) - (t.x[2] - t.x[0]) * (t.y[1] - t.y[0]);
+    if (t.area == 0)
+        return true;                // seen edge-on
+    t.a = a;
+    t.n = n;
+    t.primitive = primitive;
+    t.instance = current_instance;
+    triangles.push_back(t);
+    return true;
+}
+
+
+std::vector<int> visibility_buffer::overlapping(int x0, int y0, int x1, int y1) const {
+    std::vector<int> result;
+    for (int k = 0; k < static_cast<int>(triangles.size()); k++) {
+        const auto& t = triangles[k];
+        // The samples of pixel i lie in [i, i+1).
+        if (std::fmax(t.x[0], std::fmax(t.x[1], t.x[2])) >= x0
+            && std::fmin(t.x[0], std::fmin(t.x[1], t.x[2])) < x1
+            && std::fmax(t.y[0], std::fmax(t.y[1], t.y[2])) >= y0
+            && std::fmin(t.y[0], std::fmin(t.y[1], t.y[2])) < y1)
+            result.push_back(k);
+    }
+    return result;
+}
+
+
+void visibility_buffer::rasterize(const std::vector<int>& indices, int x0, int y0, int x1, int y1,
+                                  const std::vector<double>& du, const std::vector<double>& dv,
+                                  std::vector<int>& nearest,
+                                  std::vector<double>& depth) const {
+    int tile_width = x1 - x0;
+    nearest.assign(tile_width * (y1 - y0), -1);
+    depth.assign(tile_width * (y1 - y0), infinity);
+    point3 eye = cam.eye();
+
+    for (int index : indices) {
+        const auto& t = triangles[index];
+        int i0 = std::max(x0, static_cast<int>(std::floor(std::fmin(t.x[0], std::fmin(t.x[1], t.x[2])))));
+        int i1 = std::min(x1 - 1, static_cast<int>(std::floor(std::fmax(t.x[0], std::fmax(t.x[1], t.x[2])))));
+        int j0 = std::max(y0, static_cast<int>(std::floor(std::fmin(t.y[0], std::fmin(t.y[1], t.y[2])))));
+        int j1 = std::min(y1 - 1, static_cast<int>(std::floor(std::fmax(t.y[0], std::fmax(t.y[1], t.y[2])))));
+        double tolerance = -1e-7 * std::fabs(t.area);
+        double sign = t.area > 0 ? 1 : -1;
+        double plane = dot(t.a - eye, t.n);
+
+        for (int j = j0; j <= j1; j++) {
+            for (int i = i0; i <= i1; i++) {
+                int k = (j - y0) * tile_width + (i - x0);
+                double sx = i + du[k];
+                double sy = j + dv[k];
+                double w0 = sign * ((t.x[1] - sx) * (t.y[2] - sy) - (t.x[2] - sx) * (t.y[1] - sy));
+                double w1 = sign * ((t.x[2] - sx) * (t.y[0] - sy) - (t.x[0] - sx) * (t.y[2] - sy));
+                double w2 = sign * ((t.x[0] - sx) * (t.y[1] - sy) - (t.x[1] - sx) * (t.y[0] - sy));
+                if (w0 < tolerance || w1 < tolerance || w2 < tolerance)
+                    continue;
+                vec3 d = cam.direction(sx / (width - 1), sy / (height - 1));
+                double distance = plane / dot(d, t.n);
+                if (distance > 0 && distance < depth[k]) {
+                    depth[k] = distance;
+                    nearest[k] = index;
+                }
+            }
+        }
+    }
+}
+
+
+#endif
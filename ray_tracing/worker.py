@@ -0,0 +1,165 @@
+"""Render worker for distributed renders (see coordinator.py).
+
+Listens on a TCP port and renders one tile per request with a.out. Every message, in both
+directions, is a JSON header followed by a binary payload, each prefixed by its length:
+
+    uint32 header length, header (UTF-8 JSON), uint64 payload length, payload
+
+A request header holds the shared token and the job: the teapot instances, each the names of
+its two matrix files and its material number, the contents of those files by name, the tile
+[x0, y0, x1, y1], samples per pixel, sampler and seed. The worker builds a.out's command line
+from these fields alone, so a client can't pass it other options. The reply header repeats the
+tile and carries the scene hash; its payload is the tile's float accumulation (3 doubles per
+pixel) followed by its sample counts (one int32 per pixel), rows bottom to top. A request with
+the wrong token gets an error and the connection is closed.
+
+The token is given by --token or the RT_WORKER_TOKEN environment variable; the worker won't
+start without one. It listens on 127.0.0.1 unless --host says otherwise.
+
+usage: python3 worker.py [--host HOST] [--port PORT] [--binary ./a.out] [--token TOKEN]
+"""
+import argparse
+import hmac
+import json
+import os
+import socket
+import socketserver
+import struct
+import subprocess
+import tempfile
+
+from checkpoint import Checkpoint
+
+
+def send_message(sock, header, payload=b''):
+    data = json.dumps(header).encode()
+    sock.sendall(struct.pack('<I', len(data)) + data + struct.pack('<Q', len(payload)))
+    sock.sendall(payload)
+
+
+def recv_exact(sock, size):
+    chunks = []
+    while size > 0:
+        chunk = sock.recv(min(size, 1 << 20))
+        if not chunk:
+            raise ConnectionError("connection closed")
+        chunks.append(chunk)
+        size -= len(chunk)
+    return b''.join(chunks)
+
+
+def recv_message(sock):
+    header_length, = struct.unpack('<I', recv_exact(sock, 4))
+    header = json.loads(recv_exact(sock, header_length))
+    payload_length, = struct.unpack('<Q', recv_exact(sock, 8))
+    return header, recv_exact(sock, payload_length)
+
+
+SAMPLERS = ('independent', 'sobol', 'bluenoise')
+MATERIALS = range(4)            # metal, glass, diffuse, light
+
+
+def integer(value, low, high, what):
+    if type(value) is not int or not low <= value <= high:
+        raise ValueError(f"bad {what}: {value!r}")
+    return value
+
+
+def scene_arguments(job, directory):
+    """a.out's scene arguments for job, its matrix files written to directory under names of
+    our own; ValueError if a field is missing or out of range."""
+    instances = job.get('instances')
+    files = job.get('files')
+    if not isinstance(instances, list) or not instances or not isinstance(files, dict):
+        raise ValueError("the job has no instances")
+    args = [str(len(instances))]
+    for i, instance in enumerate(instances):
+        if not isinstance(instance, dict):
+            raise ValueError(f"bad instance {i}")
+        for kind in ('position', 'normal'):
+            text = files.get(instance.get(kind))
+            if not isinstance(text, str):
+                raise ValueError(f"instance {i} has no {kind} matrix file")
+            path = os.path.join(directory, f"{kind}_{i}.txt")
+            with open(path, 'w') as f:
+                f.write(text)
+            args.append(path)
+        args.append(str(integer(instance.get('material'), MATERIALS.start, MATERIALS.stop - 1,
+                                f"material of instance {i}")))
+    return args
+
+
+def render_tile(binary, job):
+    tile = job.get('tile')
+    if not isinstance(tile, list) or len(tile) != 4:
+        raise ValueError(f"bad tile: {tile!r}")
+    x0, y0, x1, y1 = (integer(v, 0, 1 << 16, "tile") for v in tile)
+    spp = integer(job.get('spp'), 1, 1 << 20, "samples per pixel")
+    seed = integer(job.get('seed'), 0, (1 << 32) - 1, "seed")
+    if job.get('sampler') not in SAMPLERS:
+        raise ValueError(f"bad sampler: {job.get('sampler')!r}")
+
+    with tempfile.TemporaryDirectory() as tmp:
+        checkpoint_file = os.path.join(tmp, 'tile.ckpt')
+        command = [binary, '-s', job['sampler'], '-x', str(seed),
+                   '-w', f"{x0},{y0},{x1},{y1}", '-k', checkpoint_file,
+                   str(spp)] + scene_arguments(job, tmp)
+        result = subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        if result.returncode != 0:
+            raise RuntimeError(result.stderr.decode(errors='replace'))
+        with open(checkpoint_file, 'rb') as f:
+            checkpoint = Checkpoint.parse(f.read())
+
+    accum, samples = checkpoint.tile(x0, y0, x1, y1)
+    header = {'job': job.get('job'), 'tile': tile, 'scene_hash': checkpoint.scene_hash,
+              'width': checkpoint.width, 'height': checkpoint.height,
+              'sampler': checkpoint.sampler, 'seed': checkpoint.seed,
+              'ranges': checkpoint.ranges}
+    return header, accum + samples
+
+
+class WorkerHandler(socketserver.BaseRequestHandler):
+    def handle(self):
+        while True:
+            try:
+                job, _ = recv_message(self.request)
+            except (ConnectionError, struct.error):
+                return
+            token = job.get('token')
+            if not isinstance(token, str) or not hmac.compare_digest(token.encode(),
+                                                                     self.server.token.encode()):
+                send_message(self.request, {'job': job.get('job'), 'error': "bad token"})
+                return
+            try:
+                header, payload = render_tile(self.server.binary, job)
+            except Exception as error:
+                header, payload = {'job': job.get('job'), 'error': str(error)}, b''
+            send_message(self.request, header, payload)
+
+
+class WorkerServer(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=5100)
+    parser.add_argument('--binary', default='./a.out')
+    parser.add_argument('--token', default=os.environ.get('RT_WORKER_TOKEN'),
+                        help="shared with the coordinator (default $RT_WORKER_TOKEN)")
+    args = parser.parse_args()
+    if not args.token:
+        parser.error("no token: give --token or set RT_WORKER_TOKEN")
+
+    with WorkerServer((args.host, args.port), WorkerHandler) as server:
+        server.binary = os.path.abspath(args.binary)
+        server.token = args.token
+        print(f"worker listening on {args.host}:{server.server_address[1]}", flush=True)
+        server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()